@@ -0,0 +1,229 @@
+#include "animation.hpp"
+#include "cathode-order.hpp"
+
+#include <math.h>
+#include <string.h>
+
+
+Animation::Animation() : key_count(0), frame_count(0), length_ms(0), loop_ms(0),
+                         playing(false), started(0), cycle(0), cursor(0) {
+  memset(initial, -1, sizeof(initial));
+}
+
+void Animation::clear(const int8_t* _initial) {
+  memcpy(initial, _initial, sizeof(initial));
+  key_count = 0;
+  frame_count = 0;
+  length_ms = 0;
+  loop_ms = 0;
+  playing = false;
+}
+
+bool Animation::add_key(uint8_t tube, uint16_t at_ms, int8_t digit) {
+  if(tube >= ANIMATION_TUBES || key_count >= ANIMATION_MAX_KEYS) {
+    return false;
+  }
+
+  // Insertion keeps keys ordered by time, and by insertion within a time
+  uint16_t pos = key_count;
+  while(pos > 0 && keys[pos - 1].at_ms > at_ms) {
+    keys[pos] = keys[pos - 1];
+    pos--;
+  }
+  keys[pos].at_ms = at_ms;
+  keys[pos].tube = tube;
+  keys[pos].digit = digit;
+  key_count++;
+  return true;
+}
+
+bool Animation::add_roll(uint8_t tube, int8_t from, uint8_t steps, uint16_t start_ms, uint16_t duration_ms, easing_t easing, bool by_depth) {
+  uint8_t pos = from < 0 ? 0 : (by_depth ? cathode::DEPTH[from] : from);
+  for(uint8_t step = 1; step <= steps; step++) {
+    pos = (pos + 1) % 10;
+    uint16_t at = start_ms + (uint16_t)(duration_ms * ease_time(easing, (float)step / steps));
+    if(!add_key(tube, at, by_depth ? cathode::STACK[pos] : pos)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Animation::compile(uint16_t _length_ms) {
+  frame_count = 0;
+  length_ms = _length_ms;
+
+  frames[0].at_ms = 0;
+  memcpy(frames[0].digits, initial, sizeof(initial));
+  frame_count = 1;
+
+  for(uint16_t i = 0; i < key_count; i++) {
+    frame_t* frame = &frames[frame_count - 1];
+    if(keys[i].at_ms != frame->at_ms) {
+      if(frame_count >= ANIMATION_MAX_FRAMES) {
+        return false;
+      }
+      frames[frame_count] = *frame;
+      frame = &frames[frame_count++];
+      frame->at_ms = keys[i].at_ms;
+    }
+    frame->digits[keys[i].tube] = keys[i].digit;
+  }
+
+  if(length_ms <= frames[frame_count - 1].at_ms) {
+    length_ms = frames[frame_count - 1].at_ms + 1;
+  }
+  return true;
+}
+
+
+void Animation::start(int64_t now) {
+  started = now;
+  cycle = 0;
+  cursor = 0;
+  playing = frame_count > 0;
+}
+
+bool Animation::frame_at(int64_t now, int8_t* digits) {
+  if(!playing) {
+    return false;
+  }
+
+  uint32_t elapsed_ms = (uint32_t)((now - started) / 1000);
+  uint32_t total_ms = loop_ms ? loop_ms : length_ms;
+  if(total_ms != ANIMATION_LOOP_FOREVER && elapsed_ms >= total_ms) {
+    playing = false;
+    return false;
+  }
+
+  uint32_t this_cycle = elapsed_ms / length_ms;
+  uint16_t at_ms = elapsed_ms % length_ms;
+  if(this_cycle != cycle) {
+    cycle = this_cycle;
+    cursor = 0;
+  }
+
+  // Frames only ever move forward within a cycle, so this is usually a
+  // single comparison
+  while(cursor + 1 < frame_count && frames[cursor + 1].at_ms <= at_ms) {
+    cursor++;
+  }
+  memcpy(digits, frames[cursor].digits, ANIMATION_TUBES);
+  return true;
+}
+
+float Animation::ease_time(easing_t easing, float progress) {
+  // Inverse of the easing curve: when the display has moved `progress` of
+  // the way, how much of the duration has passed
+  switch(easing) {
+    case EASE_IN:
+      return sqrtf(progress);
+    case EASE_OUT:
+      return 1.0f - sqrtf(1.0f - progress);
+    case EASE_IN_OUT:
+      return progress < 0.5f ? sqrtf(progress / 2.0f) : 1.0f - sqrtf((1.0f - progress) / 2.0f);
+    case EASE_LINEAR:
+    default:
+      return progress;
+  }
+}
+
+
+void animation_slot_roll(Animation& anim, const int8_t* from, const int8_t* to, uint16_t duration_ms) {
+  anim.clear(from);
+
+  // Reels stop left to right, each spinning at least as long as the one
+  // before it and slowing as it lands on its target
+  for(uint8_t tube = 0; tube < ANIMATION_TUBES; tube++) {
+    int8_t start = from[tube] < 0 ? 0 : from[tube];
+    int8_t target = to[tube] < 0 ? 0 : to[tube];
+    uint8_t steps = 10 * (tube / 2 + 1) + (target - start + 10) % 10;
+    uint16_t stop_ms = duration_ms / 2 + (duration_ms / 2) * (tube + 1) / ANIMATION_TUBES;
+    anim.add_roll(tube, start, steps, 0, stop_ms, EASE_OUT);
+    if(to[tube] < 0) {
+      anim.add_key(tube, stop_ms, -1);
+    }
+  }
+  anim.compile(duration_ms);
+}
+
+void animation_scroll(Animation& anim, const int8_t* from, const int8_t* to, uint16_t step_ms) {
+  anim.clear(from);
+
+  // The old digits slide out to the left, a blank gap follows, then the new
+  // digits slide in behind it
+  int8_t tape[ANIMATION_TUBES * 2 + 1];
+  memcpy(tape, from, ANIMATION_TUBES);
+  tape[ANIMATION_TUBES] = -1;
+  memcpy(tape + ANIMATION_TUBES + 1, to, ANIMATION_TUBES);
+
+  for(uint8_t step = 1; step <= ANIMATION_TUBES + 1; step++) {
+    for(uint8_t tube = 0; tube < ANIMATION_TUBES; tube++) {
+      anim.add_key(tube, step * step_ms, tape[tube + step]);
+    }
+  }
+  anim.compile((ANIMATION_TUBES + 2) * step_ms);
+}
+
+void animation_wipe(Animation& anim, const int8_t* from, const int8_t* to, uint16_t step_ms) {
+  anim.clear(from);
+
+  for(uint8_t tube = 0; tube < ANIMATION_TUBES; tube++) {
+    anim.add_key(tube, tube * step_ms, -1);
+    anim.add_key(tube, (tube + 1) * step_ms, to[tube]);
+  }
+  anim.compile((ANIMATION_TUBES + 1) * step_ms);
+}
+
+void animation_depth_sweep(Animation& anim, const int8_t* from, const int8_t* to, uint16_t step_ms) {
+  anim.clear(from);
+
+  // Light moves from the front of the stack to the back and forward again,
+  // each tube a step behind its left neighbour, then settles on the target
+  uint16_t end_ms = 0;
+  for(uint8_t tube = 0; tube < ANIMATION_TUBES; tube++) {
+    uint16_t at_ms = tube * step_ms;
+    for(uint8_t step = 0; step < 19; step++) {
+      uint8_t depth = step < 10 ? step : 18 - step;
+      anim.add_key(tube, at_ms, cathode::STACK[depth]);
+      at_ms += step_ms;
+    }
+    anim.add_key(tube, at_ms, to[tube]);
+    end_ms = at_ms;
+  }
+  anim.compile(end_ms + step_ms);
+}
+
+void animation_scan(Animation& anim, uint16_t step_ms) {
+  const int8_t blank[ANIMATION_TUBES] = {-1, -1, -1, -1, -1, -1};
+  anim.clear(blank);
+
+  // A single lit 1 bouncing between the end tubes
+  const uint8_t path[] = {0, 1, 2, 3, 4, 5, 4, 3, 2, 1};
+  for(uint8_t step = 0; step < sizeof(path); step++) {
+    if(step > 0) {
+      anim.add_key(path[step - 1], step * step_ms, -1);
+    }
+    anim.add_key(path[step], step * step_ms, 1);
+  }
+  anim.compile(sizeof(path) * step_ms);
+  anim.set_loop(ANIMATION_LOOP_FOREVER);
+}
+
+void animation_cathode_cycle(Animation& anim, uint16_t step_ms, uint32_t total_ms) {
+  int8_t initial[ANIMATION_TUBES];
+  for(uint8_t tube = 0; tube < ANIMATION_TUBES; tube++) {
+    initial[tube] = cathode::STACK[tube];
+  }
+  anim.clear(initial);
+
+  // Every tube steps through all ten cathodes in stack order, offset from
+  // its neighbours, so neighbouring cathodes are lit one after another
+  for(uint8_t step = 1; step < 10; step++) {
+    for(uint8_t tube = 0; tube < ANIMATION_TUBES; tube++) {
+      anim.add_key(tube, step * step_ms, cathode::STACK[(step + tube) % 10]);
+    }
+  }
+  anim.compile(10 * step_ms);
+  anim.set_loop(total_ms);
+}
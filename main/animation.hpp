@@ -0,0 +1,89 @@
+#ifndef ANIMATION_HPP
+#define ANIMATION_HPP
+
+#include <stdint.h>
+
+#define ANIMATION_TUBES       6
+#define ANIMATION_MAX_KEYS    256
+#define ANIMATION_MAX_FRAMES  256
+#define ANIMATION_LOOP_FOREVER 0xFFFFFFFF
+
+// Digit value that shows whatever the tube would show without the animation
+#define ANIMATION_PASSTHROUGH  -2
+
+
+typedef enum {
+  EASE_LINEAR,
+  EASE_IN,
+  EASE_OUT,
+  EASE_IN_OUT
+} easing_t;
+
+
+// Keyframe animation for the six tubes. Effects are described as per-tube
+// tracks of timed digits, then compiled once into a flat array of frames,
+// each the full display state from its start time on. Playback only walks
+// that array against the monotonic clock, so it costs nothing per frame
+// and is independent of how often or how late the display task ticks.
+// A digit of -1 blanks the tube, ANIMATION_PASSTHROUGH leaves it to the
+// caller.
+class Animation {
+public:
+  Animation();
+  ~Animation() {};
+
+  // Building
+  void clear(const int8_t* initial);
+  bool add_key(uint8_t tube, uint16_t at_ms, int8_t digit);
+  // Count a tube up through `steps` digits, spacing the changes by easing;
+  // by depth steps through the physical cathode stack instead of the values
+  bool add_roll(uint8_t tube, int8_t from, uint8_t steps, uint16_t start_ms, uint16_t duration_ms, easing_t easing, bool by_depth = false);
+  bool compile(uint16_t length_ms);
+  void set_loop(uint32_t total_ms) { loop_ms = total_ms; };
+
+  // Playback
+  void start(int64_t now);
+  void stop() { playing = false; };
+  bool frame_at(int64_t now, int8_t* digits);
+  bool is_playing() { return playing; };
+
+private:
+  typedef struct {
+    uint16_t at_ms;
+    uint8_t tube;
+    int8_t digit;
+  } key_t;
+
+  typedef struct {
+    uint16_t at_ms;
+    int8_t digits[ANIMATION_TUBES];
+  } frame_t;
+
+  int8_t initial[ANIMATION_TUBES];
+  key_t keys[ANIMATION_MAX_KEYS];
+  uint16_t key_count;
+
+  frame_t frames[ANIMATION_MAX_FRAMES];
+  uint16_t frame_count;
+  uint16_t length_ms;
+  uint32_t loop_ms;
+
+  bool playing;
+  int64_t started;
+  uint32_t cycle;
+  uint16_t cursor;
+
+  static float ease_time(easing_t easing, float progress);
+};
+
+
+// Effect library; each builds a compiled animation from one display state
+// to another
+void animation_slot_roll(Animation& anim, const int8_t* from, const int8_t* to, uint16_t duration_ms);
+void animation_scroll(Animation& anim, const int8_t* from, const int8_t* to, uint16_t step_ms);
+void animation_wipe(Animation& anim, const int8_t* from, const int8_t* to, uint16_t step_ms);
+void animation_depth_sweep(Animation& anim, const int8_t* from, const int8_t* to, uint16_t step_ms);
+void animation_scan(Animation& anim, uint16_t step_ms);
+void animation_cathode_cycle(Animation& anim, uint16_t step_ms, uint32_t total_ms);
+
+#endif // ANIMATION_HPP
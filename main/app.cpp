@@ -1 +1,407 @@
 #include "app.hpp"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdio.h>
+#include <string.h>
+
+
+static const char* status_text(int status) {
+  switch(status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 503: return "Service Unavailable";
+    default: return "Error";
+  }
+}
+
+
+App::App() : task_handle(NULL), wake_conn(NULL), wake_sock(-1), wake_pending(false),
+  route_count(0), stream_route_count(0), websocket_count(0) {
+  for(http_slot_t& slot : slots) {
+    slot.nc = NULL;
+    slot.tx = NULL;
+    slot.tx_left = 0;
+  }
+}
+
+void App::init() {
+  mg_mgr_init(&mgr, this);
+
+  // Other tasks cut the network task's sleep short with a datagram to this
+  // socket. mg_broadcast() would too, but it waits for the network task to
+  // answer, which the display task can't afford.
+  wake_conn = mg_bind(&mgr, "udp://127.0.0.1:0", &App::wake_handler);
+  union socket_address sa;
+  socklen_t len = sizeof(sa.sin);
+  if(wake_conn == NULL || getsockname(wake_conn->sock, &sa.sa, &len) != 0) {
+    ESP_LOGE("App", "No wake socket, pollers only run on their deadlines");
+    return;
+  }
+  wake_conn->user_data = this;
+
+  wake_sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if(wake_sock >= 0 && connect(wake_sock, &sa.sa, len) != 0) {
+    closesocket(wake_sock);
+    wake_sock = -1;
+  }
+}
+
+void App::wake() {
+  // One datagram in flight is enough however many tasks ask
+  if(wake_sock >= 0 && !wake_pending.exchange(true, std::memory_order_acq_rel)) {
+    send(wake_sock, "", 1, MSG_DONTWAIT);
+  }
+}
+
+bool App::listen_http(const char* port) {
+  struct mg_connection* nc = mg_bind(&mgr, port, &App::http_handler);
+  if(nc == NULL) {
+    ESP_LOGE("App", "Failed to bind HTTP on %s", port);
+    return false;
+  }
+  nc->user_data = this;
+  mg_set_protocol_http_websocket(nc);
+
+  ESP_LOGI("App", "HTTP listening on %s", port);
+  return true;
+}
+
+void App::add_route(const std::string& uri, route_t route) {
+  if(route_count >= APP_MAX_ROUTES) {
+    ESP_LOGE("App", "No room for route %s", uri.c_str());
+    return;
+  }
+  routes[route_count].uri = uri;
+  routes[route_count].route = route;
+  route_count++;
+}
+
+void App::add_json_route(const std::string& uri, json_route_t route) {
+  add_route(uri, [this, route](struct mg_connection* nc, struct http_message* hm) mutable {
+    send_json(nc, route, hm);
+  });
+}
+
+void App::add_stream_route(const std::string& uri, stream_route_t route) {
+  if(stream_route_count >= APP_MAX_STREAM_ROUTES) {
+    ESP_LOGE("App", "No room for stream route %s", uri.c_str());
+    return;
+  }
+  stream_routes[stream_route_count].uri = uri;
+  stream_routes[stream_route_count].route = route;
+  stream_route_count++;
+}
+
+App::websocket_t* App::add_websocket(const std::string& uri, uint32_t max_clients, std::function<void(struct mg_connection*)> on_open) {
+  if(websocket_count >= APP_MAX_WEBSOCKETS) {
+    ESP_LOGE("App", "No room for WebSocket %s", uri.c_str());
+    return NULL;
+  }
+  websockets[websocket_count].uri = uri;
+  websocket_t& ws = websockets[websocket_count++].ws;
+  ws.on_open = on_open;
+  ws.clients = 0;
+  ws.max_clients = max_clients;
+  return &ws;
+}
+
+uint32_t App::broadcast(websocket_t* ws, const void* data, size_t len, size_t max_backlog) {
+  uint32_t skipped = 0;
+  for(struct mg_connection* c = mg_next(&mgr, NULL); c != NULL; c = mg_next(&mgr, c)) {
+    if(!(c->flags & MG_F_IS_WEBSOCKET) || c->priv_2 != ws) {
+      continue;
+    }
+    if(c->send_mbuf.len + len > max_backlog) {
+      skipped++;
+      continue;
+    }
+    mg_send_websocket_frame(c, WEBSOCKET_OP_BINARY, data, len);
+  }
+  return skipped;
+}
+
+void App::send_mapped(struct mg_connection* nc, const char* head, size_t head_len, const char* body, size_t len) {
+  http_slot_t* slot = claim_slot(nc);
+  if(slot == NULL || slot->tx_left > 0 || slot->source) {
+    mg_http_send_error(nc, 503, NULL);
+    return;
+  }
+
+  mg_send(nc, head, head_len);
+  slot->tx = body;
+  slot->tx_left = len;
+  refill(nc);
+}
+
+void App::send_chunked(struct mg_connection* nc, const char* head, size_t head_len, chunk_source_t source) {
+  http_slot_t* slot = claim_slot(nc);
+  if(slot == NULL || slot->tx_left > 0 || slot->source) {
+    mg_http_send_error(nc, 503, NULL);
+    return;
+  }
+
+  mg_send(nc, head, head_len);
+  slot->source = source;
+  refill(nc);
+}
+
+void App::refill(struct mg_connection* nc) {
+  http_slot_t* slot = (http_slot_t*)nc->priv_2;
+  if(slot == NULL || nc->send_mbuf.len >= APP_TX_CHUNK) {
+    return;
+  }
+
+  if(slot->source) {
+    // The send buffer stays under APP_TX_CHUNK plus one slot buffer
+    while(nc->send_mbuf.len < APP_TX_CHUNK) {
+      size_t len = slot->source(slot->buf, sizeof(slot->buf));
+      mg_send_http_chunk(nc, slot->buf, len);
+      if(len == 0) {
+        slot->source = nullptr;
+        break;
+      }
+    }
+  } else if(slot->tx_left > 0) {
+    size_t n = APP_TX_CHUNK - nc->send_mbuf.len;
+    if(n > slot->tx_left) {
+      n = slot->tx_left;
+    }
+    mg_send(nc, slot->tx, n);
+    slot->tx += n;
+    slot->tx_left -= n;
+  }
+
+  // The rest drains from the send buffer on its own
+  release_idle_slot(nc);
+}
+
+void App::start() {
+  xTaskCreatePinnedToCore(&App::task, "app_task", 8192, this, 5, &task_handle, 0);
+}
+
+void App::task(void* ctx) {
+  App* app = (App*)ctx;
+
+  ESP_LOGI("App", "Network task started");
+  int64_t next = 0;
+  while(1) {
+    int64_t now = esp_timer_get_time();
+    mg_mgr_poll(&app->mgr, next <= now ? 0 : (int)((next - now + 999) / 1000));
+
+    now = esp_timer_get_time();
+    next = now + APP_POLL_MAX_US;
+    for(auto& poller : app->pollers) {
+      int64_t deadline = poller(now);
+      if(deadline < next) {
+        next = deadline;
+      }
+    }
+  }
+}
+
+void App::wake_handler(struct mg_connection* nc, int ev, void* ev_data) {
+  if(ev == MG_EV_RECV) {
+    // Cleared before the pollers run, so work handed over while they do
+    // wakes the task again
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+    ((App*)nc->user_data)->wake_pending.store(false, std::memory_order_release);
+  }
+}
+
+void App::http_handler(struct mg_connection* nc, int ev, void* ev_data) {
+  App* app = (App*)nc->user_data;
+
+  switch(ev) {
+    case MG_EV_ACCEPT:
+      mg_set_timer(nc, mg_time() + APP_HTTP_IDLE_SECS);
+      return;
+    case MG_EV_TIMER:
+      app->expire(nc);
+      return;
+    case MG_EV_CLOSE:
+      if(nc->flags & MG_F_IS_WEBSOCKET) {
+        if(nc->priv_2 != NULL) {
+          ((websocket_t*)nc->priv_2)->clients--;
+          nc->priv_2 = NULL;
+        }
+      } else {
+        app->dispatch_stream(nc, ev, NULL);
+        app->release_slot(nc);
+      }
+      return;
+    case MG_EV_WEBSOCKET_HANDSHAKE_REQUEST:
+      app->open_websocket(nc, (struct http_message*)ev_data);
+      return;
+    case MG_EV_WEBSOCKET_HANDSHAKE_DONE:
+      if(nc->priv_2 != NULL && ((websocket_t*)nc->priv_2)->on_open) {
+        ((websocket_t*)nc->priv_2)->on_open(nc);
+      }
+      return;
+    case MG_EV_SEND:
+      if(!(nc->flags & MG_F_IS_WEBSOCKET)) {
+        app->refill(nc);
+      }
+      return;
+    case MG_EV_HTTP_CHUNK:
+      if(app->dispatch_stream(nc, ev, (struct http_message*)ev_data)) {
+        nc->flags |= MG_F_DELETE_CHUNK;
+      }
+      return;
+    case MG_EV_HTTP_REQUEST:
+      if(app->dispatch_stream(nc, ev, (struct http_message*)ev_data)) {
+        return;
+      }
+      break;
+    default:
+      return;
+  }
+
+  struct http_message* hm = (struct http_message*)ev_data;
+
+  for(size_t i = 0; i < app->route_count; i++) {
+    if(mg_vcmp(&hm->uri, app->routes[i].uri.c_str()) == 0) {
+      app->routes[i].route(nc, hm);
+      return;
+    }
+  }
+  mg_http_send_error(nc, 404, NULL);
+}
+
+void App::expire(struct mg_connection* nc) {
+  if(nc->flags & MG_F_IS_WEBSOCKET) {
+    return;
+  }
+
+  // Only a connection with no request or response in flight is idle; a
+  // slow upload or a client slow to read its response keeps going
+  double now = mg_time();
+  double idle_until = (double)nc->last_io_time + APP_HTTP_IDLE_SECS;
+  if(nc->priv_2 == NULL && nc->priv_1.v == NULL && nc->send_mbuf.len == 0 && now >= idle_until) {
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return;
+  }
+  mg_set_timer(nc, idle_until > now ? idle_until : now + APP_HTTP_IDLE_SECS);
+}
+
+bool App::dispatch_stream(struct mg_connection* nc, int ev, struct http_message* hm) {
+  // The route is looked up on the first chunk and kept in priv_1 for the
+  // rest, so an upload holds no slot while its body streams in
+  stream_route_t* route = (stream_route_t*)nc->priv_1.v;
+  if(route == NULL) {
+    if(ev != MG_EV_HTTP_CHUNK) {
+      return false;
+    }
+    for(size_t i = 0; i < stream_route_count && route == NULL; i++) {
+      if(mg_vcmp(&hm->uri, stream_routes[i].uri.c_str()) == 0) {
+        route = &stream_routes[i].route;
+      }
+    }
+    if(route == NULL) {
+      return false;
+    }
+    nc->priv_1.v = route;
+  }
+
+  if(ev != MG_EV_HTTP_CHUNK) {
+    nc->priv_1.v = NULL;
+  }
+  (*route)(nc, ev, hm);
+  if(ev == MG_EV_HTTP_REQUEST) {
+    // The body went out chunk by chunk, so only the head is left; mongoose
+    // can't account for that and would parse it again
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  }
+  return true;
+}
+
+void App::release_slot(struct mg_connection* nc) {
+  if(nc->priv_2 != NULL) {
+    ((http_slot_t*)nc->priv_2)->nc = NULL;
+    ((http_slot_t*)nc->priv_2)->tx_left = 0;
+    ((http_slot_t*)nc->priv_2)->source = nullptr;
+    nc->priv_2 = NULL;
+  }
+}
+
+void App::release_idle_slot(struct mg_connection* nc) {
+  http_slot_t* slot = (http_slot_t*)nc->priv_2;
+  if(slot != NULL && slot->tx_left == 0 && !slot->source) {
+    release_slot(nc);
+  }
+}
+
+void App::open_websocket(struct mg_connection* nc, struct http_message* hm) {
+  // The connection stops being HTTP either way, so anything it still held
+  // for a pipelined response goes back now
+  release_slot(nc);
+
+  websocket_t* ws = NULL;
+  for(size_t i = 0; i < websocket_count && ws == NULL; i++) {
+    if(mg_vcmp(&hm->uri, websockets[i].uri.c_str()) == 0) {
+      ws = &websockets[i].ws;
+    }
+  }
+  if(ws == NULL || ws->clients >= ws->max_clients) {
+    mg_http_send_error(nc, ws == NULL ? 404 : 503, NULL);
+    nc->flags |= MG_F_SEND_AND_CLOSE;
+    return;
+  }
+
+  ws->clients++;
+  nc->priv_2 = ws;
+  // Viewers stay connected for as long as they like
+  mg_set_timer(nc, 0);
+  // Viewers have nothing to say beyond control frames
+  nc->recv_mbuf_limit = APP_WS_RECV_LIMIT;
+}
+
+App::http_slot_t* App::claim_slot(struct mg_connection* nc) {
+  // A pipelined request shares the slot of the response still going out
+  if(nc->priv_2 != NULL) {
+    return (http_slot_t*)nc->priv_2;
+  }
+  for(int i = 0; i < APP_HTTP_SLOTS; i++) {
+    if(slots[i].nc == NULL) {
+      slots[i].nc = nc;
+      nc->priv_2 = &slots[i];
+      return &slots[i];
+    }
+  }
+  return NULL;
+}
+
+void App::send_json(struct mg_connection* nc, json_route_t& route, struct http_message* hm) {
+  http_slot_t* slot = claim_slot(nc);
+  // A chunked body still being sent owns the slot buffer
+  if(slot == NULL || slot->source) {
+    mg_http_send_error(nc, 503, NULL);
+    return;
+  }
+
+  // The body is rendered after room for the head, then the head is written
+  // right up against it so the response is contiguous
+  char* body = slot->buf + APP_HTTP_HEAD_LEN;
+  size_t len = 0;
+  int status = route(hm, body, sizeof(slot->buf) - APP_HTTP_HEAD_LEN, len);
+
+  char head[APP_HTTP_HEAD_LEN];
+  int head_len = -1;
+  if(len <= sizeof(slot->buf) - APP_HTTP_HEAD_LEN) {
+    head_len = snprintf(head, sizeof(head),
+      "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nCache-Control: no-store\r\nContent-Length: %u\r\n\r\n",
+      status, status_text(status), (unsigned int)len
+    );
+  }
+  if(head_len < 0 || head_len >= (int)sizeof(head)) {
+    mg_http_send_error(nc, 500, NULL);
+  } else {
+    char* start = body - head_len;
+    memcpy(start, head, head_len);
+    mg_send(nc, start, head_len + len);
+  }
+
+  // The whole response is in the send buffer now
+  release_idle_slot(nc);
+}
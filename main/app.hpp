@@ -1,14 +1,155 @@
 #ifndef APP_HPP
 #define APP_HPP
 
+#include <atomic>
+#include <functional>
 #include <string>
-#include <unordered_map>
+#include <vector>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
 #include "mongoose.h"
 
+#define APP_HTTP_SLOTS        4
+#define APP_HTTP_BUF_LEN      1536
+#define APP_HTTP_HEAD_LEN     160
+#define APP_HTTP_IDLE_SECS    5
+#define APP_WS_RECV_LIMIT     256
+#define APP_TX_CHUNK          2048
+#define APP_POLL_MAX_US       500000
+#define APP_MAX_ROUTES        16
+#define APP_MAX_STREAM_ROUTES 4
+#define APP_MAX_WEBSOCKETS    2
 
+// Owns the mongoose event manager and the task that polls it. Network
+// services bind their connections to the manager and register a poller that
+// runs on the same task, so nothing outside this task touches mongoose.
+//
+// Each poller says when it next needs to run and the task sleeps in select()
+// until the nearest of those, so an idle clock leaves the CPU alone long
+// enough for automatic light sleep. Socket traffic wakes it early, and
+// other tasks that hand it work call wake().
+//
+// Responses borrow a slot from a fixed pool for as long as they are being
+// written, so an idle keep-alive connection holds nothing but its socket,
+// and is closed after APP_HTTP_IDLE_SECS without traffic. JSON routes render
+// straight into the slot and the whole response goes out in one send, so
+// polling the API doesn't grow the heap. Routes live in fixed tables and are
+// matched against the request in place.
+//
+// Bodies that live in flash for the life of the firmware are sent with
+// send_mapped(), which tops the send buffer up from the mapping as the
+// socket drains instead of queueing the whole body at once. Bodies that are
+// rendered on the fly and can outgrow the slot go out with send_chunked(),
+// a slot buffer at a time in chunked encoding.
+//
+// WebSocket endpoints are broadcast only. Upgraded connections give their
+// slot back and are counted against the endpoint's own client limit.
 class App {
+public:
+  typedef struct {
+    std::function<void(struct mg_connection*)> on_open;
+    uint32_t clients;
+    uint32_t max_clients;
+  } websocket_t;
+
+  typedef std::function<void(struct mg_connection*, struct http_message*)> route_t;
+  // Renders a JSON body into the buffer, sets its length and returns the
+  // HTTP status
+  typedef std::function<int(struct http_message*, char*, size_t, size_t&)> json_route_t;
+  // Sees MG_EV_HTTP_CHUNK for each piece of the body as it arrives, which
+  // is then discarded, MG_EV_HTTP_REQUEST once it is complete and
+  // MG_EV_CLOSE (with no message) if the connection goes away first
+  typedef std::function<void(struct mg_connection*, int, struct http_message*)> stream_route_t;
+  // Renders the next piece of a body into the buffer and returns its
+  // length, 0 once the body is complete
+  typedef std::function<size_t(char*, size_t)> chunk_source_t;
+
+  // Runs on the network task after every wakeup and returns the time it
+  // next needs to run; anything past APP_POLL_MAX_US is as good as never
+  typedef std::function<int64_t(int64_t)> poller_t;
+
+  App();
+  ~App() {};
+
+  void init();
+  void start();
+
+  void add_poller(poller_t poller) { pollers.push_back(poller); };
+  // Any task; has the pollers run without waiting for their deadlines
+  void wake();
+  // Routes must be added before start()
+  void add_route(const std::string& uri, route_t route);
+  void add_json_route(const std::string& uri, json_route_t route);
+  void add_stream_route(const std::string& uri, stream_route_t route);
+  websocket_t* add_websocket(const std::string& uri, uint32_t max_clients, std::function<void(struct mg_connection*)> on_open);
+  // Queues one binary message to every client of the endpoint, skipping
+  // any with more than max_backlog bytes still unsent; returns the number
+  // skipped. Network task only.
+  uint32_t broadcast(websocket_t* ws, const void* data, size_t len, size_t max_backlog);
+  // Sends the head now and the body APP_TX_CHUNK at a time as earlier
+  // pieces go out; the body must stay valid, so flash or rodata only. One
+  // body per connection at a time. Network task only.
+  void send_mapped(struct mg_connection* nc, const char* head, size_t head_len, const char* body, size_t len);
+  // Sends the head, which must ask for chunked encoding, then pieces from
+  // the source as earlier ones go out. Same rules as send_mapped().
+  void send_chunked(struct mg_connection* nc, const char* head, size_t head_len, chunk_source_t source);
+  bool listen_http(const char* port);
+  struct mg_mgr* get_mgr() { return &mgr; };
+
+private:
+  typedef struct {
+    struct mg_connection* nc;
+    const char* tx;
+    size_t tx_left;
+    chunk_source_t source;
+    char buf[APP_HTTP_BUF_LEN];
+  } http_slot_t;
+
+  typedef struct {
+    std::string uri;
+    route_t route;
+  } route_entry_t;
+
+  typedef struct {
+    std::string uri;
+    stream_route_t route;
+  } stream_entry_t;
+
+  typedef struct {
+    std::string uri;
+    websocket_t ws;
+  } websocket_entry_t;
+
+  struct mg_mgr mgr;
+  TaskHandle_t task_handle;
+
+  struct mg_connection* wake_conn;
+  int wake_sock;
+  std::atomic<bool> wake_pending;
+
+  std::vector<poller_t> pollers;
+  route_entry_t routes[APP_MAX_ROUTES];
+  size_t route_count;
+  stream_entry_t stream_routes[APP_MAX_STREAM_ROUTES];
+  size_t stream_route_count;
+  websocket_entry_t websockets[APP_MAX_WEBSOCKETS];
+  size_t websocket_count;
+  http_slot_t slots[APP_HTTP_SLOTS];
+
+  static void task(void* ctx);
+  static void wake_handler(struct mg_connection* nc, int ev, void* ev_data);
+  static void http_handler(struct mg_connection* nc, int ev, void* ev_data);
 
+  http_slot_t* claim_slot(struct mg_connection* nc);
+  void release_slot(struct mg_connection* nc);
+  void release_idle_slot(struct mg_connection* nc);
+  void expire(struct mg_connection* nc);
+  void refill(struct mg_connection* nc);
+  void open_websocket(struct mg_connection* nc, struct http_message* hm);
+  bool dispatch_stream(struct mg_connection* nc, int ev, struct http_message* hm);
+  void send_json(struct mg_connection* nc, json_route_t& route, struct http_message* hm);
 };
 
 #endif // APP_HPP
@@ -0,0 +1,95 @@
+#include "asset-server.hpp"
+
+#include <esp_log.h>
+#include <stdio.h>
+#include <string.h>
+
+
+bool AssetServer::init(const char* label) {
+  const esp_partition_t* partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)ASSET_PARTITION_SUBTYPE, label);
+  if(partition == NULL) {
+    ESP_LOGW("Assets", "No %s partition", label);
+    return false;
+  }
+
+  const void* ptr = NULL;
+  esp_err_t err = esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, &ptr, &map_handle);
+  if(err != ESP_OK) {
+    ESP_LOGE("Assets", "Failed to map %s: %s", label, esp_err_to_name(err));
+    return false;
+  }
+
+  if(!check((const header_t*)ptr, partition->size)) {
+    spi_flash_munmap(map_handle);
+    return false;
+  }
+
+  bundle = (const uint8_t*)ptr;
+  count = ((const header_t*)ptr)->count;
+  entries = (const entry_t*)(bundle + sizeof(header_t));
+  ESP_LOGI("Assets", "Mapped %u assets, %u bytes", count, ((const header_t*)ptr)->size);
+  return true;
+}
+
+bool AssetServer::check(const header_t* header, size_t size) {
+  // An erased partition reads as all ones, which is the usual failure
+  if(header->magic != ASSET_MAGIC || header->size > size || header->size < sizeof(header_t) ||
+     header->count > (header->size - sizeof(header_t)) / sizeof(entry_t)) {
+    ESP_LOGW("Assets", "No asset bundle flashed");
+    return false;
+  }
+
+  const entry_t* index = (const entry_t*)(header + 1);
+  for(uint32_t i = 0; i < header->count; i++) {
+    const entry_t& entry = index[i];
+    if(entry.path[0] != '/' || memchr(entry.path, 0, sizeof(entry.path)) == NULL ||
+       memchr(entry.type, 0, sizeof(entry.type)) == NULL || memchr(entry.etag, 0, sizeof(entry.etag)) == NULL ||
+       entry.offset > header->size || entry.length > header->size - entry.offset) {
+      ESP_LOGE("Assets", "Asset bundle entry %u is corrupt", i);
+      return false;
+    }
+  }
+  return true;
+}
+
+void AssetServer::attach(App& _app) {
+  app = &_app;
+  for(uint32_t i = 0; i < count; i++) {
+    const entry_t* entry = &entries[i];
+    app->add_route(entry->path, [this, entry](struct mg_connection* nc, struct http_message* hm) {
+      serve(nc, hm, entry);
+    });
+    if(strcmp(entry->path, "/index.html") == 0) {
+      app->add_route("/", [this, entry](struct mg_connection* nc, struct http_message* hm) {
+        serve(nc, hm, entry);
+      });
+    }
+  }
+}
+
+void AssetServer::serve(struct mg_connection* nc, struct http_message* hm, const entry_t* entry) {
+  char head[APP_HTTP_HEAD_LEN + 64];
+  int len;
+
+  // The browser keeps its copy and revalidates on every load, which costs
+  // a header exchange instead of the asset
+  struct mg_str* match = mg_get_http_header(hm, "If-None-Match");
+  if(match != NULL && (mg_vcmp(match, "*") == 0 || mg_strstr(*match, mg_mk_str(entry->etag)) != NULL)) {
+    not_modified.add();
+    len = snprintf(head, sizeof(head), "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nCache-Control: no-cache\r\n\r\n", entry->etag);
+    mg_send(nc, head, len);
+    return;
+  }
+
+  len = snprintf(head, sizeof(head),
+    "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Encoding: gzip\r\nContent-Length: %u\r\nETag: %s\r\nCache-Control: no-cache\r\n\r\n",
+    entry->type, entry->length, entry->etag
+  );
+  if(mg_vcmp(&hm->method, "HEAD") == 0) {
+    mg_send(nc, head, len);
+    return;
+  }
+
+  served.add();
+  app->send_mapped(nc, head, len, (const char*)bundle + entry->offset, entry->length);
+}
@@ -0,0 +1,68 @@
+#ifndef ASSET_SERVER_HPP
+#define ASSET_SERVER_HPP
+
+#include <stdint.h>
+
+#include <esp_partition.h>
+
+#include "app.hpp"
+#include "metrics.hpp"
+
+#define ASSET_PARTITION_SUBTYPE 0x40
+#define ASSET_MAGIC             0x3142414E
+
+
+// Serves the web UI from the assets partition, which tools/mkassets.py
+// fills with a bundle of gzip-compressed files:
+//
+//   header   magic "NAB1", entry count, bundle size, reserved (u32 LE each)
+//   entries  path[64], content type[32], ETag[24], offset, length
+//   data     each file's gzip bytes, 4-byte aligned
+//
+// The partition is memory mapped once at startup and responses are fed to
+// the socket straight from the mapping, so an asset never has a copy in
+// RAM beyond what is in flight. Bodies are always sent gzip encoded; ETags
+// are strong and a matching If-None-Match is answered with 304.
+class AssetServer {
+public:
+  AssetServer() : app(NULL), map_handle(0), bundle(NULL), entries(NULL), count(0) {};
+  ~AssetServer() {};
+
+  // Maps the partition and checks the index; false leaves the UI unserved
+  bool init(const char* label);
+  // Adds a route per asset, and / for /index.html
+  void attach(App& app);
+
+  const Counter& get_served() const { return served; };
+  const Counter& get_not_modified() const { return not_modified; };
+
+private:
+  typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t size;
+    uint32_t reserved;
+  } header_t;
+
+  typedef struct {
+    char path[64];
+    char type[32];
+    char etag[24];
+    uint32_t offset;
+    uint32_t length;
+  } entry_t;
+
+  App* app;
+  spi_flash_mmap_handle_t map_handle;
+  const uint8_t* bundle;
+  const entry_t* entries;
+  uint32_t count;
+
+  Counter served;
+  Counter not_modified;
+
+  bool check(const header_t* header, size_t size);
+  void serve(struct mg_connection* nc, struct http_message* hm, const entry_t* entry);
+};
+
+#endif // ASSET_SERVER_HPP
@@ -0,0 +1,66 @@
+#ifndef CATHODE_ORDER_HPP
+#define CATHODE_ORDER_HPP
+
+#include <stdint.h>
+
+#include "config.hpp"
+
+#define TUBE_MODEL_LINEAR 0
+#define TUBE_MODEL_IN14   1
+
+#ifndef TUBE_MODEL
+#define TUBE_MODEL TUBE_MODEL_IN14
+#endif
+
+// HV5530 output, within a tube's 10 bit field, wired to each digit's cathode
+#ifndef TUBE_PIN_MAP
+#define TUBE_PIN_MAP {9, 8, 7, 6, 5, 4, 3, 2, 1, 0}
+#endif
+
+
+// Compile time tables describing the tubes. The cathodes in a nixie are a
+// stack, not a line, so the order that looks like depth and the neighbours
+// that coat each other when one is lit for a long time follow the stack, not
+// the digit values. Everything here is constexpr so encoding a frame stays a
+// plain table lookup.
+namespace cathode {
+
+// Cathodes from front to back
+#if TUBE_MODEL == TUBE_MODEL_IN14
+constexpr uint8_t STACK[10] = {1, 6, 2, 7, 5, 0, 4, 9, 8, 3};
+#else
+constexpr uint8_t STACK[10] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+#endif
+
+constexpr uint8_t PIN_MAP[10] = TUBE_PIN_MAP;
+
+constexpr uint8_t depth_of(uint8_t digit, uint8_t depth = 0) {
+  return depth >= 10 || STACK[depth] == digit ? depth : depth_of(digit, depth + 1);
+}
+
+constexpr bool stack_is_permutation(uint8_t digit = 0) {
+  return digit >= 10 || (depth_of(digit) < 10 && stack_is_permutation(digit + 1));
+}
+
+constexpr bool pins_are_unique(uint8_t a = 0, uint8_t b = 1) {
+  return a >= 10 || (PIN_MAP[a] < 10 && (b >= 10 ? pins_are_unique(a + 1, a + 2) :
+                                         PIN_MAP[a] != PIN_MAP[b] && pins_are_unique(a, b + 1)));
+}
+
+static_assert(stack_is_permutation(), "Cathode stack must contain every digit once");
+static_assert(pins_are_unique(), "Every digit needs its own driver output");
+
+// Depth index of each digit, 0 at the front
+constexpr uint8_t DEPTH[10] = {
+  depth_of(0), depth_of(1), depth_of(2), depth_of(3), depth_of(4),
+  depth_of(5), depth_of(6), depth_of(7), depth_of(8), depth_of(9)
+};
+
+// Driver bits for one tube; blank for anything but 0-9
+constexpr uint16_t mask(int8_t digit) {
+  return digit >= 0 && digit <= 9 ? (uint16_t)(1u << PIN_MAP[digit]) : 0;
+}
+
+}
+
+#endif // CATHODE_ORDER_HPP
@@ -0,0 +1,353 @@
+#include "delta-patch.hpp"
+
+#include <esp_log.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static uint32_t read_u32(const uint8_t* p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+
+DeltaPatch::DeltaPatch() :
+  base(NULL), max_output(0), state(PATCH_HEADER), header_len(0), target_size(0), base_size(0), base_offset(0),
+  input(NULL), input_pos(0), input_len(0),
+  inflator(NULL), window(NULL), window_pos(0), out_pos(0), out_len(0), more_output(false),
+  op_len(0), op_need(0), op_code(DELTA_OP_END), op_src(0), op_remaining(0), ops_ended(false),
+  output_size(0), error(NULL) {
+  mbedtls_sha256_init(&base_sha);
+  mbedtls_sha256_init(&sha);
+}
+
+esp_err_t DeltaPatch::begin(const esp_partition_t* _base, size_t _max_output, sink_t _sink) {
+  end();
+
+  base = _base;
+  max_output = _max_output;
+  sink = _sink;
+  state = PATCH_HEADER;
+  header_len = 0;
+  base_offset = 0;
+  input_pos = 0;
+  input_len = 0;
+  window_pos = 0;
+  out_len = 0;
+  more_output = false;
+  op_len = 0;
+  op_code = DELTA_OP_END;
+  op_remaining = 0;
+  ops_ended = false;
+  output_size = 0;
+  error = NULL;
+
+  // Only held for the length of an update
+  input = (uint8_t*)malloc(DELTA_INPUT_LEN);
+  inflator = (tinfl_decompressor*)malloc(sizeof(tinfl_decompressor));
+  window = (uint8_t*)malloc(TINFL_LZ_DICT_SIZE);
+  if(input == NULL || inflator == NULL || window == NULL) {
+    end();
+    return fail("out of memory");
+  }
+  tinfl_init(inflator);
+
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts_ret(&sha, 0);
+  return ESP_OK;
+}
+
+void DeltaPatch::end() {
+  free(input);
+  free(inflator);
+  free(window);
+  input = NULL;
+  inflator = NULL;
+  window = NULL;
+  mbedtls_sha256_free(&base_sha);
+  mbedtls_sha256_free(&sha);
+}
+
+esp_err_t DeltaPatch::feed(const uint8_t* data, size_t len) {
+  if(error != NULL) {
+    return ESP_FAIL;
+  }
+
+  if(state == PATCH_HEADER) {
+    size_t n = DELTA_HEADER_LEN - header_len < len ? DELTA_HEADER_LEN - header_len : len;
+    memcpy(header + header_len, data, n);
+    header_len += n;
+    data += n;
+    len -= n;
+
+    if(header_len < DELTA_HEADER_LEN) {
+      return ESP_OK;
+    }
+    esp_err_t err = parse_header();
+    if(err != ESP_OK) {
+      return err;
+    }
+  }
+
+  if(len > 0) {
+    if(state == PATCH_DONE) {
+      return fail("data after end of patch");
+    }
+    memmove(input, input + input_pos, input_len - input_pos);
+    input_len -= input_pos;
+    input_pos = 0;
+    if(len > DELTA_INPUT_LEN - input_len) {
+      return fail("fed while busy");
+    }
+    memcpy(input + input_len, data, len);
+    input_len += len;
+  }
+  return step();
+}
+
+esp_err_t DeltaPatch::step() {
+  if(error != NULL) {
+    return ESP_FAIL;
+  }
+  if(state == PATCH_BASE) {
+    return hash_base();
+  }
+
+  size_t budget = DELTA_STEP_LEN;
+  while(budget > 0) {
+    esp_err_t err;
+    if(op_code == DELTA_OP_COPY && op_remaining > 0) {
+      err = copy(budget);
+    } else if(out_len > 0) {
+      err = apply(budget);
+    } else if(state == PATCH_OPS && (more_output || input_pos < input_len)) {
+      err = inflate();
+    } else {
+      break;
+    }
+    if(err != ESP_OK) {
+      return err;
+    }
+  }
+  return ESP_OK;
+}
+
+bool DeltaPatch::is_busy() {
+  if(error != NULL) {
+    return false;
+  }
+  return state == PATCH_BASE || (op_code == DELTA_OP_COPY && op_remaining > 0) || out_len > 0 ||
+         (state == PATCH_OPS && (more_output || input_pos < input_len));
+}
+
+esp_err_t DeltaPatch::finish() {
+  if(error != NULL) {
+    return ESP_FAIL;
+  }
+  if(state != PATCH_DONE || !ops_ended || is_busy()) {
+    return fail("patch truncated");
+  }
+  if(output_size != target_size) {
+    return fail("wrong output size");
+  }
+
+  uint8_t hash[32];
+  mbedtls_sha256_finish_ret(&sha, hash);
+  if(memcmp(hash, target_hash, sizeof(hash)) != 0) {
+    return fail("target hash mismatch");
+  }
+  return ESP_OK;
+}
+
+
+esp_err_t DeltaPatch::fail(const char* message) {
+  if(error == NULL) {
+    error = message;
+    ESP_LOGE("Delta", "%s after %u bytes", message, (unsigned int)output_size);
+  }
+  return ESP_FAIL;
+}
+
+esp_err_t DeltaPatch::parse_header() {
+  if(read_u32(header) != DELTA_MAGIC || header[4] != DELTA_VERSION) {
+    return fail("not a patch");
+  }
+
+  base_size = read_u32(header + 8);
+  target_size = read_u32(header + 12);
+  memcpy(target_hash, header + 48, sizeof(target_hash));
+  if(base_size > base->size) {
+    return fail("base larger than running slot");
+  }
+  if(target_size > max_output) {
+    return fail("target larger than update slot");
+  }
+
+  mbedtls_sha256_init(&base_sha);
+  mbedtls_sha256_starts_ret(&base_sha, 0);
+  base_offset = 0;
+  state = PATCH_BASE;
+  return ESP_OK;
+}
+
+esp_err_t DeltaPatch::hash_base() {
+  // A patch only makes sense against the exact image it was made from
+  uint32_t stop = base_size - base_offset < DELTA_HASH_STEP ? base_size : base_offset + DELTA_HASH_STEP;
+  while(base_offset < stop) {
+    size_t n = stop - base_offset < DELTA_BASE_CHUNK ? stop - base_offset : DELTA_BASE_CHUNK;
+    if(esp_partition_read(base, base_offset, chunk, n) != ESP_OK) {
+      return fail("base read failed");
+    }
+    mbedtls_sha256_update_ret(&base_sha, chunk, n);
+    base_offset += n;
+  }
+  if(base_offset < base_size) {
+    return ESP_OK;
+  }
+
+  uint8_t hash[32];
+  mbedtls_sha256_finish_ret(&base_sha, hash);
+  if(memcmp(hash, header + 16, sizeof(hash)) != 0) {
+    return fail("patch is for a different base image");
+  }
+
+  ESP_LOGI("Delta", "Patching %u byte base into %u byte image", base_size, (unsigned int)target_size);
+  state = PATCH_OPS;
+  return ESP_OK;
+}
+
+esp_err_t DeltaPatch::inflate() {
+  // Only called once the last output is applied, so the window can be reused
+  size_t in_bytes = input_len - input_pos;
+  size_t out_bytes = TINFL_LZ_DICT_SIZE - window_pos;
+  tinfl_status status = tinfl_decompress(inflator, input + input_pos, &in_bytes, window, window + window_pos, &out_bytes,
+    TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT | TINFL_FLAG_COMPUTE_ADLER32
+  );
+  input_pos += in_bytes;
+  out_pos = window_pos;
+  out_len = out_bytes;
+  window_pos = (window_pos + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+  more_output = status == TINFL_STATUS_HAS_MORE_OUTPUT;
+
+  if(status == TINFL_STATUS_DONE) {
+    state = PATCH_DONE;
+    return input_pos == input_len ? ESP_OK : fail("data after end of patch");
+  }
+  if(status < 0) {
+    return fail("corrupt patch stream");
+  }
+  return ESP_OK;
+}
+
+esp_err_t DeltaPatch::apply(size_t& budget) {
+  while(out_len > 0 && budget > 0) {
+    const uint8_t* data = window + out_pos;
+    if(ops_ended) {
+      return fail("ops after END");
+    }
+
+    if(op_remaining == 0) {
+      op[op_len++] = *data;
+      out_pos++;
+      out_len--;
+      if(op_len == 1) {
+        switch(op[0]) {
+          case DELTA_OP_END: op_need = 1; break;
+          case DELTA_OP_COPY: op_need = 9; break;
+          case DELTA_OP_ADD: op_need = 9; break;
+          case DELTA_OP_INSERT: op_need = 5; break;
+          default: return fail("unknown op");
+        }
+      }
+      if(op_len == op_need) {
+        esp_err_t err = start_op();
+        if(err != ESP_OK) {
+          return err;
+        }
+        // A COPY takes no patch bytes; step() runs it before anything else
+        if(op_code == DELTA_OP_COPY) {
+          return ESP_OK;
+        }
+      }
+      continue;
+    }
+
+    size_t n = op_remaining < out_len ? op_remaining : out_len;
+    n = n < budget ? n : budget;
+    if(op_code == DELTA_OP_INSERT) {
+      esp_err_t err = emit(data, n);
+      if(err != ESP_OK) {
+        return err;
+      }
+    } else {
+      n = n < DELTA_BASE_CHUNK ? n : DELTA_BASE_CHUNK;
+      if(esp_partition_read(base, op_src, chunk, n) != ESP_OK) {
+        return fail("base read failed");
+      }
+      for(size_t i = 0; i < n; i++) {
+        chunk[i] += data[i];
+      }
+      esp_err_t err = emit(chunk, n);
+      if(err != ESP_OK) {
+        return err;
+      }
+      op_src += n;
+    }
+    out_pos += n;
+    out_len -= n;
+    op_remaining -= n;
+    budget -= n;
+  }
+  return ESP_OK;
+}
+
+esp_err_t DeltaPatch::start_op() {
+  op_code = op[0];
+  op_len = 0;
+
+  switch(op_code) {
+    case DELTA_OP_END:
+      ops_ended = true;
+      return ESP_OK;
+    case DELTA_OP_COPY:
+    case DELTA_OP_ADD:
+      op_src = read_u32(op + 1);
+      op_remaining = read_u32(op + 5);
+      if(op_src > base->size || op_remaining > base->size - op_src) {
+        return fail(op_code == DELTA_OP_COPY ? "COPY outside base" : "ADD outside base");
+      }
+      return ESP_OK;
+    case DELTA_OP_INSERT:
+      op_remaining = read_u32(op + 1);
+      return ESP_OK;
+  }
+  return fail("unknown op");
+}
+
+esp_err_t DeltaPatch::copy(size_t& budget) {
+  size_t n = op_remaining < budget ? op_remaining : budget;
+  n = n < DELTA_BASE_CHUNK ? n : DELTA_BASE_CHUNK;
+  if(esp_partition_read(base, op_src, chunk, n) != ESP_OK) {
+    return fail("base read failed");
+  }
+  esp_err_t err = emit(chunk, n);
+  if(err != ESP_OK) {
+    return err;
+  }
+  op_src += n;
+  op_remaining -= n;
+  budget -= n;
+  return ESP_OK;
+}
+
+esp_err_t DeltaPatch::emit(const uint8_t* data, size_t len) {
+  if(output_size + len > target_size) {
+    return fail("output longer than target");
+  }
+
+  mbedtls_sha256_update_ret(&sha, data, len);
+  output_size += len;
+  if(sink(data, len) != ESP_OK) {
+    return fail("write failed");
+  }
+  return ESP_OK;
+}
@@ -0,0 +1,120 @@
+#ifndef DELTA_PATCH_HPP
+#define DELTA_PATCH_HPP
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+#include <esp_partition.h>
+#include <esp32/rom/miniz.h>
+#include <mbedtls/sha256.h>
+
+#define DELTA_MAGIC        0x3144444E  // "NDD1"
+#define DELTA_VERSION      1
+#define DELTA_HEADER_LEN   80
+#define DELTA_BASE_CHUNK   1024
+#define DELTA_INPUT_LEN    2048
+#define DELTA_STEP_LEN     4096   // Output per step, one flash sector to erase
+#define DELTA_HASH_STEP    32768  // Base bytes hashed per step
+
+#define DELTA_OP_END       0x00
+#define DELTA_OP_COPY      0x01
+#define DELTA_OP_ADD       0x02
+#define DELTA_OP_INSERT    0x03
+
+
+// Streaming applier for patches from tools/mkdelta.py. A patch rebuilds
+// the new image from the running one:
+//
+//   header   u32 magic, u8 version, u8[3] reserved, u32 base size,
+//            u32 target size, u8[32] base SHA-256, u8[32] target SHA-256
+//   ops      zlib stream of
+//              0x01 COPY   u32 src, u32 len       base bytes as they are
+//              0x02 ADD    u32 src, u32 len, len  base bytes plus deltas
+//              0x03 INSERT u32 len, len           new bytes
+//              0x00 END
+//
+// All integers are little endian. The output goes to the sink in order, so
+// nothing is buffered beyond the 32 KB inflate window, one base chunk and
+// the unapplied input. The base is checked against its hash before
+// anything is written, and the output against the target hash at the end.
+//
+// Work is done in bounded steps so a long COPY or the base hash never
+// holds up the caller: feed() takes one step, and while is_busy() the
+// caller stops feeding and calls step() until it clears.
+class DeltaPatch {
+public:
+  typedef std::function<esp_err_t(const uint8_t*, size_t)> sink_t;
+
+  DeltaPatch();
+  ~DeltaPatch() { end(); };
+
+  esp_err_t begin(const esp_partition_t* base, size_t max_output, sink_t sink);
+  // At most DELTA_INPUT_LEN bytes, and only while not busy
+  esp_err_t feed(const uint8_t* data, size_t len);
+  esp_err_t step();
+  bool is_busy();
+  // Whether the whole target was produced and matches its hash
+  esp_err_t finish();
+  void end();
+
+  size_t get_output_size() { return output_size; };
+  const char* get_error() { return error; };
+
+private:
+  typedef enum {
+    PATCH_HEADER,
+    PATCH_BASE,
+    PATCH_OPS,
+    PATCH_DONE
+  } state_t;
+
+  const esp_partition_t* base;
+  size_t max_output;
+  sink_t sink;
+
+  state_t state;
+  uint8_t header[DELTA_HEADER_LEN];
+  size_t header_len;
+  size_t target_size;
+  uint8_t target_hash[32];
+  uint32_t base_size;
+  uint32_t base_offset;
+  mbedtls_sha256_context base_sha;
+
+  uint8_t* input;
+  size_t input_pos;
+  size_t input_len;
+
+  tinfl_decompressor* inflator;
+  uint8_t* window;
+  size_t window_pos;
+  size_t out_pos;
+  size_t out_len;
+  bool more_output;
+
+  uint8_t op[9];
+  size_t op_len;
+  size_t op_need;
+  uint8_t op_code;
+  uint32_t op_src;
+  uint32_t op_remaining;
+  bool ops_ended;
+
+  uint8_t chunk[DELTA_BASE_CHUNK];
+  size_t output_size;
+  mbedtls_sha256_context sha;
+  const char* error;
+
+  esp_err_t fail(const char* message);
+  esp_err_t parse_header();
+  esp_err_t hash_base();
+  esp_err_t inflate();
+  esp_err_t apply(size_t& budget);
+  esp_err_t start_op();
+  esp_err_t copy(size_t& budget);
+  esp_err_t emit(const uint8_t* data, size_t len);
+};
+
+#endif // DELTA_PATCH_HPP
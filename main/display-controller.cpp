@@ -0,0 +1,268 @@
+#include "display-controller.hpp"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <string.h>
+
+
+DisplayController::DisplayController(TubeDriver& _td, TubeManager& _tm, DisplayState& _state, PeriodicExecutor& _executor) :
+  td(_td), tm(_tm), state(_state), executor(_executor), queue(NULL), dropped(0), transient_until(0),
+  timer_mode(TIMER_OFF), timer_running(false), timer_start(0), timer_elapsed(0), countdown_us(0), last_count(-1),
+  timer_frames(0), timer_dropped(0) {
+  memset(clock_digits, 0, sizeof(clock_digits));
+  memset(&shown, 0, sizeof(shown));
+  memset(&published, 0, sizeof(published));
+}
+
+void DisplayController::init() {
+  queue = xQueueCreateStatic(DISPLAY_QUEUE_LEN, sizeof(cmd_t), queue_storage, &queue_buffer);
+
+  shown.hv = true;
+  shown.brightness = 100;
+  published = shown;
+  state.publish(published);
+  if(publish_callback) {
+    publish_callback(published);
+  }
+}
+
+
+bool DisplayController::set_digits(const int8_t* digits) {
+  cmd_t cmd = {};
+  cmd.type = CMD_SET_DIGITS;
+  memcpy(cmd.digits, digits, sizeof(cmd.digits));
+  return post(cmd);
+}
+
+bool DisplayController::set_hv(bool on) {
+  cmd_t cmd = {};
+  cmd.type = CMD_HV;
+  cmd.value = on;
+  return post(cmd);
+}
+
+bool DisplayController::set_brightness(uint8_t percent) {
+  cmd_t cmd = {};
+  cmd.type = CMD_BRIGHTNESS;
+  cmd.value = percent > 100 ? 100 : percent;
+  return post(cmd);
+}
+
+bool DisplayController::start_effect(TubeManager::effect_t effect) {
+  cmd_t cmd = {};
+  cmd.type = CMD_EFFECT;
+  cmd.value = effect;
+  return post(cmd);
+}
+
+bool DisplayController::show_transient(const int8_t* digits, uint32_t duration_ms) {
+  cmd_t cmd = {};
+  cmd.type = CMD_TRANSIENT;
+  memcpy(cmd.digits, digits, sizeof(cmd.digits));
+  cmd.value = duration_ms;
+  return post(cmd);
+}
+
+bool DisplayController::stopwatch(timer_action_t action) {
+  cmd_t cmd = {};
+  cmd.type = CMD_STOPWATCH;
+  cmd.value = action;
+  return post(cmd);
+}
+
+bool DisplayController::countdown(uint32_t duration_ms) {
+  cmd_t cmd = {};
+  cmd.type = CMD_COUNTDOWN;
+  cmd.value = duration_ms;
+  return post(cmd);
+}
+
+bool DisplayController::post(const cmd_t& cmd) {
+  if(queue == NULL || xQueueSend(queue, &cmd, 0) != pdTRUE) {
+    dropped++;
+    return false;
+  }
+  executor.notify();
+  return true;
+}
+
+
+void DisplayController::process() {
+  cmd_t cmd;
+  int64_t now = esp_timer_get_time();
+  while(queue != NULL && xQueueReceive(queue, &cmd, 0) == pdTRUE) {
+    apply(cmd, now);
+  }
+}
+
+void DisplayController::show_clock(const int8_t* digits) {
+  memcpy(clock_digits, digits, sizeof(clock_digits));
+  if(transient_until == 0 && timer_mode == TIMER_OFF) {
+    tm.set_digits(digits[0], digits[1], digits[2], digits[3], digits[4], digits[5]);
+  }
+}
+
+void DisplayController::tick(int64_t now) {
+  if(transient_until != 0 && now >= transient_until) {
+    transient_until = 0;
+    tm.set_digits(clock_digits[0], clock_digits[1], clock_digits[2], clock_digits[3], clock_digits[4], clock_digits[5]);
+  }
+  if(timer_mode != TIMER_OFF) {
+    render_timer(now);
+  }
+
+  tm.tick(now);
+  publish();
+}
+
+void DisplayController::apply(const cmd_t& cmd, int64_t now) {
+  switch(cmd.type) {
+    case CMD_SET_DIGITS:
+      show_clock(cmd.digits);
+      break;
+    case CMD_HV:
+      if(cmd.value) {
+        td.enable_hv();
+      } else {
+        td.disable_hv();
+      }
+      shown.hv = cmd.value != 0;
+      break;
+    case CMD_BRIGHTNESS:
+      td.set_brightness(cmd.value);
+      shown.brightness = cmd.value;
+      break;
+    case CMD_EFFECT:
+      tm.start_effect((TubeManager::effect_t)cmd.value, now);
+      break;
+    case CMD_TRANSIENT:
+      transient_until = now + (int64_t)cmd.value * 1000;
+      tm.set_digits(cmd.digits[0], cmd.digits[1], cmd.digits[2], cmd.digits[3], cmd.digits[4], cmd.digits[5]);
+      break;
+    case CMD_STOPWATCH:
+      if(timer_mode != TIMER_STOPWATCH && cmd.value != TIMER_EXIT) {
+        timer_mode = TIMER_STOPWATCH;
+        timer_running = false;
+        timer_elapsed = 0;
+      }
+      apply_timer((timer_action_t)cmd.value, now);
+      break;
+    case CMD_COUNTDOWN:
+      timer_mode = TIMER_COUNTDOWN;
+      timer_running = false;
+      timer_elapsed = 0;
+      countdown_us = (int64_t)cmd.value * 1000;
+      apply_timer(TIMER_START, now);
+      break;
+  }
+  publish();
+}
+
+void DisplayController::apply_timer(timer_action_t action, int64_t now) {
+  switch(action) {
+    case TIMER_START:
+      if(!timer_running) {
+        timer_start = timer_origin(now);
+        timer_running = true;
+        last_count = -1;
+      }
+      break;
+    case TIMER_STOP:
+      if(timer_running) {
+        timer_elapsed += now - timer_start;
+        timer_running = false;
+      }
+      break;
+    case TIMER_RESET:
+      timer_elapsed = 0;
+      if(timer_running) {
+        timer_start = timer_origin(now);
+        last_count = -1;
+      }
+      break;
+    case TIMER_EXIT:
+      timer_mode = TIMER_OFF;
+      timer_running = false;
+      tm.set_digits(clock_digits[0], clock_digits[1], clock_digits[2], clock_digits[3], clock_digits[4], clock_digits[5]);
+      break;
+  }
+
+  tm.hold_prevention(timer_mode != TIMER_OFF);
+  if(timer_mode != TIMER_OFF) {
+    render_timer(now);
+  }
+}
+
+// Half a period before the next tick, so every tick lands in the middle of
+// a hundredth and jitter can't repeat or skip one
+int64_t DisplayController::timer_origin(int64_t now) {
+  int64_t next_tick = executor.get_next_deadline();
+  return (next_tick > now ? next_tick : now) - executor.get_period() / 2;
+}
+
+void DisplayController::render_timer(int64_t now) {
+  int64_t elapsed = timer_elapsed + (timer_running && now > timer_start ? now - timer_start : 0);
+
+  int64_t value = elapsed;
+  if(timer_mode == TIMER_COUNTDOWN) {
+    value = countdown_us > elapsed ? countdown_us - elapsed : 0;
+    if(value == 0 && timer_running) {
+      timer_elapsed = countdown_us;
+      timer_running = false;
+    }
+  }
+
+  // Every hundredth should get exactly one frame; a gap in the count is a
+  // frame that never made it to the tubes
+  if(timer_running) {
+    int64_t count = elapsed / 10000;
+    if(last_count >= 0 && count > last_count + 1) {
+      timer_dropped += count - last_count - 1;
+    }
+    last_count = count;
+    timer_frames++;
+  }
+
+  // MM SS hh, or HH MM SS past the first hour
+  int64_t hundredths = value / 10000;
+  int64_t secs = hundredths / 100;
+  int8_t digits[6];
+  if(secs < 3600) {
+    digits[0] = secs / 600;
+    digits[1] = (secs / 60) % 10;
+    digits[2] = (secs % 60) / 10;
+    digits[3] = secs % 10;
+    digits[4] = (hundredths % 100) / 10;
+    digits[5] = hundredths % 10;
+  } else {
+    int64_t hours = (secs / 3600) % 100;
+    digits[0] = hours / 10;
+    digits[1] = hours % 10;
+    digits[2] = (secs % 3600) / 600;
+    digits[3] = (secs / 60) % 10;
+    digits[4] = (secs % 60) / 10;
+    digits[5] = secs % 10;
+  }
+  tm.set_digits(digits[0], digits[1], digits[2], digits[3], digits[4], digits[5]);
+}
+
+void DisplayController::publish() {
+  tm.get_frame(shown.digits);
+  shown.mode = tm.is_scanning() ? DISPLAY_MODE_BOOT :
+               timer_mode == TIMER_STOPWATCH ? DISPLAY_MODE_STOPWATCH :
+               timer_mode == TIMER_COUNTDOWN ? DISPLAY_MODE_COUNTDOWN :
+               transient_until != 0 ? DISPLAY_MODE_TRANSIENT :
+               tm.is_preventing() ? DISPLAY_MODE_POISON_PREVENTION :
+               !tm.is_idle() ? DISPLAY_MODE_EFFECT : DISPLAY_MODE_CLOCK;
+
+  // Most ticks change nothing, so readers only see a write when they must
+  if(memcmp(&shown, &published, sizeof(shown)) == 0) {
+    return;
+  }
+
+  published = shown;
+  state.publish(published);
+  if(publish_callback) {
+    publish_callback(published);
+  }
+}
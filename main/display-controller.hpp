@@ -0,0 +1,117 @@
+#ifndef DISPLAY_CONTROLLER_HPP
+#define DISPLAY_CONTROLLER_HPP
+
+#include <atomic>
+#include <functional>
+#include <stdint.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+#include "display-state.hpp"
+#include "periodic-executor.hpp"
+#include "tube-driver.hpp"
+#include "tube-manager.hpp"
+
+#define DISPLAY_QUEUE_LEN 16
+
+
+// The only way into the display from other tasks. Requests are copied into a
+// preallocated FreeRTOS queue and applied by the display task between frames,
+// so HomeKit, HTTP, MQTT or the console never wait on SPI and never touch the
+// driver directly. Posting never blocks; when the queue is full the command
+// is dropped and counted.
+class DisplayController {
+public:
+  typedef enum {
+    TIMER_START,
+    TIMER_STOP,
+    TIMER_RESET,
+    TIMER_EXIT
+  } timer_action_t;
+
+  DisplayController(TubeDriver& td, TubeManager& tm, DisplayState& state, PeriodicExecutor& executor);
+  ~DisplayController() {};
+
+  void init();
+  // Runs on the display task for every change to what the tubes show,
+  // including each frame of an effect; must not block
+  void on_publish(std::function<void(const display_snapshot_t&)> callback) { publish_callback = callback; };
+
+  // Safe from any task
+  bool set_digits(const int8_t* digits);
+  bool set_hv(bool on);
+  bool set_brightness(uint8_t percent);
+  bool start_effect(TubeManager::effect_t effect);
+  bool show_transient(const int8_t* digits, uint32_t duration_ms);
+  // Stopwatch and countdown show hundredths on the last two tubes
+  bool stopwatch(timer_action_t action);
+  bool countdown(uint32_t duration_ms);
+  uint32_t get_dropped() { return dropped.load(); };
+  uint32_t get_timer_frames() { return timer_frames.load(); };
+  uint32_t get_timer_dropped() { return timer_dropped.load(); };
+
+  // Display task only
+  void process();
+  void show_clock(const int8_t* digits);
+  void tick(int64_t now);
+  bool is_idle() { return transient_until == 0 && !timer_running && tm.is_idle(); };
+  bool is_timer_running() { return timer_running; };
+
+private:
+  typedef enum {
+    CMD_SET_DIGITS,
+    CMD_HV,
+    CMD_BRIGHTNESS,
+    CMD_EFFECT,
+    CMD_TRANSIENT,
+    CMD_STOPWATCH,
+    CMD_COUNTDOWN
+  } cmd_type_t;
+
+  typedef enum {
+    TIMER_OFF,
+    TIMER_STOPWATCH,
+    TIMER_COUNTDOWN
+  } timer_mode_t;
+
+  typedef struct {
+    cmd_type_t type;
+    int8_t digits[6];
+    uint32_t value;
+  } cmd_t;
+
+  TubeDriver& td;
+  TubeManager& tm;
+  DisplayState& state;
+  PeriodicExecutor& executor;
+
+  QueueHandle_t queue;
+  StaticQueue_t queue_buffer;
+  uint8_t queue_storage[DISPLAY_QUEUE_LEN * sizeof(cmd_t)];
+  std::atomic<uint32_t> dropped;
+
+  int8_t clock_digits[6];
+  int64_t transient_until;
+  timer_mode_t timer_mode;
+  bool timer_running;
+  int64_t timer_start;
+  int64_t timer_elapsed;
+  int64_t countdown_us;
+  int64_t last_count;
+  std::atomic<uint32_t> timer_frames;
+  std::atomic<uint32_t> timer_dropped;
+
+  display_snapshot_t shown;
+  display_snapshot_t published;
+  std::function<void(const display_snapshot_t&)> publish_callback;
+
+  bool post(const cmd_t& cmd);
+  void apply(const cmd_t& cmd, int64_t now);
+  void apply_timer(timer_action_t action, int64_t now);
+  int64_t timer_origin(int64_t now);
+  void render_timer(int64_t now);
+  void publish();
+};
+
+#endif // DISPLAY_CONTROLLER_HPP
@@ -0,0 +1,72 @@
+#include "display-mirror.hpp"
+
+#include <esp_timer.h>
+#include <string.h>
+
+
+DisplayMirror::DisplayMirror(DisplayState& _state) : state(_state), seq(0), app(NULL), ws(NULL), attached(false), have_last(false) {
+  memset(&last, 0, sizeof(last));
+}
+
+void DisplayMirror::attach(App& _app, const char* uri) {
+  app = &_app;
+
+  // Frames published before now were dropped, so start from what is on
+  // the tubes. push() leaves seq alone until attached is set.
+  item_t item;
+  item.snapshot = state.read();
+  item.seq = seq++;
+  item.time = esp_timer_get_time();
+  encode(item, last);
+  have_last = true;
+
+  ws = app->add_websocket(uri, MIRROR_MAX_CLIENTS, [this](struct mg_connection* nc){
+    // New viewers start from the current state rather than a blank display
+    if(have_last) {
+      mg_send_websocket_frame(nc, WEBSOCKET_OP_BINARY, &last, sizeof(last));
+    }
+  });
+  app->add_poller([this](int64_t now){
+    poll();
+    return INT64_MAX;
+  });
+  attached.store(true, std::memory_order_release);
+}
+
+void DisplayMirror::push(const display_snapshot_t& snapshot, int64_t now) {
+  // Nothing drains the ring until the network side is up
+  if(!attached.load(std::memory_order_acquire)) {
+    return;
+  }
+
+  item_t item;
+  item.snapshot = snapshot;
+  item.seq = seq++;
+  item.time = now;
+  if(!queue.push(item)) {
+    queue_dropped.add();
+    return;
+  }
+  app->wake();
+}
+
+void DisplayMirror::poll() {
+  item_t item;
+  while(queue.pop(item)) {
+    encode(item, last);
+    have_last = true;
+    if(ws->clients > 0) {
+      client_skipped.add(app->broadcast(ws, &last, sizeof(last), MIRROR_MAX_BACKLOG));
+    }
+  }
+}
+
+void DisplayMirror::encode(const item_t& item, message_t& message) {
+  message.version = MIRROR_VERSION;
+  message.mode = item.snapshot.mode;
+  message.flags = item.snapshot.hv ? 0x01 : 0x00;
+  message.brightness = item.snapshot.brightness;
+  memcpy(message.digits, item.snapshot.digits, sizeof(message.digits));
+  message.seq = item.seq;
+  message.time_ms = (uint32_t)(item.time / 1000);
+}
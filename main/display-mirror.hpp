@@ -0,0 +1,76 @@
+#ifndef DISPLAY_MIRROR_HPP
+#define DISPLAY_MIRROR_HPP
+
+#include <atomic>
+#include <stdint.h>
+
+#include "app.hpp"
+#include "display-state.hpp"
+#include "metrics.hpp"
+#include "spsc-queue.hpp"
+
+#define MIRROR_QUEUE_LEN      32
+#define MIRROR_MAX_CLIENTS    4
+#define MIRROR_MAX_BACKLOG    1024
+#define MIRROR_VERSION        1
+
+
+// Live view of the tubes over a WebSocket. The display task hands every
+// published snapshot to a lock-free ring; the network task drains it,
+// encodes each frame once and queues the same bytes to every viewer.
+// A viewer whose unsent backlog is over the cap misses frames instead of
+// growing its buffer, and a full ring drops frames instead of blocking the
+// display. Viewers can spot either from gaps in the sequence number.
+//
+// Each message is 18 bytes, little endian:
+//   u8 version, u8 mode, u8 flags (bit 0 HV), u8 brightness,
+//   i8 digits[6] (-1 blank), u32 sequence, u32 uptime in ms
+class DisplayMirror {
+public:
+  DisplayMirror(DisplayState& state);
+  ~DisplayMirror() {};
+
+  // Network task; registers the endpoint and the poller that drains the
+  // ring, and takes the current state as the frame new viewers start from
+  void attach(App& app, const char* uri);
+  // Display task only; wakes the network task to send the frame
+  void push(const display_snapshot_t& snapshot, int64_t now);
+
+  const Counter& get_queue_dropped() { return queue_dropped; };
+  const Counter& get_client_skipped() { return client_skipped; };
+
+private:
+  typedef struct {
+    display_snapshot_t snapshot;
+    uint32_t seq;
+    int64_t time;
+  } item_t;
+
+  typedef struct {
+    uint8_t version;
+    uint8_t mode;
+    uint8_t flags;
+    uint8_t brightness;
+    int8_t digits[6];
+    uint32_t seq;
+    uint32_t time_ms;
+  } __attribute__((packed)) message_t;
+
+  DisplayState& state;
+  SpscQueue<item_t, MIRROR_QUEUE_LEN> queue;
+  uint32_t seq;
+
+  App* app;
+  App::websocket_t* ws;
+  std::atomic<bool> attached;
+  message_t last;
+  bool have_last;
+
+  Counter queue_dropped;
+  Counter client_skipped;
+
+  void poll();
+  static void encode(const item_t& item, message_t& message);
+};
+
+#endif // DISPLAY_MIRROR_HPP
@@ -0,0 +1,87 @@
+#ifndef DISPLAY_STATE_HPP
+#define DISPLAY_STATE_HPP
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+
+
+typedef enum {
+  DISPLAY_MODE_BOOT,
+  DISPLAY_MODE_CLOCK,
+  DISPLAY_MODE_POISON_PREVENTION,
+  DISPLAY_MODE_TRANSIENT,
+  DISPLAY_MODE_EFFECT,
+  DISPLAY_MODE_STOPWATCH,
+  DISPLAY_MODE_COUNTDOWN,
+  DISPLAY_MODE_NIGHT
+} display_mode_t;
+
+typedef struct {
+  int8_t digits[6];
+  bool hv;
+  uint8_t brightness;
+  display_mode_t mode;
+} display_snapshot_t;
+
+inline const char* display_mode_name(display_mode_t mode) {
+  switch(mode) {
+    case DISPLAY_MODE_BOOT: return "boot";
+    case DISPLAY_MODE_CLOCK: return "clock";
+    case DISPLAY_MODE_POISON_PREVENTION: return "prevention";
+    case DISPLAY_MODE_TRANSIENT: return "transient";
+    case DISPLAY_MODE_EFFECT: return "effect";
+    case DISPLAY_MODE_STOPWATCH: return "stopwatch";
+    case DISPLAY_MODE_COUNTDOWN: return "countdown";
+    case DISPLAY_MODE_NIGHT: return "night";
+  }
+  return "unknown";
+}
+
+
+// What the tubes are showing, shared between the display task and anyone
+// who wants to report on it. Readers never block or lock: they copy the
+// snapshot and retry if the sequence number moved underneath them, so a
+// read from HomeKit or HTTP can't stall the 10 ms path. Writers are rare
+// and tiny, and are serialized with a spinlock only among themselves.
+class DisplayState {
+public:
+  DisplayState() : seq(0), write_lock(portMUX_INITIALIZER_UNLOCKED) { memset(&state, 0, sizeof(state)); };
+  ~DisplayState() {};
+
+  display_snapshot_t read() {
+    display_snapshot_t snapshot;
+    uint32_t start;
+    do {
+      while((start = seq.load(std::memory_order_acquire)) & 1) {}
+      memcpy(&snapshot, (const void*)&state, sizeof(snapshot));
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } while(seq.load(std::memory_order_relaxed) != start);
+    return snapshot;
+  };
+
+  void publish(const display_snapshot_t& snapshot) {
+    update([&](display_snapshot_t& current){ current = snapshot; });
+  };
+
+  // Read-modify-write of the fields a caller owns, e.g. only HV
+  template <typename F>
+  void update(F modify) {
+    portENTER_CRITICAL(&write_lock);
+    uint32_t start = seq.load(std::memory_order_relaxed);
+    seq.store(start + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    modify(state);
+    seq.store(start + 2, std::memory_order_release);
+    portEXIT_CRITICAL(&write_lock);
+  };
+
+private:
+  std::atomic<uint32_t> seq;
+  portMUX_TYPE write_lock;
+  display_snapshot_t state;
+};
+
+#endif // DISPLAY_STATE_HPP
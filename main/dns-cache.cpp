@@ -0,0 +1,195 @@
+#include "dns-cache.hpp"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <nvs.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DNS_CACHE_NAMESPACE "dns_cache"
+#define DNS_CACHE_KEY       "answers"
+
+
+static bool is_literal(const char* host, size_t len) {
+  for(size_t i = 0; i < len; i++) {
+    if((host[i] < '0' || host[i] > '9') && host[i] != '.') {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+DnsCache::DnsCache() : mgr(NULL), dirty(false), next_persist(0) {
+  memset(entries, 0, sizeof(entries));
+}
+
+void DnsCache::init(struct mg_mgr* _mgr) {
+  mgr = _mgr;
+  for(entry_t& entry : entries) {
+    entry.cache = this;
+  }
+  load();
+}
+
+int64_t DnsCache::poll(int64_t now) {
+  if(dirty && now >= next_persist) {
+    next_persist = now + DNS_CACHE_PERSIST_US;
+    persist();
+  }
+  return dirty ? next_persist : INT64_MAX;
+}
+
+DnsCache::result_t DnsCache::resolve(const char* address, char* out, size_t len) {
+  const char* scheme = strstr(address, "://");
+  const char* host = scheme != NULL ? scheme + 3 : address;
+  size_t host_len = strcspn(host, ":/");
+
+  if(host_len == 0 || host_len >= DNS_CACHE_NAME_LEN || is_literal(host, host_len)) {
+    snprintf(out, len, "%s", address);
+    return DNS_FOUND;
+  }
+
+  int64_t now = esp_timer_get_time();
+  entry_t* entry = find(host, host_len, now);
+  if(entry == NULL) {
+    // Every entry is busy with a lookup; mongoose resolves this one itself
+    snprintf(out, len, "%s", address);
+    return DNS_FOUND;
+  }
+  entry->last_used = now;
+
+  bool fresh = entry->record.addr != 0 && now < entry->expires;
+  bool stale = entry->record.addr != 0 && now < entry->stale_until;
+  if(!fresh && !entry->pending && now >= entry->negative_until) {
+    lookup(entry, now);
+  }
+
+  if(!stale) {
+    return entry->pending ? DNS_PENDING : DNS_FAILED;
+  }
+  (fresh ? hits : stale_hits).add();
+
+  const uint8_t* ip = (const uint8_t*)&entry->record.addr;
+  snprintf(out, len, "%.*s%u.%u.%u.%u%s", (int)(host - address), address, ip[0], ip[1], ip[2], ip[3], host + host_len);
+  return DNS_FOUND;
+}
+
+
+DnsCache::entry_t* DnsCache::find(const char* name, size_t name_len, int64_t now) {
+  entry_t* victim = NULL;
+  for(entry_t& entry : entries) {
+    if(strncmp(entry.record.name, name, name_len) == 0 && entry.record.name[name_len] == 0) {
+      return &entry;
+    }
+    // Anything with a lookup in flight has to stay put for its callback
+    if(!entry.pending && (victim == NULL || entry.last_used < victim->last_used)) {
+      victim = &entry;
+    }
+  }
+
+  if(victim == NULL) {
+    return NULL;
+  }
+
+  memset(&victim->record, 0, sizeof(victim->record));
+  memcpy(victim->record.name, name, name_len);
+  victim->expires = 0;
+  victim->stale_until = 0;
+  victim->negative_until = 0;
+  victim->pending = false;
+  return victim;
+}
+
+void DnsCache::lookup(entry_t* entry, int64_t now) {
+  lookups.add();
+  if(mg_resolve_async(mgr, entry->record.name, MG_DNS_A_RECORD, &DnsCache::on_resolved, entry) != 0) {
+    failures.add();
+    entry->negative_until = now + DNS_CACHE_NEGATIVE_US;
+    return;
+  }
+  entry->pending = true;
+}
+
+void DnsCache::on_resolved(struct mg_dns_message* msg, void* data, enum mg_resolve_err err) {
+  entry_t* entry = (entry_t*)data;
+  DnsCache* cache = entry->cache;
+  int64_t now = esp_timer_get_time();
+  entry->pending = false;
+
+  struct mg_dns_resource_record* rr = NULL;
+  struct in_addr addr;
+  if(err == MG_RESOLVE_OK && msg != NULL) {
+    rr = mg_dns_next_record(msg, MG_DNS_A_RECORD, NULL);
+  }
+  if(rr == NULL || mg_dns_parse_record_data(msg, rr, &addr, sizeof(addr)) != 0) {
+    // A stale answer stays usable; the failure only paces the retries
+    cache->failures.add();
+    entry->negative_until = now + DNS_CACHE_NEGATIVE_US;
+    ESP_LOGI("DNS", "Lookup of %s failed (%d)%s", entry->record.name, err, entry->record.addr != 0 ? ", keeping stale answer" : "");
+    return;
+  }
+
+  int ttl = rr->ttl < DNS_CACHE_MIN_TTL_SECS ? DNS_CACHE_MIN_TTL_SECS : rr->ttl > DNS_CACHE_MAX_TTL_SECS ? DNS_CACHE_MAX_TTL_SECS : rr->ttl;
+  entry->expires = now + (int64_t)ttl * 1000000;
+  entry->stale_until = entry->expires + DNS_CACHE_STALE_US;
+  entry->negative_until = 0;
+
+  if(entry->record.addr != addr.s_addr) {
+    entry->record.addr = addr.s_addr;
+    cache->dirty = true;
+  }
+}
+
+
+void DnsCache::load() {
+  nvs_handle_t handle;
+  if(nvs_open(DNS_CACHE_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+    return;
+  }
+
+  record_t records[DNS_CACHE_ENTRIES];
+  size_t len = sizeof(records);
+  esp_err_t ret = nvs_get_blob(handle, DNS_CACHE_KEY, records, &len);
+  nvs_close(handle);
+  if(ret != ESP_OK || len % sizeof(record_t) != 0) {
+    return;
+  }
+
+  // Last boot's answers have no TTL left to trust, so they start out stale
+  int64_t now = esp_timer_get_time();
+  for(size_t i = 0; i < len / sizeof(record_t); i++) {
+    records[i].name[DNS_CACHE_NAME_LEN - 1] = 0;
+    entries[i].record = records[i];
+    entries[i].stale_until = now + DNS_CACHE_STALE_US;
+    entries[i].last_used = now;
+  }
+  ESP_LOGI("DNS", "Loaded %u cached answers", (unsigned int)(len / sizeof(record_t)));
+}
+
+void DnsCache::persist() {
+  record_t records[DNS_CACHE_ENTRIES];
+  size_t count = 0;
+  for(const entry_t& entry : entries) {
+    if(entry.record.addr != 0) {
+      records[count++] = entry.record;
+    }
+  }
+
+  nvs_handle_t handle;
+  if(nvs_open(DNS_CACHE_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+    return;
+  }
+
+  esp_err_t ret = nvs_set_blob(handle, DNS_CACHE_KEY, records, count * sizeof(record_t));
+  if(ret == ESP_OK) {
+    ret = nvs_commit(handle);
+  }
+  nvs_close(handle);
+
+  if(ret != ESP_OK) {
+    ESP_LOGI("DNS", "Failed to store DNS cache: %s", esp_err_to_name(ret));
+    return;
+  }
+  dirty = false;
+}
@@ -0,0 +1,91 @@
+#ifndef DNS_CACHE_HPP
+#define DNS_CACHE_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "metrics.hpp"
+#include "mongoose.h"
+
+#define DNS_CACHE_ENTRIES       4
+#define DNS_CACHE_NAME_LEN      48
+#define DNS_CACHE_MIN_TTL_SECS  60
+#define DNS_CACHE_MAX_TTL_SECS  86400
+#define DNS_CACHE_NEGATIVE_US   30000000LL
+#define DNS_CACHE_STALE_US      86400000000LL
+#define DNS_CACHE_PERSIST_US    3600000000LL
+
+
+// A records for the few hosts the clock talks to, in front of mongoose's
+// async resolver. Answers are kept for their TTL, clamped to a sane range.
+// Past that they are still handed out for up to a day while a refresh runs
+// in the background, so a slow or unreachable DNS server never holds up a
+// sync that already knows where to go. Failed lookups are remembered
+// briefly so a dead server isn't asked again on every poll.
+//
+// The last good answers are written to NVS, at most hourly, and come back
+// on the next boot as stale entries: the first sync after power up goes
+// out at once and the lookup catches up behind it.
+//
+// Network task only.
+class DnsCache {
+public:
+  typedef enum {
+    DNS_FOUND,
+    DNS_PENDING,
+    DNS_FAILED
+  } result_t;
+
+  DnsCache();
+  ~DnsCache() {};
+
+  void init(struct mg_mgr* mgr);
+  // Returns when it next needs to run
+  int64_t poll(int64_t now);
+
+  // Takes a mongoose address, "[proto://]host[:port]", and writes it back
+  // out with the host replaced by its cached IPv4 address. Literal
+  // addresses and names too long to cache are passed through unchanged.
+  result_t resolve(const char* address, char* out, size_t len);
+
+  const Counter& get_hits() const { return hits; };
+  const Counter& get_stale_hits() const { return stale_hits; };
+  const Counter& get_lookups() const { return lookups; };
+  const Counter& get_failures() const { return failures; };
+
+private:
+  // Persisted as a blob, so the layout is part of the NVS format
+  typedef struct {
+    char name[DNS_CACHE_NAME_LEN];
+    uint32_t addr;
+  } record_t;
+
+  typedef struct {
+    record_t record;
+    DnsCache* cache;
+    int64_t expires;
+    int64_t stale_until;
+    int64_t negative_until;
+    int64_t last_used;
+    bool pending;
+  } entry_t;
+
+  struct mg_mgr* mgr;
+  entry_t entries[DNS_CACHE_ENTRIES];
+  bool dirty;
+  int64_t next_persist;
+
+  Counter hits;
+  Counter stale_hits;
+  Counter lookups;
+  Counter failures;
+
+  static void on_resolved(struct mg_dns_message* msg, void* data, enum mg_resolve_err err);
+
+  entry_t* find(const char* name, size_t name_len, int64_t now);
+  void lookup(entry_t* entry, int64_t now);
+  void load();
+  void persist();
+};
+
+#endif // DNS_CACHE_HPP
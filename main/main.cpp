@@ -6,16 +6,17 @@
 #include <esp_int_wdt.h>
 #include <esp_log.h>
 #include <esp_system.h>
+#include <esp_timer.h>
 #include <esp_wifi.h>
 #include <freertos/event_groups.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <lwip/err.h>
-#include <lwip/apps/sntp.h>
 #include <nvs_flash.h>
 #include <sodium.h>
 #include <sys/time.h>
 #include <time.h>
+#include <atomic>
 
 
 #include <soc/soc.h>
@@ -26,9 +27,27 @@
 #include "mongoose.h"
 #include "sdkconfig.h"
 
+#include "app.hpp"
+#include "asset-server.hpp"
+#include "display-controller.hpp"
+#include "display-mirror.hpp"
+#include "display-state.hpp"
+#include "dns-cache.hpp"
+#include "mem-pool.h"
+#include "metrics.hpp"
+#include "mqtt-publisher.hpp"
+#include "night-mode.hpp"
+#include "ota-updater.hpp"
+#include "periodic-executor.hpp"
+#include "peer-sync.hpp"
+#include "power-manager.hpp"
 #include "tube-driver.hpp"
 #include "rtc-driver.hpp"
+#include "status-api.hpp"
+#include "time-sync.hpp"
 #include "tube-manager.hpp"
+#include "wear-counters.hpp"
+#include "wifi-manager.hpp"
 
 #include "rollkit.hpp"
 
@@ -38,6 +57,12 @@
 #define GPIO_OUTPUT_IO_BL        17
 #define GPIO_OUTPUT_IO_HV_DIS    18
 
+// DS3231 INT/SQW, must be an RTC GPIO to wake from deep sleep
+#define GPIO_INPUT_IO_RTC_INT    4
+
+#define DISPLAY_TASK_CORE        1
+#define DISPLAY_TASK_PRIORITY    (configMAX_PRIORITIES - 5)
+
 #define SPI_MOSI    13
 #define SPI_SCLK    14
 
@@ -45,32 +70,53 @@
 #define RTC_I2C_SDA 27
 #define RTC_I2C_SCL 26
 
-#define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT      BIT1
-
 
 RTCDriver rtc(RTC_I2C_PORT, RTC_I2C_SDA, RTC_I2C_SCL);
 TubeDriver tubes(SPI_MOSI, SPI_SCLK, GPIO_OUTPUT_IO_LE, GPIO_OUTPUT_IO_POL, GPIO_OUTPUT_IO_BL, GPIO_OUTPUT_IO_HV_DIS);
 TubeManager tm(tubes);
+WearCounters wear(tm, tubes, WEAR_FLUSH_SECS);
+NightMode night(rtc, tubes, GPIO_INPUT_IO_RTC_INT, NIGHT_START_HOUR, NIGHT_END_HOUR);
+
+App app;
+PeerSync peer_sync(PEER_SYNC_PRIORITY);
+PowerManager power(POWER_MAX_CPU_MHZ, POWER_MIN_CPU_MHZ, POWER_LIGHT_SLEEP);
+PerfLock display_lock("display");
 
 rollkit::App rollkit_app;
 rollkit::Accessory acc;
 rollkit::Service acc_switch;
 rollkit::Characteristic acc_switch_on_char;
 rollkit::Characteristic acc_switch_name_char;
+rollkit::Service acc_stopwatch;
+rollkit::Characteristic acc_stopwatch_on_char;
+rollkit::Characteristic acc_stopwatch_name_char;
+
+WifiManager wifi(WIFI_SSID, WIFI_PASS);
+DnsCache dns;
+TimeSync time_sync(wifi, dns, NTP_SERVER, HTTP_TIME_URLS, NTP_INTERVAL_SECS);
+
+// Written once by app_main, read every tick by the display task
+std::atomic<bool> time_set(false);
 
-EventGroupHandle_t wifi_event_group;
+DisplayState display_state;
 
-bool time_set = false;
 
+PeriodicExecutor display_executor("display_tick", 10000);
+DisplayController display(tubes, tm, display_state, display_executor);
+MetricsRegistry metrics;
+DisplayMirror mirror(display_state);
+OtaUpdater ota(wifi, OTA_TOKEN);
+MqttPublisher mqtt(wifi, dns, display_state, MQTT_BROKER, MQTT_TOPIC, MQTT_INTERVAL_SECS);
+StatusApi status_api(display, display_state, time_sync, peer_sync, wifi);
+AssetServer assets;
 
 void init_rollkit(const std::string& mac) {
   rollkit_app.init(ACC_NAME, ACC_MODEL, ACC_MANUFACTURER, ACC_FIRMWARE_REVISION, ACC_SETUP_CODE, mac);
 
   acc_switch_on_char = rollkit::Characteristic(
     APPL_CHAR_UUID_ON,
-    [](nlohmann::json v){ if((bool)v.get<int>()) { tubes.enable_hv(); } else { tubes.disable_hv(); }},
-    []() -> nlohmann::json { return tubes.hv_enabled(); },
+    [](nlohmann::json v){ display.set_hv(v.get<int>() != 0); },
+    []() -> nlohmann::json { return display_state.read().hv; },
     "bool",
     {"pr", "pw", "ev"}
   );
@@ -89,75 +135,38 @@ void init_rollkit(const std::string& mac) {
   acc_switch.register_characteristic(acc_switch_on_char);
   acc_switch.register_characteristic(acc_switch_name_char);
   acc.register_service(acc_switch);
-  rollkit_app.register_accessory(acc);
-  rollkit_app.start();
-}
 
-
-void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
-  static uint32_t s_retry_num = 0;
-  if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-    esp_wifi_connect();
-  } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-    if (s_retry_num < 1000) {
-      esp_wifi_connect();
-      s_retry_num++;
-      ESP_LOGI("main", "Retrying WiFi connection");
-    } else {
-      xEventGroupSetBits(wifi_event_group, WIFI_FAIL_BIT);
-    }
-    ESP_LOGI("main","Failed to connect to AP");
-  } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-    ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-    ESP_LOGI("main", "Recevied IP:" IPSTR, IP2STR(&event->ip_info.ip));
-    s_retry_num = 0;
-    xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
-  }
-}
-
-
-void config_wifi() {
-  ESP_ERROR_CHECK(esp_netif_init());
-  wifi_event_group = xEventGroupCreate();
-
-  ESP_ERROR_CHECK(esp_event_loop_create_default());
-  auto net_if = esp_netif_create_default_wifi_sta();
-  ESP_ERROR_CHECK(esp_netif_set_hostname(net_if, "NixieClock"));
-
-  wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-  ESP_ERROR_CHECK(esp_wifi_init(&cfg));
-
-  esp_event_handler_instance_t instance_any_id;
-  esp_event_handler_instance_t instance_got_ip;
-  ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
-                                                      ESP_EVENT_ANY_ID,
-                                                      &wifi_event_handler,
-                                                      NULL,
-                                                      &instance_any_id));
-  ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
-                                                      IP_EVENT_STA_GOT_IP,
-                                                      &wifi_event_handler,
-                                                      NULL,
-                                                      &instance_got_ip));
-
-  wifi_config_t wifi_config = {};
-  strcpy((char*)wifi_config.sta.ssid, WIFI_SSID);
-  strcpy((char*)wifi_config.sta.password, WIFI_PASS);
-  wifi_config.sta.threshold.authmode = WIFI_AUTH_WPA2_PSK;
-
-  ESP_LOGI("WiFi", "Setting WiFi configuration SSID %s...", wifi_config.sta.ssid);
-  ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-  ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
-  ESP_ERROR_CHECK(esp_wifi_start());
-
-  ESP_LOGI("WiFi", "Waiting for connection....");
-  EventBits_t bits = xEventGroupWaitBits(wifi_event_group,
-    WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-    pdFALSE,
-    pdFALSE,
-    portMAX_DELAY
+  acc_stopwatch_on_char = rollkit::Characteristic(
+    APPL_CHAR_UUID_ON,
+    [](nlohmann::json v){
+      if(v.get<int>() != 0) {
+        display.stopwatch(DisplayController::TIMER_RESET);
+        display.stopwatch(DisplayController::TIMER_START);
+      } else {
+        display.stopwatch(DisplayController::TIMER_EXIT);
+      }
+    },
+    []() -> nlohmann::json { return display_state.read().mode == DISPLAY_MODE_STOPWATCH; },
+    "bool",
+    {"pr", "pw", "ev"}
   );
-  ESP_LOGI("WiFi", "Connected");
+  acc_stopwatch_name_char = rollkit::Characteristic(
+    APPL_CHAR_UUID_NAME,
+    [](nlohmann::json v){},
+    []() -> nlohmann::json { return "Stopwatch"; },
+    "string",
+    {"pr"}
+  );
+  acc_stopwatch = rollkit::Service(
+    APPL_SRVC_UUID_SWITCH,
+    false,
+    false
+  );
+  acc_stopwatch.register_characteristic(acc_stopwatch_on_char);
+  acc_stopwatch.register_characteristic(acc_stopwatch_name_char);
+  acc.register_service(acc_stopwatch);
+  rollkit_app.register_accessory(acc);
+  rollkit_app.start();
 }
 
 
@@ -174,37 +183,52 @@ void configure_clock(struct tm& time_info) {
   rtc.sync();
 }
 
-void set_tubes() {
+void seed_time_from_rtc() {
+  if(!rtc.sync()) {
+    return;
+  }
+
+  // The RTC holds local time with tm_year and tm_mon offsets
+  struct tm time_info = {};
+  time_info.tm_sec = rtc.get_sec();
+  time_info.tm_min = rtc.get_min();
+  time_info.tm_hour = rtc.get_hour();
+  time_info.tm_mday = rtc.get_date();
+  time_info.tm_mon = rtc.get_month();
+  time_info.tm_year = rtc.get_year();
+  time_info.tm_isdst = -1;
+
+  struct timeval tv = {};
+  tv.tv_sec = mktime(&time_info);
+  settimeofday(&tv, NULL);
+}
+
+void rtc_digits(int8_t* digits) {
   rtc.sync();
 
-  tm.set_digits(
-    rtc.get_hour() / 10, rtc.get_hour() % 10,
-    rtc.get_min() / 10, rtc.get_min() % 10,
-    rtc.get_sec() / 10, rtc.get_sec() % 10
-  );
+  digits[0] = rtc.get_hour() / 10;
+  digits[1] = rtc.get_hour() % 10;
+  digits[2] = rtc.get_min() / 10;
+  digits[3] = rtc.get_min() % 10;
+  digits[4] = rtc.get_sec() / 10;
+  digits[5] = rtc.get_sec() % 10;
 }
 
+void time_digits(time_t now, int8_t* digits) {
+  struct tm time_info = {};
+  localtime_r(&now, &time_info);
 
-void init_ntp() {
-  ESP_LOGI("NTP", "Initializing SNTP");
-  setenv("TZ", "EST+5EDT,M3.2.0,M11.1.0", 1);
-  tzset();
-  sntp_setoperatingmode(SNTP_OPMODE_POLL);
-  sntp_setservername(0, (char*)"pool.ntp.org");
-  sntp_init();
+  digits[0] = time_info.tm_hour / 10;
+  digits[1] = time_info.tm_hour % 10;
+  digits[2] = time_info.tm_min / 10;
+  digits[3] = time_info.tm_min % 10;
+  digits[4] = time_info.tm_sec / 10;
+  digits[5] = time_info.tm_sec % 10;
+}
 
-  // wait for time to be set
-  time_t now = 0;
-  struct tm timeinfo = {};
-  int retry = 0;
-  const int retry_count = 10;
-  while(timeinfo.tm_year < (2016 - 1900) && ++retry < retry_count) {
-      vTaskDelay(100);
-      time(&now);
-      localtime_r(&now, &timeinfo);
-  }
-  ESP_LOGI("TIME", "Current Time: %i:%i:%i", (int)timeinfo.tm_hour, (int)timeinfo.tm_min, (int)timeinfo.tm_sec);
-  ESP_LOGI("NTP", "Clock synced");
+bool timebase_valid(int64_t now_us) {
+  // Anything before 2016 means neither NTP nor a sync leader has set the time
+  return now_us > 1451606400LL * 1000000;
 }
 
 
@@ -223,32 +247,169 @@ void update_rtc() {
 }
 
 
-TaskHandle_t main_task_handle;
-void main_task(void* ctx_ptr) {
+void update_nameserver() {
+  // mongoose resolves through its own DNS client, point it at the DHCP server
+  static uint32_t current = 0;
+  if(!wifi.is_connected()) {
+    return;
+  }
+
+  esp_netif_dns_info_t dns_info;
+  if(esp_netif_get_dns_info(wifi.get_netif(), ESP_NETIF_DNS_MAIN, &dns_info) != ESP_OK ||
+     dns_info.ip.u_addr.ip4.addr == 0 || dns_info.ip.u_addr.ip4.addr == current) {
+    return;
+  }
+
+  char nameserver[16];
+  uint8_t* ip = (uint8_t*)&dns_info.ip.u_addr.ip4.addr;
+  snprintf(nameserver, sizeof(nameserver), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+  mg_set_nameserver(app.get_mgr(), nameserver);
+  current = dns_info.ip.u_addr.ip4.addr;
+}
+
+
+void report_display_stats() {
+  PeriodicExecutor::stats_t stats = display_executor.get_stats(true);
+
+  ESP_LOGI("Display", "%u periods, %u missed, exec avg %lld us max %lld us, late avg %lld us max %lld us, %u commands dropped, %u/%u timer frames dropped",
+    stats.periods, stats.missed,
+    stats.periods ? stats.exec_sum_us / stats.periods : 0, stats.exec_max_us,
+    stats.periods ? stats.late_sum_us / stats.periods : 0, stats.late_max_us,
+    display.get_dropped(), display.get_timer_dropped(), display.get_timer_frames()
+  );
+}
+
+
+void register_metrics() {
+  metrics.add_histogram("nixie_display_tick_lateness_seconds", "Display tick wakeup lateness", display_executor.get_lateness());
+  metrics.add_histogram("nixie_spi_frame_seconds", "Tube frame SPI transfer and latch time", tubes.get_frame_latency());
+  metrics.add_counter("nixie_spi_errors_total", "Failed tube SPI transfers", tubes.get_spi_errors());
+  metrics.add_histogram("nixie_i2c_transaction_seconds", "RTC I2C transaction time", rtc.get_transaction_latency());
+  metrics.add_counter("nixie_i2c_errors_total", "Failed RTC I2C transactions", rtc.get_errors());
+
+  metrics.add_gauge("nixie_ntp_offset_seconds", "Clock offset at the last NTP sync", [](){ return time_sync.get_stats().offset_us / 1e6; });
+  metrics.add_gauge("nixie_ntp_delay_seconds", "Round trip of the last NTP sync", [](){ return time_sync.get_stats().delay_us / 1e6; });
+  metrics.add_gauge("nixie_ntp_jitter_seconds", "Spread of recent NTP offsets", [](){ return time_sync.get_stats().jitter_us / 1e6; });
+  metrics.add_counter("nixie_ntp_syncs_total", "Successful NTP syncs", [](){ return (double)time_sync.get_stats().syncs; });
+  metrics.add_counter("nixie_ntp_http_syncs_total", "Syncs that fell back to HTTP Date headers", [](){ return (double)time_sync.get_stats().http_syncs; });
+  metrics.add_counter("nixie_ntp_failures_total", "Failed NTP syncs", [](){ return (double)time_sync.get_stats().failures; });
+
+  metrics.add_counter("nixie_dns_cache_hits_total", "Lookups answered from the DNS cache", dns.get_hits());
+  metrics.add_counter("nixie_dns_cache_stale_hits_total", "Lookups answered with an expired entry while it refreshed", dns.get_stale_hits());
+  metrics.add_counter("nixie_dns_lookups_total", "Queries sent to the DNS server", dns.get_lookups());
+  metrics.add_counter("nixie_dns_failures_total", "DNS queries that failed or timed out", dns.get_failures());
+
+  metrics.add_counter("nixie_wifi_connects_total", "Wi-Fi associations", [](){ return (double)wifi.get_stats().connects; });
+  metrics.add_counter("nixie_wifi_disconnects_total", "Wi-Fi disconnects", [](){ return (double)wifi.get_stats().disconnects; });
+  metrics.add_gauge("nixie_wifi_rssi_dbm", "Last sampled RSSI", [](){ return (double)wifi.get_stats().rssi; });
+
+  metrics.add_counter("nixie_mirror_queue_dropped_total", "Mirror frames dropped before reaching the network task", mirror.get_queue_dropped());
+  metrics.add_counter("nixie_mirror_client_skipped_total", "Mirror frames skipped for backlogged viewers", mirror.get_client_skipped());
+
+  metrics.add_counter("nixie_mqtt_messages_total", "Telemetry batches published", mqtt.get_published());
+  metrics.add_counter("nixie_mqtt_bytes_total", "Telemetry payload bytes published", mqtt.get_bytes());
+  metrics.add_counter("nixie_mqtt_held_total", "Telemetry batches held back by a full send buffer", mqtt.get_held());
+  metrics.add_counter("nixie_mqtt_connects_total", "Broker connections", mqtt.get_connects());
+
+  metrics.add_counter("nixie_assets_served_total", "Web UI assets sent in full", assets.get_served());
+  metrics.add_counter("nixie_assets_not_modified_total", "Web UI requests answered with 304", assets.get_not_modified());
+
+  metrics.add_gauge("nixie_mg_pool_block_bytes", "Mongoose pool bytes in use", [](){ mem_pool_stats_t s; mem_pool_get_stats(&s); return (double)s.block_bytes; });
+  metrics.add_gauge("nixie_mg_pool_requested_bytes", "Mongoose pool bytes requested; the rest of the blocks in use is slack", [](){ mem_pool_stats_t s; mem_pool_get_stats(&s); return (double)s.requested_bytes; });
+  metrics.add_gauge("nixie_mg_pool_high_water_bytes", "Most mongoose pool bytes ever in use", [](){ mem_pool_stats_t s; mem_pool_get_stats(&s); return (double)s.block_bytes_high_water; });
+  metrics.add_counter("nixie_mg_pool_heap_fallbacks_total", "Mongoose allocations that missed the pool and went to the heap", [](){ mem_pool_stats_t s; mem_pool_get_stats(&s); return (double)s.heap_fallbacks; });
+
+  metrics.add_gauge("nixie_heap_free_bytes", "Free heap", [](){ return (double)esp_get_free_heap_size(); });
+  metrics.add_gauge("nixie_heap_min_free_bytes", "Lowest free heap since boot", [](){ return (double)esp_get_minimum_free_heap_size(); });
+  metrics.add_counter("nixie_uptime_seconds", "Time since boot", [](){ return esp_timer_get_time() / 1e6; });
+}
+
+
+void register_telemetry() {
+  mqtt.add_field("heap", 4096, [](){ return (double)esp_get_free_heap_size(); });
+  mqtt.add_field("heap_min", 0, [](){ return (double)esp_get_minimum_free_heap_size(); });
+  mqtt.add_field("rssi", 3, [](){ return (double)wifi.get_stats().rssi; });
+  mqtt.add_field("wifi_disc", 0, [](){ return (double)wifi.get_stats().disconnects; });
+  mqtt.add_field("ntp_jitter_us", 1000, [](){ return (double)time_sync.get_stats().jitter_us; });
+  mqtt.add_field("ntp_fail", 0, [](){ return (double)time_sync.get_stats().failures; });
+  mqtt.add_field("peer_locked", 0, [](){ return peer_sync.get_stats().locked ? 1.0 : 0.0; });
+  mqtt.add_field("cmd_dropped", 0, [](){ return (double)display.get_dropped(); });
+}
+
+
+void display_task(void* ctx_ptr) {
+  display_executor.init();
+  display_executor.on_wake([](){ display.process(); });
+
   tubes.enable_hv();
-  while(1) {
-    vTaskDelay(10 / portTICK_PERIOD_MS);
-    tm.tick_10ms();
 
-    if(!time_set) {
+  int8_t digits[6];
+  time_t shown = 0;
+  while(1) {
+    display.process();
+
+    // Nothing is animating, so the latched digits hold until the next
+    // second; sleep straight to it and let the chip drop into light sleep
+    int64_t now = peer_sync.now_us();
+    if(time_set && timebase_valid(now) && display.is_idle()) {
+      display_lock.release();
+      int64_t to_boundary = 1000000 - (now % 1000000);
+      display_executor.wait_until(esp_timer_get_time() + to_boundary);
+
+      time_t second = (time_t)((now + to_boundary) / 1000000);
+      if(night.is_night(second) && night.may_sleep(esp_timer_get_time())) {
+        display_state.update([](display_snapshot_t& state){ state.hv = false; state.mode = DISPLAY_MODE_NIGHT; });
+        wear.flush();
+        esp_wifi_stop();
+        night.enter(second);
+      }
+
+      time_digits(second, digits);
+      display.show_clock(digits);
+      shown = second;
+      display.tick(esp_timer_get_time());
       continue;
     }
 
-    static uint32_t set_tube_timer = 1;
-    if(set_tube_timer % 10 == 0) {
-      set_tubes();
-      set_tube_timer = 0;
-    }
-    set_tube_timer++;
+    display_lock.acquire();
+    display_executor.wait_next();
 
+    // A running timer needs every 10 ms tick on the grid; the clock digits
+    // aren't shown, so the second boundary is left alone
+    if(!time_set || display.is_timer_running()) {
+      display.tick(esp_timer_get_time());
+      continue;
+    }
 
-    static uint32_t sync_timer = 1;
-    if(sync_timer % 3600000 == 0) {
-      ESP_LOGI("NTP", "Updating RTC Clock");
-      update_rtc();
-      sync_timer = 0;
+    // When the shared timebase rolls over within this tick, sleep until the
+    // exact boundary so every clock on the LAN flips together. Ticks stay on
+    // the grid restarted at the last boundary, so one may also land just
+    // past it.
+    now = peer_sync.now_us();
+    if(timebase_valid(now)) {
+      int64_t to_boundary = 1000000 - (now % 1000000);
+      if(to_boundary <= display_executor.get_period()) {
+        display_executor.wait_until(esp_timer_get_time() + to_boundary);
+        now += to_boundary;
+      }
+
+      time_t second = (time_t)(now / 1000000);
+      if(second != shown) {
+        time_digits(second, digits);
+        display.show_clock(digits);
+        shown = second;
+      }
+    } else {
+      static uint32_t set_tube_timer = 1;
+      if(set_tube_timer % 10 == 0) {
+        rtc_digits(digits);
+        display.show_clock(digits);
+        set_tube_timer = 0;
+      }
+      set_tube_timer++;
     }
-    sync_timer++;
+    display.tick(esp_timer_get_time());
+
   }
 }
 
@@ -257,21 +418,137 @@ extern "C" {
 	void app_main(void);
 }
 void app_main(void) {
-  xTaskCreatePinnedToCore(&main_task, "main_task", 20000, NULL, 1, &main_task_handle, 0);
+  night.on_boot();
+  ota.on_boot();
+  power.init();
+  // The mirror drops frames published before it is attached; attach()
+  // starts it from the display state instead
+  display.on_publish([](const display_snapshot_t& snapshot){ mirror.push(snapshot, esp_timer_get_time()); });
+  display.init();
+
+  // Wi-Fi, lwIP, mongoose and HomeKit all live on core 0; the display gets
+  // core 1 to itself so network bursts can't delay a tick
+  xTaskCreatePinnedToCore(&display_task, "display_task", 20000, NULL, DISPLAY_TASK_PRIORITY, NULL, DISPLAY_TASK_CORE);
+
+  // Digits come straight from the RTC so the display is back within a few
+  // hundred milliseconds of a night mode wakeup, long before the network
+  setenv("TZ", "EST+5EDT,M3.2.0,M11.1.0", 1);
+  tzset();
+  rtc.init();
+  if(night.woke_from_night()) {
+    night.disarm();
+  }
+  seed_time_from_rtc();
+
+  int8_t digits[6];
+  rtc_digits(digits);
+  display.set_digits(digits);
+  time_set = true;
 
   ESP_ERROR_CHECK(nvs_flash_init());
-  config_wifi();
-  init_ntp();
-  rtc.init();
-  update_rtc();
+  wear.init();
+
+  // Bring Wi-Fi up in the background; the display runs from the RTC until
+  // the network is available
+  wifi.set_policy(WIFI_POLICY, WIFI_CONTROL_WINDOW_SECS);
+  wifi.start();
 
   std::string mac_address(17, 0);
   uint8_t mac[6];
   ESP_ERROR_CHECK(esp_wifi_get_mac(WIFI_IF_STA, mac));
   sprintf(&mac_address[0], "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 
-  set_tubes();
-  init_rollkit(mac_address);
+  app.init();
+  dns.init(app.get_mgr());
+  app.add_poller([](int64_t now){ return dns.poll(now); });
+  peer_sync.init(app.get_mgr(), (uint32_t)mac[2] << 24 | (uint32_t)mac[3] << 16 | (uint32_t)mac[4] << 8 | mac[5]);
+  app.add_poller([](int64_t now){ return peer_sync.poll(now); });
+
+  time_sync.init(app.get_mgr());
+  time_sync.on_sync([](int64_t offset){
+    ESP_LOGI("NTP", "Updating RTC Clock");
+    update_rtc();
+    mqtt.add_event("sync", offset);
+  });
+  app.add_poller([](int64_t now){ return time_sync.poll(now); });
+  app.add_poller([](int64_t now){
+    update_nameserver();
+    return INT64_MAX;
+  });
+  app.add_poller([](int64_t now){
+    static int64_t next_report = 0;
+    if(now >= next_report) {
+      next_report = now + 600000000LL;
+      power.report();
+    }
+    return next_report;
+  });
+  app.add_poller([](int64_t now){
+    static int64_t next_report = 60000000LL;
+    if(now >= next_report) {
+      next_report = now + 60000000LL;
+      report_display_stats();
+    }
+    return next_report;
+  });
+  app.add_poller([](int64_t now){ return wear.poll(now); });
+
+  char client_id[16];
+  snprintf(client_id, sizeof(client_id), "nixie-%02x%02x%02x", mac[3], mac[4], mac[5]);
+  mqtt.init(app.get_mgr(), client_id);
+  register_telemetry();
+  app.add_poller([](int64_t now){ return mqtt.poll(now); });
+  app.add_json_route("/wear", [](struct http_message* hm, char* buf, size_t size, size_t& len){
+    len = wear.render_json(buf, size);
+    return 200;
+  });
+  app.add_json_route("/pool", [](struct http_message* hm, char* buf, size_t size, size_t& len){
+    len = mem_pool_render_json(buf, size);
+    return 200;
+  });
+  app.add_json_route("/timer", [](struct http_message* hm, char* buf, size_t size, size_t& len){
+    char action[8];
+    char secs[12];
+    bool ok = true;
+    if(mg_get_http_var(&hm->query_string, "countdown", secs, sizeof(secs)) > 0) {
+      ok = display.countdown((uint32_t)strtoul(secs, NULL, 10) * 1000);
+    } else if(mg_get_http_var(&hm->query_string, "action", action, sizeof(action)) > 0) {
+      if(strcmp(action, "start") == 0) {
+        ok = display.stopwatch(DisplayController::TIMER_START);
+      } else if(strcmp(action, "stop") == 0) {
+        ok = display.stopwatch(DisplayController::TIMER_STOP);
+      } else if(strcmp(action, "reset") == 0) {
+        ok = display.stopwatch(DisplayController::TIMER_RESET);
+      } else if(strcmp(action, "exit") == 0) {
+        ok = display.stopwatch(DisplayController::TIMER_EXIT);
+      } else {
+        len = snprintf(buf, size, "{\"error\":\"invalid action\"}");
+        return 400;
+      }
+    }
 
-  time_set = true;
+    len = snprintf(buf, size, "{\"mode\":\"%s\",\"frames\":%u,\"dropped\":%u}",
+      display_mode_name(display_state.read().mode), display.get_timer_frames(), display.get_timer_dropped()
+    );
+    return ok ? 200 : 503;
+  });
+  status_api.attach(app);
+  if(assets.init("assets")) {
+    assets.attach(app);
+  }
+  mirror.attach(app, "/ws/display");
+  ota.on_before_restart([](){ wear.flush(); });
+  ota.set_health_check([](){
+    // A new image has to keep time, drive the tubes and reach the network
+    return time_set && wifi.is_connected() && display_executor.get_stats(false).periods > 0;
+  });
+  ota.attach(app, "/ota");
+  register_metrics();
+  metrics.attach(app, "/metrics");
+  app.listen_http(HTTP_PORT);
+  app.start();
+
+  // Only the network dependent setup waits on the connection
+  wifi.wait_connected(portMAX_DELAY);
+  init_rollkit(mac_address);
 }
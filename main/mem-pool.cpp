@@ -0,0 +1,301 @@
+#include "mem-pool.h"
+
+#include <freertos/FreeRTOS.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  uint16_t size;
+  uint16_t count;
+} class_config_t;
+
+// Sized from the network task's peak: APP_HTTP_SLOTS HTTP responses and
+// the display mirror viewers with their mbufs and HTTP state, plus MQTT, NTP,
+// peer sync and DNS. Connections themselves take a 256 byte block; the
+// large classes hold receive buffers and send mbufs, up to a full JSON
+// response or APP_TX_CHUNK of an asset.
+static constexpr class_config_t class_config[MEM_POOL_CLASSES] = {
+  {32, 32},
+  {64, 32},
+  {128, 16},
+  {256, 16},
+  {512, 8},
+  {1024, 8},
+  {2048, 4},
+  {4096, 2}
+};
+
+static constexpr size_t total(size_t i, bool bytes) {
+  return i == MEM_POOL_CLASSES ? 0 : (bytes ? class_config[i].size : 1) * class_config[i].count + total(i + 1, bytes);
+}
+
+typedef struct block {
+  struct block* next;
+} block_t;
+
+typedef struct {
+  uint8_t* base;
+  uint8_t* end;
+  uint16_t* requested;
+  block_t* free_list;
+} pool_class_t;
+
+static uint8_t arena[total(0, true)] __attribute__((aligned(8)));
+static uint16_t requested[total(0, false)];
+static pool_class_t classes[MEM_POOL_CLASSES];
+static void* heap_blocks[MEM_POOL_HEAP_SLOTS];
+static bool initialized = false;
+
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static mem_pool_stats_t stats;
+
+
+// Called with the lock held
+static void init_classes() {
+  uint8_t* base = arena;
+  uint16_t* sizes = requested;
+
+  for(int c = 0; c < MEM_POOL_CLASSES; c++) {
+    pool_class_t& pool = classes[c];
+    pool.base = base;
+    pool.end = base + class_config[c].size * class_config[c].count;
+    pool.requested = sizes;
+    pool.free_list = NULL;
+
+    // Threaded back to front so blocks are handed out in address order
+    for(int i = class_config[c].count - 1; i >= 0; i--) {
+      block_t* block = (block_t*)(base + class_config[c].size * i);
+      block->next = pool.free_list;
+      pool.free_list = block;
+    }
+
+    stats.classes[c].block_size = class_config[c].size;
+    stats.classes[c].blocks = class_config[c].count;
+    base = pool.end;
+    sizes += class_config[c].count;
+  }
+
+  stats.arena_bytes = sizeof(arena);
+  initialized = true;
+}
+
+static int find_class(const void* ptr) {
+  if((const uint8_t*)ptr < arena || (const uint8_t*)ptr >= arena + sizeof(arena)) {
+    return -1;
+  }
+  for(int c = 0; c < MEM_POOL_CLASSES; c++) {
+    if((const uint8_t*)ptr < classes[c].end) {
+      return c;
+    }
+  }
+  return -1;
+}
+
+// Called with the lock held
+static int find_heap(const void* ptr) {
+  for(int i = 0; i < MEM_POOL_HEAP_SLOTS; i++) {
+    if(heap_blocks[i] == ptr) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static size_t block_index(int c, const void* ptr) {
+  return ((const uint8_t*)ptr - classes[c].base) / class_config[c].size;
+}
+
+// Called with the lock held
+static void* take(size_t size) {
+  for(int c = 0; c < MEM_POOL_CLASSES; c++) {
+    if(size > class_config[c].size) {
+      continue;
+    }
+
+    pool_class_t& pool = classes[c];
+    mem_pool_class_stats_t& class_stats = stats.classes[c];
+    if(pool.free_list == NULL) {
+      class_stats.exhausted++;
+      continue;
+    }
+
+    block_t* block = pool.free_list;
+    pool.free_list = block->next;
+    pool.requested[block_index(c, block)] = size;
+
+    class_stats.in_use++;
+    if(class_stats.in_use > class_stats.high_water) {
+      class_stats.high_water = class_stats.in_use;
+    }
+    stats.block_bytes += class_config[c].size;
+    stats.requested_bytes += size;
+    if(stats.block_bytes > stats.block_bytes_high_water) {
+      stats.block_bytes_high_water = stats.block_bytes;
+    }
+    return block;
+  }
+  return NULL;
+}
+
+// Called with the lock held
+static void give(int c, void* ptr) {
+  pool_class_t& pool = classes[c];
+  size_t index = block_index(c, ptr);
+
+  stats.classes[c].in_use--;
+  stats.block_bytes -= class_config[c].size;
+  stats.requested_bytes -= pool.requested[index];
+
+  block_t* block = (block_t*)ptr;
+  block->next = pool.free_list;
+  pool.free_list = block;
+}
+
+
+void* mem_pool_malloc(size_t size) {
+  if(size == 0) {
+    return NULL;
+  }
+
+  portENTER_CRITICAL(&lock);
+  if(!initialized) {
+    init_classes();
+  }
+  void* ptr = take(size);
+  portEXIT_CRITICAL(&lock);
+  if(ptr != NULL) {
+    return ptr;
+  }
+
+  ptr = malloc(size);
+  if(ptr == NULL) {
+    return NULL;
+  }
+
+  portENTER_CRITICAL(&lock);
+  int slot = find_heap(NULL);
+  if(slot >= 0) {
+    heap_blocks[slot] = ptr;
+    stats.heap_live++;
+    stats.heap_fallbacks++;
+  }
+  portEXIT_CRITICAL(&lock);
+
+  if(slot < 0) {
+    free(ptr);
+    return NULL;
+  }
+  return ptr;
+}
+
+void* mem_pool_calloc(size_t count, size_t size) {
+  if(size != 0 && count > SIZE_MAX / size) {
+    return NULL;
+  }
+  void* ptr = mem_pool_malloc(count * size);
+  if(ptr != NULL) {
+    memset(ptr, 0, count * size);
+  }
+  return ptr;
+}
+
+void mem_pool_free(void* ptr) {
+  if(ptr == NULL) {
+    return;
+  }
+
+  int c = find_class(ptr);
+  portENTER_CRITICAL(&lock);
+  if(c >= 0) {
+    give(c, ptr);
+  } else {
+    // Mongoose also frees a few things libc allocated, like the nameserver
+    int slot = find_heap(ptr);
+    if(slot >= 0) {
+      heap_blocks[slot] = NULL;
+      stats.heap_live--;
+    }
+  }
+  portEXIT_CRITICAL(&lock);
+
+  if(c < 0) {
+    free(ptr);
+  }
+}
+
+void* mem_pool_realloc(void* ptr, size_t size) {
+  if(ptr == NULL) {
+    return mem_pool_malloc(size);
+  }
+  if(size == 0) {
+    mem_pool_free(ptr);
+    return NULL;
+  }
+
+  int c = find_class(ptr);
+  if(c < 0) {
+    // Found first; the old pointer can't be looked at once realloc() ran
+    portENTER_CRITICAL(&lock);
+    int slot = find_heap(ptr);
+    portEXIT_CRITICAL(&lock);
+
+    void* moved = realloc(ptr, size);
+    if(moved != NULL && slot >= 0) {
+      portENTER_CRITICAL(&lock);
+      heap_blocks[slot] = moved;
+      portEXIT_CRITICAL(&lock);
+    }
+    return moved;
+  }
+
+  size_t index = block_index(c, ptr);
+  size_t old_size = classes[c].requested[index];
+  if(size <= class_config[c].size) {
+    portENTER_CRITICAL(&lock);
+    stats.requested_bytes += size - old_size;
+    classes[c].requested[index] = size;
+    portEXIT_CRITICAL(&lock);
+    return ptr;
+  }
+
+  void* moved = mem_pool_malloc(size);
+  if(moved == NULL) {
+    return NULL;
+  }
+  memcpy(moved, ptr, old_size);
+  mem_pool_free(ptr);
+  return moved;
+}
+
+
+void mem_pool_get_stats(mem_pool_stats_t* snapshot) {
+  portENTER_CRITICAL(&lock);
+  if(!initialized) {
+    init_classes();
+  }
+  *snapshot = stats;
+  portEXIT_CRITICAL(&lock);
+}
+
+size_t mem_pool_render_json(char* buf, size_t len) {
+  mem_pool_stats_t snapshot;
+  mem_pool_get_stats(&snapshot);
+
+  size_t pos = snprintf(buf, len,
+    "{\"arena_bytes\":%u,\"block_bytes\":%u,\"requested_bytes\":%u,\"block_bytes_high_water\":%u,"
+    "\"heap_live\":%u,\"heap_fallbacks\":%u,\"classes\":[",
+    snapshot.arena_bytes, snapshot.block_bytes, snapshot.requested_bytes, snapshot.block_bytes_high_water,
+    snapshot.heap_live, snapshot.heap_fallbacks
+  );
+  for(int c = 0; c < MEM_POOL_CLASSES && pos < len; c++) {
+    const mem_pool_class_stats_t& class_stats = snapshot.classes[c];
+    pos += snprintf(buf + pos, len - pos, "%s{\"size\":%u,\"blocks\":%u,\"in_use\":%u,\"high_water\":%u,\"exhausted\":%u}",
+      c ? "," : "", class_stats.block_size, class_stats.blocks, class_stats.in_use, class_stats.high_water, class_stats.exhausted
+    );
+  }
+  if(pos < len) {
+    pos += snprintf(buf + pos, len - pos, "]}");
+  }
+  return pos < len ? pos : len - 1;
+}
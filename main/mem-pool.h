@@ -0,0 +1,62 @@
+#ifndef MEM_POOL_H
+#define MEM_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MEM_POOL_CLASSES     8
+#define MEM_POOL_HEAP_SLOTS  16
+
+
+// Size-class allocator behind mongoose's MG_MALLOC, MG_CALLOC, MG_REALLOC
+// and MG_FREE hooks; main/CMakeLists.txt points them here for mongoose.c
+// only, which is why this header is plain C.
+//
+// Each class is a fixed run of equal blocks carved from one static arena,
+// so connections and their buffers come and go without ever splitting the
+// heap that Wi-Fi and HomeKit allocate from. A request takes the smallest
+// class with a free block, falling back to malloc() when every class that
+// fits is full or it is larger than the biggest block. realloc() stays in
+// place while the new size fits the block, which absorbs mbuf growth and
+// trimming. Heap fallbacks are remembered so only those are counted when
+// they come back; at most MEM_POOL_HEAP_SLOTS are out at once, past that
+// a request fails as if the heap were empty.
+typedef struct {
+  uint32_t block_size;
+  uint32_t blocks;
+  uint32_t in_use;
+  uint32_t high_water;
+  // Requests that found the class full and went up a class or to the heap
+  uint32_t exhausted;
+} mem_pool_class_stats_t;
+
+typedef struct {
+  mem_pool_class_stats_t classes[MEM_POOL_CLASSES];
+  uint32_t arena_bytes;
+  // Bytes in blocks handed out, and how much of that was asked for; the
+  // difference is the pool's internal fragmentation
+  uint32_t block_bytes;
+  uint32_t requested_bytes;
+  uint32_t block_bytes_high_water;
+  // Fallback blocks still out, and how many were ever handed out
+  uint32_t heap_live;
+  uint32_t heap_fallbacks;
+} mem_pool_stats_t;
+
+void* mem_pool_malloc(size_t size);
+void* mem_pool_calloc(size_t count, size_t size);
+void* mem_pool_realloc(void* ptr, size_t size);
+void mem_pool_free(void* ptr);
+
+void mem_pool_get_stats(mem_pool_stats_t* stats);
+size_t mem_pool_render_json(char* buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MEM_POOL_H
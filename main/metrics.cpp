@@ -0,0 +1,134 @@
+#include "metrics.hpp"
+
+#include <esp_log.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+
+void Histogram::observe(int64_t us) {
+  uint32_t value = us < 0 ? 0 : us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+
+  size_t i = 0;
+  while(i < bound_count && value > bounds[i]) {
+    i++;
+  }
+  buckets[i].fetch_add(1, std::memory_order_relaxed);
+  sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+
+void MetricsRegistry::add_counter(const char* name, const char* help, const Counter& counter) {
+  entry_t* entry = add(name, help, METRIC_COUNTER);
+  if(entry != NULL) {
+    entry->counter = &counter;
+  }
+}
+
+void MetricsRegistry::add_counter(const char* name, const char* help, read_t read) {
+  entry_t* entry = add(name, help, METRIC_COUNTER_READ);
+  if(entry != NULL) {
+    entry->read = read;
+  }
+}
+
+void MetricsRegistry::add_gauge(const char* name, const char* help, read_t read) {
+  entry_t* entry = add(name, help, METRIC_GAUGE_READ);
+  if(entry != NULL) {
+    entry->read = read;
+  }
+}
+
+void MetricsRegistry::add_histogram(const char* name, const char* help, const Histogram& histogram) {
+  entry_t* entry = add(name, help, METRIC_HISTOGRAM);
+  if(entry != NULL) {
+    entry->histogram = &histogram;
+  }
+}
+
+MetricsRegistry::entry_t* MetricsRegistry::add(const char* name, const char* help, metric_type_t type) {
+  if(count >= METRICS_MAX_ENTRIES) {
+    ESP_LOGE("Metrics", "No room for %s", name);
+    return NULL;
+  }
+
+  entry_t* entry = &entries[count++];
+  entry->name = name;
+  entry->help = help;
+  entry->type = type;
+  entry->counter = NULL;
+  entry->histogram = NULL;
+  return entry;
+}
+
+
+void MetricsRegistry::attach(App& app, const char* uri) {
+  app.add_route(uri, [this, &app](struct mg_connection* nc, struct http_message* hm){
+    static const char head[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nTransfer-Encoding: chunked\r\n\r\n";
+    size_t next = 0;
+    app.send_chunked(nc, head, sizeof(head) - 1, [this, next](char* buf, size_t len) mutable {
+      return render(next, buf, len);
+    });
+  });
+}
+
+size_t MetricsRegistry::render(size_t& next, char* buf, size_t len) {
+  size_t pos = 0;
+  while(next < count) {
+    size_t n = render_entry(entries[next], buf + pos, len - pos);
+    if(n == 0) {
+      if(pos > 0) {
+        break;
+      }
+      // Can never fit, so leave it out rather than stall the scrape
+      ESP_LOGE("Metrics", "%s does not fit a %u byte buffer", entries[next].name, (unsigned int)len);
+    }
+    pos += n;
+    next++;
+  }
+  return pos;
+}
+
+
+// snprintf that leaves pos past the end once the buffer is full, so a
+// whole entry is checked once at the end
+static void append(char* buf, size_t len, size_t& pos, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buf + (pos < len ? pos : len), pos < len ? len - pos : 0, format, args);
+  va_end(args);
+  pos += n > 0 ? n : 0;
+}
+
+size_t MetricsRegistry::render_entry(const entry_t& entry, char* buf, size_t len) {
+  const char* type = entry.type == METRIC_GAUGE_READ ? "gauge" : entry.type == METRIC_HISTOGRAM ? "histogram" : "counter";
+  size_t pos = 0;
+  append(buf, len, pos, "# HELP %s %s\n# TYPE %s %s\n", entry.name, entry.help, entry.name, type);
+
+  switch(entry.type) {
+    case METRIC_COUNTER:
+      append(buf, len, pos, "%s %u\n", entry.name, entry.counter->get());
+      break;
+    case METRIC_COUNTER_READ:
+    case METRIC_GAUGE_READ:
+      append(buf, len, pos, "%s %.6f\n", entry.name, entry.read());
+      break;
+    case METRIC_HISTOGRAM: {
+      const Histogram& histogram = *entry.histogram;
+      uint32_t cumulative = 0;
+      for(size_t i = 0; i < histogram.get_bound_count(); i++) {
+        uint32_t bound = histogram.get_bound(i);
+        cumulative += histogram.get_bucket(i);
+        append(buf, len, pos, "%s_bucket{le=\"%u.%06u\"} %u\n", entry.name, bound / 1000000, bound % 1000000, cumulative);
+      }
+      cumulative += histogram.get_bucket(histogram.get_bound_count());
+      append(buf, len, pos, "%s_bucket{le=\"+Inf\"} %u\n", entry.name, cumulative);
+
+      uint32_t sum = histogram.get_sum();
+      append(buf, len, pos, "%s_sum %u.%06u\n%s_count %u\n", entry.name, sum / 1000000, sum % 1000000, entry.name, cumulative);
+      break;
+    }
+  }
+
+  // vsnprintf wants room for the terminator too
+  return pos < len ? pos : 0;
+}
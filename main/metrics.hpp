@@ -0,0 +1,107 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "app.hpp"
+
+#define METRICS_MAX_ENTRIES   48
+#define METRICS_MAX_BUCKETS   12
+
+
+// Monotonic event count. Increments are relaxed atomics, cheap enough for
+// the display task and safe from any core.
+class Counter {
+public:
+  Counter() : value(0) {};
+
+  void add(uint32_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); };
+  uint32_t get() const { return value.load(std::memory_order_relaxed); };
+
+private:
+  std::atomic<uint32_t> value;
+};
+
+// Fixed-bucket distribution of microsecond samples. Bounds are inclusive
+// upper limits in microseconds; anything above the last falls in +Inf. The
+// sum wraps after 2^32 us of accumulated samples, which Prometheus sees as
+// a counter reset.
+class Histogram {
+public:
+  template <size_t N>
+  Histogram(const uint32_t (&_bounds)[N]) : bounds(_bounds), bound_count(N), sum(0) {
+    static_assert(N <= METRICS_MAX_BUCKETS, "too many histogram buckets");
+    for(size_t i = 0; i <= METRICS_MAX_BUCKETS; i++) {
+      buckets[i].store(0, std::memory_order_relaxed);
+    }
+  };
+
+  void observe(int64_t us);
+
+  size_t get_bound_count() const { return bound_count; };
+  uint32_t get_bound(size_t i) const { return bounds[i]; };
+  // Non-cumulative count of bucket i; bucket bound_count is +Inf
+  uint32_t get_bucket(size_t i) const { return buckets[i].load(std::memory_order_relaxed); };
+  uint32_t get_sum() const { return sum.load(std::memory_order_relaxed); };
+
+private:
+  const uint32_t* bounds;
+  size_t bound_count;
+  std::atomic<uint32_t> buckets[METRICS_MAX_BUCKETS + 1];
+  std::atomic<uint32_t> sum;
+};
+
+
+// Named metrics rendered in the Prometheus text format. Counters and
+// histograms are owned by the subsystems that update them; values that
+// already live in a subsystem's stats are read through a callback at scrape
+// time. Everything is registered once at startup.
+//
+// A scrape is sent chunked, as many whole entries at a time as fit the
+// connection's slot buffer, so the response never has to fit in RAM.
+class MetricsRegistry {
+public:
+  typedef std::function<double()> read_t;
+
+  MetricsRegistry() : count(0) {};
+  ~MetricsRegistry() {};
+
+  void add_counter(const char* name, const char* help, const Counter& counter);
+  void add_counter(const char* name, const char* help, read_t read);
+  void add_gauge(const char* name, const char* help, read_t read);
+  // Rendered in seconds, as Prometheus expects
+  void add_histogram(const char* name, const char* help, const Histogram& histogram);
+
+  void attach(App& app, const char* uri);
+  // Renders whole entries from next on and moves next past them; returns
+  // the length, 0 once every entry is out
+  size_t render(size_t& next, char* buf, size_t len);
+
+private:
+  typedef enum {
+    METRIC_COUNTER,
+    METRIC_COUNTER_READ,
+    METRIC_GAUGE_READ,
+    METRIC_HISTOGRAM
+  } metric_type_t;
+
+  typedef struct {
+    const char* name;
+    const char* help;
+    metric_type_t type;
+    const Counter* counter;
+    const Histogram* histogram;
+    read_t read;
+  } entry_t;
+
+  entry_t entries[METRICS_MAX_ENTRIES];
+  size_t count;
+
+  entry_t* add(const char* name, const char* help, metric_type_t type);
+  size_t render_entry(const entry_t& entry, char* buf, size_t len);
+};
+
+#endif // METRICS_HPP
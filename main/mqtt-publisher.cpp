@@ -0,0 +1,262 @@
+#include "mqtt-publisher.hpp"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+
+static bool append(char* buf, size_t size, size_t& pos, const char* fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(buf + pos, size - pos, fmt, args);
+  va_end(args);
+
+  if(n < 0 || pos + n >= size) {
+    buf[pos] = 0;
+    return false;
+  }
+  pos += n;
+  return true;
+}
+
+
+MqttPublisher::MqttPublisher(WifiManager& _wifi, DnsCache& _dns, DisplayState& _state, const char* _broker, const char* _topic, uint32_t interval_secs) :
+  wifi(_wifi), dns(_dns), state(_state), broker(_broker), topic(_topic), interval_us((int64_t)interval_secs * 1000000),
+  mgr(NULL), conn(NULL), connected(false), failures(0), retry_at(0), next_publish(0), seq(0), until_full(0),
+  field_count(0), event_count(0), events_lost(0), state_sent(false), state_changes(0) {
+  memset(client_id, 0, sizeof(client_id));
+  memset(telemetry_topic, 0, sizeof(telemetry_topic));
+  memset(status_topic, 0, sizeof(status_topic));
+  memset(&last_state, 0, sizeof(last_state));
+}
+
+void MqttPublisher::init(struct mg_mgr* _mgr, const char* _client_id) {
+  mgr = _mgr;
+  snprintf(client_id, sizeof(client_id), "%s", _client_id);
+  snprintf(telemetry_topic, sizeof(telemetry_topic), "%s/%s/telemetry", topic, client_id);
+  snprintf(status_topic, sizeof(status_topic), "%s/%s/status", topic, client_id);
+}
+
+void MqttPublisher::add_field(const char* name, double deadband, read_t read) {
+  if(field_count >= MQTT_MAX_FIELDS) {
+    ESP_LOGE("MQTT", "No room for field %s", name);
+    return;
+  }
+
+  field_t& field = fields[field_count++];
+  field.name = name;
+  field.deadband = deadband;
+  field.read = read;
+  field.last = 0;
+  field.sent = false;
+}
+
+void MqttPublisher::add_event(const char* name, int64_t value) {
+  if(event_count >= MQTT_MAX_EVENTS) {
+    events_lost++;
+    return;
+  }
+
+  event_t& event = events[event_count++];
+  event.name = name;
+  event.time = esp_timer_get_time() / 1000000;
+  event.value = value;
+}
+
+int64_t MqttPublisher::poll(int64_t now) {
+  if(broker[0] == 0) {
+    return INT64_MAX;
+  }
+
+  watch_state();
+
+  if(conn == NULL) {
+    if(wifi.is_connected() && now >= retry_at) {
+      char addr[80];
+      DnsCache::result_t result = dns.resolve(broker, addr, sizeof(addr));
+      if(result == DnsCache::DNS_FOUND) {
+        connect(now, addr);
+      } else if(result == DnsCache::DNS_FAILED) {
+        on_close(now);
+      }
+    }
+  } else if(connected && now >= next_publish) {
+    next_publish = now + interval_us;
+    publish_batch(now);
+  }
+
+  // Past the backoff only Wi-Fi or the lookup are left to wait for, and
+  // both are noticed on the next wakeup; the broker answers on the socket
+  if(conn == NULL) {
+    return now < retry_at ? retry_at : INT64_MAX;
+  }
+  return connected ? next_publish : INT64_MAX;
+}
+
+
+void MqttPublisher::handler(struct mg_connection* nc, int ev, void* ev_data) {
+  MqttPublisher* publisher = (MqttPublisher*)nc->user_data;
+  if(nc != publisher->conn) {
+    return;
+  }
+
+  switch(ev) {
+    case MG_EV_CONNECT: {
+      if(*(int*)ev_data != 0) {
+        break;
+      }
+
+      struct mg_send_mqtt_handshake_opts opts;
+      memset(&opts, 0, sizeof(opts));
+      opts.flags = MG_MQTT_CLEAN_SESSION | MG_MQTT_HAS_WILL | MG_MQTT_WILL_RETAIN;
+      opts.keep_alive = MQTT_KEEP_ALIVE_SECS;
+      opts.will_topic = publisher->status_topic;
+      opts.will_message = "offline";
+      mg_send_mqtt_handshake_opt(nc, publisher->client_id, opts);
+      break;
+    }
+    case MG_EV_MQTT_CONNACK:
+      publisher->on_connack(((struct mg_mqtt_message*)ev_data)->connack_ret_code, esp_timer_get_time());
+      break;
+    case MG_EV_CLOSE:
+      publisher->on_close(esp_timer_get_time());
+      break;
+    default:
+      break;
+  }
+}
+
+void MqttPublisher::connect(int64_t now, const char* addr) {
+  struct mg_connect_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.user_data = this;
+
+  connected = false;
+  conn = mg_connect_opt(mgr, addr, &MqttPublisher::handler, opts);
+  if(conn == NULL) {
+    on_close(now);
+    return;
+  }
+  mg_set_protocol_mqtt(conn);
+}
+
+void MqttPublisher::on_connack(uint8_t code, int64_t now) {
+  if(code != MG_EV_MQTT_CONNACK_ACCEPTED) {
+    ESP_LOGI("MQTT", "Broker refused connection: %u", code);
+    conn->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return;
+  }
+
+  ESP_LOGI("MQTT", "Connected to %s", broker);
+  connected = true;
+  failures = 0;
+  connects.add();
+  mg_mqtt_publish(conn, status_topic, 0, MG_MQTT_QOS(0) | MG_MQTT_RETAIN, "online", 6);
+
+  // Whoever is listening may have missed everything before the drop
+  until_full = 0;
+  next_publish = now;
+}
+
+void MqttPublisher::on_close(int64_t now) {
+  conn = NULL;
+  connected = false;
+  failures++;
+
+  int64_t backoff = (int64_t)MQTT_BACKOFF_BASE_US << (failures < 9 ? failures - 1 : 8);
+  if(backoff > MQTT_BACKOFF_MAX_US) {
+    backoff = MQTT_BACKOFF_MAX_US;
+  }
+  retry_at = now + backoff;
+  ESP_LOGI("MQTT", "Disconnected, retrying in %lld s", backoff / 1000000);
+}
+
+
+void MqttPublisher::watch_state() {
+  display_snapshot_t current = state.read();
+  if(current.mode != last_state.mode || current.hv != last_state.hv || current.brightness != last_state.brightness) {
+    last_state = current;
+    state_changes++;
+    state_sent = false;
+  }
+}
+
+void MqttPublisher::publish_batch(int64_t now) {
+  bool full = until_full == 0;
+  size_t len = render(now, full);
+
+  // A slow broker link mustn't grow the send buffer without bound; keep
+  // everything pending and fold it into the next batch
+  if(conn->send_mbuf.len + len > MQTT_MAX_BACKLOG) {
+    held.add();
+    return;
+  }
+
+  mg_mqtt_publish(conn, telemetry_topic, 0, MG_MQTT_QOS(0), payload, len);
+  published.add();
+  bytes.add(len);
+  seq++;
+  until_full = full ? MQTT_FULL_EVERY - 1 : until_full - 1;
+
+  for(size_t i = 0; i < field_count; i++) {
+    fields[i].sent = true;
+  }
+  state_sent = true;
+  state_changes = 0;
+  event_count = 0;
+  events_lost = 0;
+}
+
+size_t MqttPublisher::render(int64_t now, bool full) {
+  // Items stop at the limit so there is always room left to close the
+  // object; anything cut off stays pending or is counted as lost
+  const size_t limit = sizeof(payload) - MQTT_PAYLOAD_RESERVE;
+  size_t pos = 0;
+  append(payload, limit, pos, "{\"seq\":%u,\"up\":%lld,\"full\":%d", seq, now / 1000000, full ? 1 : 0);
+
+  if(full || !state_sent) {
+    append(payload, limit, pos, ",\"state\":{\"mode\":\"%s\",\"hv\":%d,\"br\":%u,\"changes\":%u}",
+      display_mode_name(last_state.mode), last_state.hv ? 1 : 0, last_state.brightness, state_changes
+    );
+  }
+
+  // Fields rendered into a batch that is held back stay pending and go out
+  // with the next one whatever their deadband
+  bool opened = false;
+  for(size_t i = 0; i < field_count; i++) {
+    field_t& field = fields[i];
+    double value = field.read();
+    double delta = value > field.last ? value - field.last : field.last - value;
+    if(!full && field.sent && delta <= field.deadband) {
+      continue;
+    }
+
+    if(!append(payload, limit, pos, "%s\"%s\":%.10g", opened ? "," : ",\"f\":{", field.name, value)) {
+      break;
+    }
+    opened = true;
+    field.last = value;
+    field.sent = false;
+  }
+  if(opened) {
+    append(payload, sizeof(payload), pos, "}");
+  }
+
+  uint32_t lost = events_lost;
+  if(event_count > 0 && append(payload, limit, pos, ",\"ev\":[")) {
+    for(size_t i = 0; i < event_count; i++) {
+      if(!append(payload, limit, pos, "%s[\"%s\",%u,%lld]", i > 0 ? "," : "", events[i].name, events[i].time, events[i].value)) {
+        lost += event_count - i;
+        break;
+      }
+    }
+    append(payload, sizeof(payload), pos, "]");
+  } else {
+    lost += event_count;
+  }
+
+  append(payload, sizeof(payload), pos, ",\"lost\":%u}", lost);
+  return pos;
+}
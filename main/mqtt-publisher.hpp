@@ -0,0 +1,124 @@
+#ifndef MQTT_PUBLISHER_HPP
+#define MQTT_PUBLISHER_HPP
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "display-state.hpp"
+#include "dns-cache.hpp"
+#include "metrics.hpp"
+#include "mongoose.h"
+#include "wifi-manager.hpp"
+
+#define MQTT_MAX_FIELDS       16
+#define MQTT_MAX_EVENTS       16
+#define MQTT_PAYLOAD_LEN      768
+#define MQTT_PAYLOAD_RESERVE  24
+#define MQTT_MAX_BACKLOG      2048
+#define MQTT_FULL_EVERY       10
+#define MQTT_KEEP_ALIVE_SECS  60
+#define MQTT_BACKOFF_BASE_US  1000000
+#define MQTT_BACKOFF_MAX_US   300000000
+
+
+// Fleet telemetry over MQTT on the App's mongoose manager. Nothing is sent
+// per event: values, display state and events collect between batches and
+// go out as one compact JSON message on <topic>/<client id>/telemetry
+// every interval.
+//
+//   {"seq":7,"up":420,"full":0,"state":{"mode":"clock","hv":1,"br":100,"changes":2},
+//    "f":{"rssi":-61},"ev":[["sync",395,-1250]],"lost":0}
+//
+// Fields are only included when they moved by more than their deadband,
+// and state only when it changed; every few batches and after each
+// reconnect everything is sent in full. A batch that would push the send
+// buffer over its cap is held back and merged into the next one. Broker
+// connections are retried with exponential backoff, and only while Wi-Fi
+// is up; the radio is never held on for telemetry. The broker's name goes
+// through the DNS cache.
+class MqttPublisher {
+public:
+  typedef std::function<double()> read_t;
+
+  MqttPublisher(WifiManager& wifi, DnsCache& dns, DisplayState& state, const char* broker, const char* topic, uint32_t interval_secs);
+  ~MqttPublisher() {};
+
+  void init(struct mg_mgr* mgr, const char* client_id);
+  // Returns when it next needs to run
+  int64_t poll(int64_t now);
+
+  // Registration happens before the network task starts
+  void add_field(const char* name, double deadband, read_t read);
+  // Network task only
+  void add_event(const char* name, int64_t value);
+
+  bool is_connected() { return connected; };
+  const Counter& get_published() { return published; };
+  const Counter& get_bytes() { return bytes; };
+  const Counter& get_held() { return held; };
+  const Counter& get_connects() { return connects; };
+
+private:
+  typedef struct {
+    const char* name;
+    double deadband;
+    read_t read;
+    double last;
+    bool sent;
+  } field_t;
+
+  typedef struct {
+    const char* name;
+    uint32_t time;
+    int64_t value;
+  } event_t;
+
+  WifiManager& wifi;
+  DnsCache& dns;
+  DisplayState& state;
+  const char* broker;
+  const char* topic;
+  int64_t interval_us;
+
+  struct mg_mgr* mgr;
+  struct mg_connection* conn;
+  bool connected;
+  char client_id[24];
+  char telemetry_topic[64];
+  char status_topic[64];
+
+  uint32_t failures;
+  int64_t retry_at;
+  int64_t next_publish;
+  uint32_t seq;
+  uint32_t until_full;
+
+  field_t fields[MQTT_MAX_FIELDS];
+  size_t field_count;
+  event_t events[MQTT_MAX_EVENTS];
+  size_t event_count;
+  uint32_t events_lost;
+
+  display_snapshot_t last_state;
+  bool state_sent;
+  uint32_t state_changes;
+
+  char payload[MQTT_PAYLOAD_LEN];
+
+  Counter published;
+  Counter bytes;
+  Counter held;
+  Counter connects;
+
+  static void handler(struct mg_connection* nc, int ev, void* ev_data);
+
+  void connect(int64_t now, const char* addr);
+  void on_connack(uint8_t code, int64_t now);
+  void on_close(int64_t now);
+  void watch_state();
+  void publish_batch(int64_t now);
+  size_t render(int64_t now, bool full);
+};
+
+#endif // MQTT_PUBLISHER_HPP
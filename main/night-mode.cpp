@@ -0,0 +1,72 @@
+#include "night-mode.hpp"
+
+#include <driver/rtc_io.h>
+#include <esp_log.h>
+#include <esp_sleep.h>
+
+
+NightMode::NightMode(RTCDriver& _rtc, TubeDriver& _td, uint8_t _wake_pin, uint8_t _start_hour, uint8_t _end_hour) :
+  rtc(_rtc), td(_td), wake_pin(_wake_pin), start_hour(_start_hour), end_hour(_end_hour), woke(false) {}
+
+void NightMode::on_boot() {
+  esp_sleep_wakeup_cause_t cause = esp_sleep_get_wakeup_cause();
+  woke = cause == ESP_SLEEP_WAKEUP_EXT0 || cause == ESP_SLEEP_WAKEUP_TIMER;
+  if(!woke) {
+    return;
+  }
+
+  // The pads were latched off for the night; hand them back to the driver
+  rtc_gpio_deinit((gpio_num_t)wake_pin);
+  td.release_hold();
+  ESP_LOGI("Night", "Woke by %s", cause == ESP_SLEEP_WAKEUP_EXT0 ? "RTC alarm" : "timer");
+}
+
+bool NightMode::is_night(time_t now) {
+  if(!is_enabled()) {
+    return false;
+  }
+
+  struct tm time_info = {};
+  localtime_r(&now, &time_info);
+
+  if(start_hour < end_hour) {
+    return time_info.tm_hour >= start_hour && time_info.tm_hour < end_hour;
+  }
+  return time_info.tm_hour >= start_hour || time_info.tm_hour < end_hour;
+}
+
+void NightMode::enter(time_t now) {
+  uint32_t sleep_secs = secs_until_end(now);
+
+  // The alarm flag holds INT/SQW low, so it has to be clear before arming
+  // or the wakeup fires immediately; disarm() releases it after waking
+  bool alarm_armed = rtc.clear_alarm() &&
+                     rtc.set_alarm(end_hour, 0, 0) &&
+                     rtc.enable_alarm_interrupt(true);
+
+  if(alarm_armed) {
+    rtc_gpio_pullup_en((gpio_num_t)wake_pin);
+    rtc_gpio_pulldown_dis((gpio_num_t)wake_pin);
+    esp_sleep_enable_ext0_wakeup((gpio_num_t)wake_pin, 0);
+  }
+  esp_sleep_enable_timer_wakeup((uint64_t)(sleep_secs + NIGHT_MODE_FALLBACK_SECS) * 1000000);
+
+  ESP_LOGI("Night", "Sleeping %u s until %02u:00 (alarm %s)", sleep_secs, end_hour, alarm_armed ? "armed" : "unavailable");
+
+  td.hold_off();
+  esp_deep_sleep_start();
+}
+
+void NightMode::disarm() {
+  rtc.enable_alarm_interrupt(false);
+  rtc.clear_alarm();
+}
+
+uint32_t NightMode::secs_until_end(time_t now) {
+  struct tm time_info = {};
+  localtime_r(&now, &time_info);
+
+  uint32_t secs_of_day = time_info.tm_hour * 3600 + time_info.tm_min * 60 + time_info.tm_sec;
+  uint32_t end_secs = end_hour * 3600;
+  return end_secs > secs_of_day ? end_secs - secs_of_day : end_secs + 86400 - secs_of_day;
+}
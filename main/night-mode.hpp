@@ -0,0 +1,47 @@
+#ifndef NIGHT_MODE_HPP
+#define NIGHT_MODE_HPP
+
+#include <stdint.h>
+#include <time.h>
+
+#include "rtc-driver.hpp"
+#include "tube-driver.hpp"
+
+#define NIGHT_MODE_BOOT_GRACE_US   300000000
+#define NIGHT_MODE_FALLBACK_SECS   60
+
+
+// Scheduled deep sleep for the hours nobody looks at the clock. Entering
+// night mode blanks the tubes, holds HV off, arms DS3231 alarm 1 for the
+// end of the night and deep sleeps until INT/SQW pulls the wake pin low. A
+// timer wakeup a little after the alarm covers a missed or unwired alarm.
+// A start hour equal to the end hour disables night mode.
+class NightMode {
+public:
+  NightMode(RTCDriver& rtc, TubeDriver& td, uint8_t wake_pin, uint8_t start_hour, uint8_t end_hour);
+  ~NightMode() {};
+
+  // Call first thing on boot, before the display is driven
+  void on_boot();
+  // Call once the RTC is up to release INT/SQW after an alarm wakeup
+  void disarm();
+
+  bool is_enabled() { return start_hour != end_hour; };
+  bool woke_from_night() { return woke; };
+  bool is_night(time_t now);
+  bool may_sleep(int64_t uptime_us) { return is_enabled() && (woke || uptime_us > NIGHT_MODE_BOOT_GRACE_US); };
+
+  void enter(time_t now);
+
+private:
+  RTCDriver& rtc;
+  TubeDriver& td;
+  uint8_t wake_pin;
+  uint8_t start_hour;
+  uint8_t end_hour;
+  bool woke;
+
+  uint32_t secs_until_end(time_t now);
+};
+
+#endif // NIGHT_MODE_HPP
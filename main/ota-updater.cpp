@@ -0,0 +1,285 @@
+#include "ota-updater.hpp"
+
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+OtaUpdater::OtaUpdater(WifiManager& _wifi, const char* _token) :
+  wifi(_wifi), token(_token), upload_lock("ota_upload"), uploader(NULL), target(NULL), handle(0), delta(false),
+  recv_limit(0), finishing(false), expected(0), started(0), pending_verify(false), restart_at(0) {
+  memset(&stats, 0, sizeof(stats));
+  memset(&last_stats, 0, sizeof(last_stats));
+}
+
+void OtaUpdater::on_boot() {
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  esp_ota_img_states_t state;
+  if(running != NULL && esp_ota_get_state_partition(running, &state) == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY) {
+    ESP_LOGI("OTA", "Running new image from %s, pending verification", running->label);
+    pending_verify = true;
+  }
+}
+
+void OtaUpdater::attach(App& app, const char* uri) {
+  app.add_stream_route(uri, [this](struct mg_connection* nc, int ev, struct http_message* hm){ on_request(nc, ev, hm, false); });
+  app.add_stream_route(std::string(uri) + "/delta", [this](struct mg_connection* nc, int ev, struct http_message* hm){ on_request(nc, ev, hm, true); });
+  app.add_poller([this](int64_t now){ return poll(now); });
+}
+
+
+void OtaUpdater::on_request(struct mg_connection* nc, int ev, struct http_message* hm, bool is_delta) {
+  switch(ev) {
+    case MG_EV_HTTP_CHUNK:
+      // A rejected request keeps streaming until the reply has gone out
+      if(nc->flags & MG_F_SEND_AND_CLOSE) {
+        return;
+      }
+      if(uploader == NULL && !begin(nc, hm, is_delta)) {
+        return;
+      }
+      if(nc != uploader) {
+        reply(nc, 409, "{\"error\":\"update in progress\"}");
+        return;
+      }
+      write(nc, hm->body.p, hm->body.len);
+      break;
+    case MG_EV_HTTP_REQUEST:
+      if(nc == uploader) {
+        finish(nc);
+      }
+      break;
+    case MG_EV_CLOSE:
+      if(nc == uploader) {
+        ESP_LOGI("OTA", "Upload dropped after %u bytes", stats.bytes);
+        esp_ota_abort(handle);
+        end_session();
+      }
+      break;
+  }
+}
+
+bool OtaUpdater::begin(struct mg_connection* nc, struct http_message* hm, bool is_delta) {
+  if(mg_vcmp(&hm->method, "POST") != 0) {
+    reply(nc, 405, "{\"error\":\"POST the image\"}");
+    return false;
+  }
+
+  struct mg_str* header = mg_get_http_header(hm, "X-OTA-Token");
+  if(token[0] != 0 && (header == NULL || mg_vcmp(header, token) != 0)) {
+    reply(nc, 403, "{\"error\":\"bad token\"}");
+    return false;
+  }
+
+  header = mg_get_http_header(hm, "Content-Length");
+  expected = header != NULL ? strtoul(std::string(header->p, header->len).c_str(), NULL, 10) : 0;
+  if(expected == 0) {
+    reply(nc, 411, "{\"error\":\"length required\"}");
+    return false;
+  }
+
+  target = esp_ota_get_next_update_partition(NULL);
+  if(target == NULL) {
+    reply(nc, 500, "{\"error\":\"no OTA partition\"}");
+    return false;
+  }
+  if(!is_delta && expected > target->size) {
+    reply(nc, 413, "{\"error\":\"image too large\"}");
+    return false;
+  }
+
+  uint32_t heap_start = esp_get_free_heap_size();
+
+  // Sequential writes erase each sector as it is reached instead of the
+  // whole slot up front, which would hold up the network task for seconds
+  esp_err_t err = esp_ota_begin(target, OTA_WITH_SEQUENTIAL_WRITES, &handle);
+  if(err != ESP_OK) {
+    ESP_LOGE("OTA", "Begin failed: %s", esp_err_to_name(err));
+    reply(nc, 500, "{\"error\":\"begin failed\"}");
+    return false;
+  }
+
+  delta = is_delta;
+  finishing = false;
+  if(delta) {
+    err = patch.begin(esp_ota_get_running_partition(), target->size, [this](const uint8_t* data, size_t len){
+      return esp_ota_write(handle, data, len);
+    });
+    if(err != ESP_OK) {
+      esp_ota_abort(handle);
+      reply(nc, 503, "{\"error\":\"out of memory\"}");
+      return false;
+    }
+  }
+
+  uploader = nc;
+  started = esp_timer_get_time();
+  memset(&stats, 0, sizeof(stats));
+  stats.heap_start = heap_start;
+  stats.heap_min = esp_get_free_heap_size();
+  upload_lock.acquire();
+  wifi.acquire();
+
+  ESP_LOGI("OTA", "Writing %u byte %s to %s at 0x%x", (unsigned int)expected, delta ? "patch" : "image", target->label, target->address);
+  return true;
+}
+
+void OtaUpdater::write(struct mg_connection* nc, const char* data, size_t len) {
+  if(len == 0) {
+    return;
+  }
+  if(stats.bytes + len > expected) {
+    abort(nc, 400, "{\"error\":\"body longer than Content-Length\"}");
+    return;
+  }
+
+  if(delta) {
+    if(patch.feed((const uint8_t*)data, len) != ESP_OK) {
+      abort_patch(nc);
+      return;
+    }
+    // Stop reading until the poller has caught the patch up
+    if(patch.is_busy()) {
+      recv_limit = nc->recv_mbuf_limit;
+      nc->recv_mbuf_limit = 0;
+    }
+  } else {
+    esp_err_t err = esp_ota_write(handle, data, len);
+    if(err != ESP_OK) {
+      ESP_LOGE("OTA", "Write failed at %u: %s", stats.bytes, esp_err_to_name(err));
+      abort(nc, 500, "{\"error\":\"write failed\"}");
+      return;
+    }
+  }
+
+  stats.bytes += len;
+  uint32_t heap = esp_get_free_heap_size();
+  if(heap < stats.heap_min) {
+    stats.heap_min = heap;
+  }
+}
+
+void OtaUpdater::finish(struct mg_connection* nc) {
+  // The last chunk may still be applying; the poller comes back here
+  if(delta && patch.is_busy()) {
+    finishing = true;
+    return;
+  }
+  if(stats.bytes != expected) {
+    abort(nc, 400, "{\"error\":\"short body\"}");
+    return;
+  }
+  if(delta && patch.finish() != ESP_OK) {
+    abort_patch(nc);
+    return;
+  }
+  stats.image_bytes = delta ? patch.get_output_size() : stats.bytes;
+
+  esp_err_t err = esp_ota_end(handle);
+  if(err == ESP_OK) {
+    err = esp_ota_set_boot_partition(target);
+  }
+
+  stats.duration_ms = (esp_timer_get_time() - started) / 1000;
+  stats.kbytes_per_sec = stats.duration_ms > 0 ? (uint32_t)(stats.bytes / stats.duration_ms) : 0;
+  last_stats = stats;
+  end_session();
+
+  if(err != ESP_OK) {
+    ESP_LOGE("OTA", "Image rejected: %s", esp_err_to_name(err));
+    reply(nc, err == ESP_ERR_OTA_VALIDATE_FAILED ? 400 : 500, "{\"error\":\"image rejected\"}");
+    return;
+  }
+
+  ESP_LOGI("OTA", "Received %u bytes for a %u byte image in %lld ms (%u KB/s), free heap %u at start, %u minimum; restarting",
+    stats.bytes, stats.image_bytes, stats.duration_ms, stats.kbytes_per_sec, stats.heap_start, stats.heap_min
+  );
+
+  char body[160];
+  snprintf(body, sizeof(body), "{\"ok\":true,\"bytes\":%u,\"image_bytes\":%u,\"ms\":%lld,\"kbps\":%u,\"heap_start\":%u,\"heap_min\":%u}",
+    stats.bytes, stats.image_bytes, stats.duration_ms, stats.kbytes_per_sec, stats.heap_start, stats.heap_min
+  );
+  reply(nc, 200, body);
+  restart_at = esp_timer_get_time() + OTA_RESTART_DELAY_US;
+}
+
+void OtaUpdater::abort(struct mg_connection* nc, int status, const char* error) {
+  esp_ota_abort(handle);
+  end_session();
+  reply(nc, status, error);
+}
+
+void OtaUpdater::abort_patch(struct mg_connection* nc) {
+  char body[96];
+  snprintf(body, sizeof(body), "{\"error\":\"%s\"}", patch.get_error());
+  abort(nc, 400, body);
+}
+
+void OtaUpdater::end_session() {
+  uploader = NULL;
+  patch.end();
+  upload_lock.release();
+  wifi.release();
+}
+
+
+int64_t OtaUpdater::poll(int64_t now) {
+  if(restart_at != 0 && now >= restart_at) {
+    if(restart_callback) {
+      restart_callback();
+    }
+    esp_restart();
+  }
+
+  if(uploader != NULL && delta && patch.is_busy()) {
+    struct mg_connection* nc = uploader;
+    if(patch.step() != ESP_OK) {
+      abort_patch(nc);
+    } else if(!patch.is_busy()) {
+      nc->recv_mbuf_limit = recv_limit;
+      if(finishing) {
+        finish(nc);
+      }
+    }
+  }
+
+  if(pending_verify) {
+    if(now >= OTA_HEALTH_MIN_UPTIME_US && (!health_check || health_check())) {
+      ESP_LOGI("OTA", "Health check passed, keeping this image");
+      esp_ota_mark_app_valid_cancel_rollback();
+      pending_verify = false;
+    } else if(now >= OTA_HEALTH_TIMEOUT_US) {
+      ESP_LOGE("OTA", "Health check failed, rolling back");
+      if(restart_callback) {
+        restart_callback();
+      }
+      esp_ota_mark_app_invalid_rollback_and_reboot();
+    }
+  }
+
+  // Patch work runs back to back; the socket is paused until it's done
+  if(uploader != NULL && delta && patch.is_busy()) {
+    return now;
+  }
+  int64_t next = restart_at != 0 ? restart_at : INT64_MAX;
+  if(pending_verify) {
+    int64_t check = now < OTA_HEALTH_MIN_UPTIME_US ? OTA_HEALTH_MIN_UPTIME_US : now + OTA_HEALTH_RETRY_US;
+    next = check < next ? check : next;
+  }
+  return next;
+}
+
+void OtaUpdater::reply(struct mg_connection* nc, int status, const char* body) {
+  const char* reason = status == 200 ? "OK" : status == 400 ? "Bad Request" : status == 403 ? "Forbidden" :
+                       status == 405 ? "Method Not Allowed" : status == 409 ? "Conflict" :
+                       status == 411 ? "Length Required" : status == 413 ? "Payload Too Large" : "Internal Server Error";
+
+  // The rest of a rejected body may still be on its way, so always close
+  mg_printf(nc, "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %u\r\nConnection: close\r\n\r\n%s",
+    status, reason, (unsigned int)strlen(body), body
+  );
+  nc->flags |= MG_F_SEND_AND_CLOSE;
+}
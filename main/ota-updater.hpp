@@ -0,0 +1,101 @@
+#ifndef OTA_UPDATER_HPP
+#define OTA_UPDATER_HPP
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <esp_ota_ops.h>
+
+#include "app.hpp"
+#include "delta-patch.hpp"
+#include "power-manager.hpp"
+#include "wifi-manager.hpp"
+
+#define OTA_RESTART_DELAY_US     1000000
+#define OTA_HEALTH_MIN_UPTIME_US 30000000
+#define OTA_HEALTH_TIMEOUT_US    180000000
+#define OTA_HEALTH_RETRY_US      1000000
+
+
+// Firmware updates over the local HTTP server into the inactive OTA slot.
+//
+//   curl --data-binary @build/neon-dreams.bin http://<clock>/ota
+//
+// The request body is written to flash chunk by chunk as mongoose receives
+// it, with sectors erased just ahead of the writes, so the image never sits
+// in RAM and the network task never stalls on a bulk erase. esp_ota_end
+// verifies the image before it is made the boot partition and the clock
+// restarts.
+//
+// A patch from tools/mkdelta.py can go to <uri>/delta instead. It is
+// applied against the running image on the fly and the result lands in the
+// same slot, so only the changed bytes travel over the network; the image
+// is checked against the patch's hash before it is used. Patch work comes
+// in bounded steps: while one is pending the socket isn't read and the
+// poller runs the rest, so a long COPY stalls the upload, not the task.
+//
+// A freshly updated image boots pending verification. It has to pass the
+// health check within the timeout, after a minimum uptime, or the
+// bootloader goes back to the previous image. A crash before then has the
+// same effect.
+class OtaUpdater {
+public:
+  typedef struct {
+    uint32_t bytes;
+    uint32_t image_bytes;
+    int64_t duration_ms;
+    uint32_t kbytes_per_sec;
+    uint32_t heap_start;
+    uint32_t heap_min;
+  } stats_t;
+
+  OtaUpdater(WifiManager& wifi, const char* token);
+  ~OtaUpdater() {};
+
+  // Call early in boot, before anything could decide the image is healthy
+  void on_boot();
+  void attach(App& app, const char* uri);
+
+  void set_health_check(std::function<bool()> check) { health_check = check; };
+  void on_before_restart(std::function<void()> callback) { restart_callback = callback; };
+
+  bool is_pending_verify() { return pending_verify; };
+  stats_t get_last_stats() { return last_stats; };
+
+private:
+  WifiManager& wifi;
+  const char* token;
+  PerfLock upload_lock;
+
+  struct mg_connection* uploader;
+  const esp_partition_t* target;
+  esp_ota_handle_t handle;
+  bool delta;
+  DeltaPatch patch;
+  size_t recv_limit;
+  bool finishing;
+  size_t expected;
+  int64_t started;
+  stats_t stats;
+  stats_t last_stats;
+
+  bool pending_verify;
+  int64_t restart_at;
+
+  std::function<bool()> health_check;
+  std::function<void()> restart_callback;
+
+  void on_request(struct mg_connection* nc, int ev, struct http_message* hm, bool is_delta);
+  bool begin(struct mg_connection* nc, struct http_message* hm, bool is_delta);
+  void write(struct mg_connection* nc, const char* data, size_t len);
+  void finish(struct mg_connection* nc);
+  void abort(struct mg_connection* nc, int status, const char* error);
+  void abort_patch(struct mg_connection* nc);
+  void end_session();
+
+  int64_t poll(int64_t now);
+  static void reply(struct mg_connection* nc, int status, const char* body);
+};
+
+#endif // OTA_UPDATER_HPP
@@ -0,0 +1,339 @@
+#include "peer-sync.hpp"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <math.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define PEER_SYNC_MAGIC   0x5350444E  // "NDPS"
+#define PEER_SYNC_VERSION 2
+
+
+PeerSync::PeerSync(uint16_t _priority, uint16_t _port) :
+  mgr(NULL), listen_conn(NULL), announce_conn(NULL), request_conn(NULL), peer_count(0),
+  priority(_priority), port(_port), node_id(0), seq(0),
+  leader_priority(_priority), leader_id(0), leader_ip(0), leader_port(0), request_ip(0), request_port(0), leader_seen(0),
+  next_announce(0), next_report(0), sample_count(0), sample_pos(0),
+  offset_lock(portMUX_INITIALIZER_UNLOCKED), offset_us(0), delay_us(0), jitter_us(0), locked(false) {
+  memset(samples, 0, sizeof(samples));
+  memset(peer_conns, 0, sizeof(peer_conns));
+}
+
+bool PeerSync::add_peer(const char* address) {
+  if(peer_count >= PEER_SYNC_MAX_PEERS) {
+    ESP_LOGE("PeerSync", "No room for peer %s", address);
+    return false;
+  }
+  peers[peer_count++] = address;
+  return true;
+}
+
+void PeerSync::init(struct mg_mgr* _mgr, uint32_t _node_id) {
+  mgr = _mgr;
+  node_id = _node_id;
+  leader_id = node_id;
+  leader_priority = priority;
+
+  char addr[16];
+  snprintf(addr, sizeof(addr), "udp://:%u", port);
+  listen_conn = mg_bind(mgr, addr, &PeerSync::handler);
+  if(listen_conn == NULL) {
+    ESP_LOGE("PeerSync", "Failed to bind %s", addr);
+    return;
+  }
+  listen_conn->user_data = this;
+
+  ESP_LOGI("PeerSync", "Node %08X listening on %s, priority %u", node_id, addr, priority);
+}
+
+int64_t PeerSync::poll(int64_t now) {
+  if(listen_conn == NULL) {
+    return INT64_MAX;
+  }
+  if(now < next_announce) {
+    return next_announce;
+  }
+  next_announce = now + PEER_SYNC_INTERVAL_US;
+
+  // Fall back to leading ourselves if the leader has gone quiet
+  if(!is_leader() && (now - leader_seen) > PEER_SYNC_LEADER_TTL_US) {
+    ESP_LOGI("PeerSync", "Leader %08X timed out, taking over", leader_id);
+    leader_id = node_id;
+    leader_priority = priority;
+    reset_samples();
+  }
+
+  send_announce();
+  if(!is_leader()) {
+    send_request();
+  }
+
+  if(now >= next_report) {
+    next_report = now + PEER_SYNC_REPORT_US;
+    report();
+  }
+  return next_announce;
+}
+
+int64_t PeerSync::now_us() {
+  if(is_leader() || !locked) {
+    return system_us();
+  }
+
+  portENTER_CRITICAL(&offset_lock);
+  int64_t offset = offset_us;
+  portEXIT_CRITICAL(&offset_lock);
+
+  return esp_timer_get_time() + offset;
+}
+
+PeerSync::stats_t PeerSync::get_stats() {
+  stats_t stats;
+
+  portENTER_CRITICAL(&offset_lock);
+  stats.offset_us = offset_us;
+  stats.delay_us = delay_us;
+  stats.jitter_us = jitter_us;
+  portEXIT_CRITICAL(&offset_lock);
+
+  stats.samples = sample_count;
+  stats.leader_id = leader_id;
+  stats.leader = is_leader();
+  stats.locked = locked;
+  return stats;
+}
+
+
+void PeerSync::handler(struct mg_connection* nc, int ev, void* ev_data) {
+  PeerSync* sync = (PeerSync*)nc->user_data;
+
+  switch(ev) {
+    case MG_EV_RECV: {
+      // Timestamp before anything else so parsing isn't counted as path delay
+      int64_t rx_time = nc == sync->request_conn ? esp_timer_get_time() : system_us();
+
+      packet_t packet;
+      if(nc->recv_mbuf.len == sizeof(packet_t)) {
+        memcpy(&packet, nc->recv_mbuf.buf, sizeof(packet_t));
+        if(packet.magic == PEER_SYNC_MAGIC && packet.version == PEER_SYNC_VERSION && packet.node_id != sync->node_id) {
+          sync->handle_packet(nc, packet, rx_time);
+        }
+      }
+      mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+      break;
+    }
+    case MG_EV_CLOSE:
+      if(nc == sync->announce_conn) {
+        sync->announce_conn = NULL;
+      } else if(nc == sync->request_conn) {
+        sync->request_conn = NULL;
+      }
+      for(size_t i = 0; i < sync->peer_count; i++) {
+        if(nc == sync->peer_conns[i]) {
+          sync->peer_conns[i] = NULL;
+        }
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void PeerSync::handle_packet(struct mg_connection* nc, const packet_t& packet, int64_t rx_time) {
+  switch(packet.type) {
+    case PACKET_ANNOUNCE:
+      handle_announce(nc, packet, esp_timer_get_time());
+      break;
+    case PACKET_REQUEST:
+      handle_request(nc, packet, rx_time);
+      break;
+    case PACKET_RESPONSE:
+      if(nc == request_conn) {
+        handle_response(packet, rx_time);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void PeerSync::handle_announce(struct mg_connection* nc, const packet_t& packet, int64_t now) {
+  bool is_current = packet.node_id == leader_id;
+  bool is_better = packet.priority < leader_priority ||
+                   (packet.priority == leader_priority && packet.node_id < leader_id);
+
+  if(!is_current && !is_better) {
+    return;
+  }
+
+  if(!is_current) {
+    ESP_LOGI("PeerSync", "Following leader %08X (priority %u)", packet.node_id, packet.priority);
+    reset_samples();
+  }
+
+  leader_id = packet.node_id;
+  leader_priority = packet.priority;
+  leader_ip = nc->sa.sin.sin_addr.s_addr;
+  leader_port = packet.port;
+  leader_seen = now;
+}
+
+void PeerSync::handle_request(struct mg_connection* nc, const packet_t& packet, int64_t rx_time) {
+  if(!is_leader()) {
+    return;
+  }
+
+  packet_t response = packet;
+  response.type = PACKET_RESPONSE;
+  response.priority = priority;
+  response.port = port;
+  response.node_id = node_id;
+  response.t2 = rx_time;
+  response.t3 = system_us();
+  mg_send(nc, &response, sizeof(response));
+}
+
+void PeerSync::handle_response(const packet_t& packet, int64_t rx_time) {
+  if(packet.node_id != leader_id || packet.seq != seq) {
+    return;
+  }
+
+  int64_t offset = ((packet.t2 - packet.t1) + (packet.t3 - rx_time)) / 2;
+  int64_t delay = (rx_time - packet.t1) - (packet.t3 - packet.t2);
+  if(delay < 0) {
+    return;
+  }
+
+  add_sample(offset, delay);
+}
+
+
+void PeerSync::send_announce() {
+  packet_t packet;
+  memset(&packet, 0, sizeof(packet));
+  packet.magic = PEER_SYNC_MAGIC;
+  packet.version = PEER_SYNC_VERSION;
+  packet.type = PACKET_ANNOUNCE;
+  packet.priority = priority;
+  packet.port = port;
+  packet.node_id = node_id;
+
+  if(announce_conn == NULL) {
+    char addr[32];
+    snprintf(addr, sizeof(addr), "255.255.255.255:%u", port);
+    announce_conn = connect(addr, true);
+  }
+  if(announce_conn != NULL) {
+    mg_send(announce_conn, &packet, sizeof(packet));
+  }
+
+  for(size_t i = 0; i < peer_count; i++) {
+    if(peer_conns[i] == NULL) {
+      peer_conns[i] = connect(peers[i], false);
+    }
+    if(peer_conns[i] != NULL) {
+      mg_send(peer_conns[i], &packet, sizeof(packet));
+    }
+  }
+}
+
+void PeerSync::send_request() {
+  if(request_conn != NULL && (request_ip != leader_ip || request_port != leader_port)) {
+    request_conn->flags |= MG_F_CLOSE_IMMEDIATELY;
+    request_conn = NULL;
+  }
+
+  if(request_conn == NULL) {
+    char addr[32];
+    uint8_t* ip = (uint8_t*)&leader_ip;
+    snprintf(addr, sizeof(addr), "%u.%u.%u.%u:%u", ip[0], ip[1], ip[2], ip[3], leader_port);
+    request_conn = connect(addr, false);
+    if(request_conn == NULL) {
+      return;
+    }
+    request_ip = leader_ip;
+    request_port = leader_port;
+  }
+
+  packet_t packet;
+  memset(&packet, 0, sizeof(packet));
+  packet.magic = PEER_SYNC_MAGIC;
+  packet.version = PEER_SYNC_VERSION;
+  packet.type = PACKET_REQUEST;
+  packet.priority = priority;
+  packet.port = port;
+  packet.node_id = node_id;
+  packet.seq = ++seq;
+  packet.t1 = esp_timer_get_time();
+  mg_send(request_conn, &packet, sizeof(packet));
+}
+
+struct mg_connection* PeerSync::connect(const char* address, bool broadcast) {
+  char addr[48];
+  struct mg_connect_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.flags = broadcast ? MG_F_ENABLE_BROADCAST : 0;
+  opts.user_data = this;
+
+  snprintf(addr, sizeof(addr), "udp://%s", address);
+  return mg_connect_opt(mgr, addr, &PeerSync::handler, opts);
+}
+
+
+void PeerSync::add_sample(int64_t offset, int64_t delay) {
+  samples[sample_pos].offset = offset;
+  samples[sample_pos].delay = delay;
+  sample_pos = (sample_pos + 1) % PEER_SYNC_SAMPLES;
+  if(sample_count < PEER_SYNC_SAMPLES) {
+    sample_count++;
+  }
+
+  // Queueing only ever adds delay, so the fastest exchange carries the
+  // least asymmetry and gives the best offset estimate
+  const sample_t* best = &samples[0];
+  for(uint32_t i = 1; i < sample_count; i++) {
+    if(samples[i].delay < best->delay) {
+      best = &samples[i];
+    }
+  }
+
+  double sum_sq = 0;
+  for(uint32_t i = 0; i < sample_count; i++) {
+    double diff = (double)(samples[i].offset - best->offset);
+    sum_sq += diff * diff;
+  }
+
+  portENTER_CRITICAL(&offset_lock);
+  offset_us = best->offset;
+  delay_us = best->delay;
+  jitter_us = (int64_t)sqrt(sum_sq / sample_count);
+  portEXIT_CRITICAL(&offset_lock);
+
+  locked = sample_count >= PEER_SYNC_MIN_SAMPLES && best->delay < PEER_SYNC_MAX_DELAY_US;
+}
+
+void PeerSync::reset_samples() {
+  sample_count = 0;
+  sample_pos = 0;
+  locked = false;
+}
+
+void PeerSync::report() {
+  stats_t stats = get_stats();
+  if(stats.leader) {
+    ESP_LOGI("PeerSync", "Leading as %08X", node_id);
+    return;
+  }
+
+  ESP_LOGI("PeerSync", "Leader %08X offset %lld us delay %lld us jitter %lld us (%u samples, %s)",
+    stats.leader_id, stats.offset_us, stats.delay_us, stats.jitter_us, stats.samples,
+    stats.locked ? "locked" : "unlocked"
+  );
+}
+
+int64_t PeerSync::system_us() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
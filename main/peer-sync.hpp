@@ -0,0 +1,133 @@
+#ifndef PEER_SYNC_HPP
+#define PEER_SYNC_HPP
+
+#include <stdint.h>
+
+#include <freertos/FreeRTOS.h>
+
+#include "mongoose.h"
+
+#define PEER_SYNC_PORT          4243
+#define PEER_SYNC_MAX_PEERS     4
+#define PEER_SYNC_SAMPLES       8
+#define PEER_SYNC_MIN_SAMPLES   4
+#define PEER_SYNC_MAX_DELAY_US  20000
+#define PEER_SYNC_INTERVAL_US   1000000
+#define PEER_SYNC_LEADER_TTL_US 3500000
+#define PEER_SYNC_REPORT_US     60000000
+
+
+// Aligns the second phase of several clocks on one LAN. Every clock
+// broadcasts an announce once a second, and sends it to any peers added by
+// address for where a broadcast doesn't reach; the one with the lowest
+// (priority, node id) is the timing leader. Announces carry the sender's
+// port, so nodes on other ports, like several on one host, find each
+// other. Followers run an NTP style request/response exchange against the
+// leader and keep the sample with the lowest round trip out of the last few
+// as their offset estimate.
+//
+// The leader's timebase is its system time. now_us() returns that timebase
+// on every node, so display code can flip digits on its second boundaries.
+class PeerSync {
+public:
+  typedef struct {
+    int64_t offset_us;
+    int64_t delay_us;
+    int64_t jitter_us;
+    uint32_t samples;
+    uint32_t leader_id;
+    bool leader;
+    bool locked;
+  } stats_t;
+
+  PeerSync(uint16_t priority, uint16_t port = PEER_SYNC_PORT);
+  ~PeerSync() {};
+
+  // Also announce to host:port; the string has to outlive the PeerSync
+  bool add_peer(const char* address);
+  void init(struct mg_mgr* mgr, uint32_t node_id);
+  // Returns when it next needs to run
+  int64_t poll(int64_t now);
+
+  int64_t now_us();
+  bool is_leader() { return leader_id == node_id; };
+  bool is_locked() { return locked; };
+  stats_t get_stats();
+
+private:
+  typedef struct {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t type;
+    uint16_t priority;
+    uint16_t port;
+    uint32_t node_id;
+    uint32_t seq;
+    int64_t t1;
+    int64_t t2;
+    int64_t t3;
+  } __attribute__((packed)) packet_t;
+
+  typedef struct {
+    int64_t offset;
+    int64_t delay;
+  } sample_t;
+
+  enum {
+    PACKET_ANNOUNCE = 1,
+    PACKET_REQUEST = 2,
+    PACKET_RESPONSE = 3
+  };
+
+  struct mg_mgr* mgr;
+  struct mg_connection* listen_conn;
+  struct mg_connection* announce_conn;
+  struct mg_connection* request_conn;
+  const char* peers[PEER_SYNC_MAX_PEERS];
+  struct mg_connection* peer_conns[PEER_SYNC_MAX_PEERS];
+  size_t peer_count;
+
+  uint16_t priority;
+  uint16_t port;
+  uint32_t node_id;
+  uint32_t seq;
+
+  uint16_t leader_priority;
+  uint32_t leader_id;
+  uint32_t leader_ip;
+  uint16_t leader_port;
+  uint32_t request_ip;
+  uint16_t request_port;
+  int64_t leader_seen;
+
+  int64_t next_announce;
+  int64_t next_report;
+
+  sample_t samples[PEER_SYNC_SAMPLES];
+  uint32_t sample_count;
+  uint32_t sample_pos;
+
+  portMUX_TYPE offset_lock;
+  int64_t offset_us;
+  int64_t delay_us;
+  int64_t jitter_us;
+  bool locked;
+
+  static void handler(struct mg_connection* nc, int ev, void* ev_data);
+
+  void handle_packet(struct mg_connection* nc, const packet_t& packet, int64_t rx_time);
+  void handle_announce(struct mg_connection* nc, const packet_t& packet, int64_t now);
+  void handle_request(struct mg_connection* nc, const packet_t& packet, int64_t rx_time);
+  void handle_response(const packet_t& packet, int64_t rx_time);
+
+  void send_announce();
+  struct mg_connection* connect(const char* address, bool broadcast);
+  void send_request();
+  void add_sample(int64_t offset, int64_t delay);
+  void reset_samples();
+  void report();
+
+  static int64_t system_us();
+};
+
+#endif // PEER_SYNC_HPP
@@ -0,0 +1,99 @@
+#include "periodic-executor.hpp"
+
+#include <esp_err.h>
+#include <string.h>
+
+static const uint32_t LATENESS_BOUNDS_US[] = {10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000};
+
+PeriodicExecutor::PeriodicExecutor(const char* _name, int64_t _period_us) :
+  name(_name), period_us(_period_us), task_handle(NULL), timer(NULL),
+  next_deadline(0), woke_at(0), stats_lock(portMUX_INITIALIZER_UNLOCKED),
+  lateness(LATENESS_BOUNDS_US) {
+  memset(&stats, 0, sizeof(stats));
+}
+
+void PeriodicExecutor::init() {
+  task_handle = xTaskGetCurrentTaskHandle();
+
+  esp_timer_create_args_t timer_args = {};
+  timer_args.callback = &PeriodicExecutor::timer_cb;
+  timer_args.arg = this;
+  timer_args.name = name;
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer));
+
+  woke_at = esp_timer_get_time();
+  next_deadline = woke_at + period_us;
+}
+
+PeriodicExecutor::stats_t PeriodicExecutor::get_stats(bool reset) {
+  portENTER_CRITICAL(&stats_lock);
+  stats_t snapshot = stats;
+  if(reset) {
+    memset(&stats, 0, sizeof(stats));
+  }
+  portEXIT_CRITICAL(&stats_lock);
+  return snapshot;
+}
+
+void PeriodicExecutor::wait_next() {
+  int64_t now = esp_timer_get_time();
+
+  // Work ran past one or more deadlines; drop them and stay on the grid
+  uint32_t missed = 0;
+  while(next_deadline <= now) {
+    next_deadline += period_us;
+    missed++;
+  }
+  if(missed > 0) {
+    portENTER_CRITICAL(&stats_lock);
+    stats.missed += missed;
+    portEXIT_CRITICAL(&stats_lock);
+  }
+
+  sleep_until(next_deadline);
+  next_deadline += period_us;
+}
+
+void PeriodicExecutor::wait_until(int64_t deadline) {
+  sleep_until(deadline);
+  next_deadline = deadline + period_us;
+}
+
+
+void PeriodicExecutor::timer_cb(void* arg) {
+  PeriodicExecutor* executor = (PeriodicExecutor*)arg;
+  xTaskNotifyGive(executor->task_handle);
+}
+
+void PeriodicExecutor::sleep_until(int64_t deadline) {
+  int64_t now = esp_timer_get_time();
+  int64_t exec = now - woke_at;
+
+  // A wakeup from notify() can leave the previous timer armed
+  esp_timer_stop(timer);
+  if(deadline > now) {
+    esp_timer_start_once(timer, deadline - now);
+  }
+
+  while((now = esp_timer_get_time()) < deadline) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    if(wake_handler) {
+      wake_handler();
+    }
+  }
+  woke_at = now;
+
+  int64_t late = now - deadline;
+  lateness.observe(late);
+  portENTER_CRITICAL(&stats_lock);
+  stats.periods++;
+  stats.exec_sum_us += exec;
+  if(exec > stats.exec_max_us) {
+    stats.exec_max_us = exec;
+  }
+  stats.late_sum_us += late;
+  if(late > stats.late_max_us) {
+    stats.late_max_us = late;
+  }
+  portEXIT_CRITICAL(&stats_lock);
+}
@@ -0,0 +1,72 @@
+#ifndef PERIODIC_EXECUTOR_HPP
+#define PERIODIC_EXECUTOR_HPP
+
+#include <functional>
+#include <stdint.h>
+
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "metrics.hpp"
+
+
+// Runs a task on a fixed grid of absolute deadlines kept on esp_timer, so
+// time spent working (SPI, I2C, logging) never pushes later periods back.
+// The task sleeps on its notification between deadlines, which lets other
+// tasks wake it early through notify(); the wake handler runs on every
+// wakeup and the wait resumes until the deadline is reached.
+//
+// Each period records how long the work took, how late the wakeup was and
+// whether the work overran into the next deadline. Overrun periods are
+// skipped rather than run back to back.
+class PeriodicExecutor {
+public:
+  typedef struct {
+    uint32_t periods;
+    uint32_t missed;
+    int64_t exec_sum_us;
+    int64_t exec_max_us;
+    int64_t late_sum_us;
+    int64_t late_max_us;
+  } stats_t;
+
+  PeriodicExecutor(const char* name, int64_t period_us);
+  ~PeriodicExecutor() {};
+
+  // Call from the task that will wait
+  void init();
+  void on_wake(std::function<void()> handler) { wake_handler = handler; };
+  void notify() { if(task_handle != NULL) { xTaskNotifyGive(task_handle); } };
+
+  // Sleep until the next period on the grid
+  void wait_next();
+  // Sleep until an absolute esp_timer deadline and restart the grid there
+  void wait_until(int64_t deadline);
+
+  int64_t get_period() { return period_us; };
+  int64_t get_next_deadline() { return next_deadline; };
+  stats_t get_stats(bool reset);
+  const Histogram& get_lateness() { return lateness; };
+
+private:
+  const char* name;
+  int64_t period_us;
+
+  TaskHandle_t task_handle;
+  esp_timer_handle_t timer;
+  std::function<void()> wake_handler;
+
+  int64_t next_deadline;
+  int64_t woke_at;
+
+  portMUX_TYPE stats_lock;
+  stats_t stats;
+  Histogram lateness;
+
+  static void timer_cb(void* arg);
+
+  void sleep_until(int64_t deadline);
+};
+
+#endif // PERIODIC_EXECUTOR_HPP
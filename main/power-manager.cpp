@@ -0,0 +1,56 @@
+#include "power-manager.hpp"
+
+#include <esp_err.h>
+#include <esp_log.h>
+#include <stdio.h>
+
+
+bool PerfLock::create() {
+  if(handle != NULL) {
+    return true;
+  }
+
+  // Fails with ESP_ERR_NOT_SUPPORTED when CONFIG_PM_ENABLE is off, in which
+  // case the CPU never scales down and the lock is not needed anyway
+  return esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, name, &handle) == ESP_OK;
+}
+
+void PerfLock::acquire() {
+  if(held || !create()) {
+    return;
+  }
+  held = esp_pm_lock_acquire(handle) == ESP_OK;
+}
+
+void PerfLock::release() {
+  if(!held) {
+    return;
+  }
+  esp_pm_lock_release(handle);
+  held = false;
+}
+
+
+void PowerManager::init() {
+  esp_pm_config_esp32_t pm_config = {};
+  pm_config.max_freq_mhz = max_mhz;
+  pm_config.min_freq_mhz = min_mhz;
+  pm_config.light_sleep_enable = light_sleep;
+
+  esp_err_t ret = esp_pm_configure(&pm_config);
+  if(ret != ESP_OK) {
+    ESP_LOGI("PM", "Power management unavailable: %s", esp_err_to_name(ret));
+    return;
+  }
+
+  enabled = true;
+  ESP_LOGI("PM", "CPU %u-%u MHz, light sleep %s", min_mhz, max_mhz, light_sleep ? "on" : "off");
+}
+
+void PowerManager::report() {
+#if CONFIG_PM_PROFILING
+  // Time spent in each power mode and per lock; the light sleep share is
+  // what the idle current reduction scales with
+  esp_pm_dump_locks(stdout);
+#endif
+}
@@ -0,0 +1,48 @@
+#ifndef POWER_MANAGER_HPP
+#define POWER_MANAGER_HPP
+
+#include <stdint.h>
+
+#include <esp_pm.h>
+
+
+// Named CPU frequency lock. While any lock is held the CPU runs at the
+// configured maximum and automatic light sleep is suppressed; otherwise the
+// chip idles at the minimum frequency and sleeps between deadlines. Locks are
+// created on first use so they can live in statically constructed objects.
+class PerfLock {
+public:
+  PerfLock(const char* _name) : name(_name), handle(NULL), held(false) {};
+  ~PerfLock() {};
+
+  void acquire();
+  void release();
+  bool is_held() { return held; };
+
+private:
+  const char* name;
+  esp_pm_lock_handle_t handle;
+  bool held;
+
+  bool create();
+};
+
+
+class PowerManager {
+public:
+  PowerManager(uint32_t max_mhz, uint32_t min_mhz, bool light_sleep) :
+    max_mhz(max_mhz), min_mhz(min_mhz), light_sleep(light_sleep), enabled(false) {};
+  ~PowerManager() {};
+
+  void init();
+  void report();
+  bool is_enabled() { return enabled; };
+
+private:
+  uint32_t max_mhz;
+  uint32_t min_mhz;
+  bool light_sleep;
+  bool enabled;
+};
+
+#endif // POWER_MANAGER_HPP
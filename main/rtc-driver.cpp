@@ -1,10 +1,13 @@
 #include "rtc-driver.hpp"
 #include <esp_log.h>
 #include <esp_err.h>
+#include <esp_timer.h>
+
+static const uint32_t TRANSACTION_BOUNDS_US[] = {100, 200, 500, 1000, 2000, 5000, 10000, 50000};
 
 
 RTCDriver::RTCDriver(uint8_t esp_i2c_port_num, uint8_t sda, uint8_t scl) :
-  _esp_i2c_port_num(esp_i2c_port_num), _sda(sda), _scl(scl) {}
+  _esp_i2c_port_num(esp_i2c_port_num), _sda(sda), _scl(scl), transaction_latency(TRANSACTION_BOUNDS_US) {}
 
 void RTCDriver::init() {
   rtc_port = (i2c_port_t)_esp_i2c_port_num;
@@ -33,7 +36,7 @@ bool RTCDriver::sync() {
   i2c_master_write_byte(cmd, 0xD0 | 0x01, (i2c_ack_type_t)true);
   i2c_master_read(cmd, (uint8_t*)&reg_status, 7, I2C_MASTER_LAST_NACK );
   i2c_master_stop(cmd);
-  esp_err_t ret = i2c_master_cmd_begin(rtc_port, cmd, 50 / portTICK_RATE_MS);
+  esp_err_t ret = transact(cmd);
   i2c_cmd_link_delete(cmd);
 
   if (ret != ESP_OK){
@@ -74,7 +77,91 @@ bool RTCDriver::set_clock(uint8_t new_sec, uint8_t new_min, uint8_t new_hour, ui
   i2c_master_write_byte(cmd, month_reg, (i2c_ack_type_t)true);
   i2c_master_write_byte(cmd, year_reg, (i2c_ack_type_t)true);
   i2c_master_stop(cmd);
+  esp_err_t ret = transact(cmd);
+  i2c_cmd_link_delete(cmd);
+
+  if (ret != ESP_OK){
+    ESP_LOGI("I2C", "Error message: %s", esp_err_to_name(ret));
+    return false;
+  }
+  return true;
+}
+
+
+bool RTCDriver::set_alarm(uint8_t alarm_hour, uint8_t alarm_min, uint8_t alarm_sec) {
+  // A1M1-A1M3 clear and A1M4 set matches on hours, minutes and seconds
+  uint8_t alarm_regs[4] = {
+    (uint8_t)(((alarm_sec / 10) << 4) | (alarm_sec % 10)),
+    (uint8_t)(((alarm_min / 10) << 4) | (alarm_min % 10)),
+    (uint8_t)(((alarm_hour / 10) << 4) | (alarm_hour % 10)),
+    0x80 | 0x01
+  };
+  return write_regs(0x07, alarm_regs, sizeof(alarm_regs));
+}
+
+bool RTCDriver::enable_alarm_interrupt(bool enable) {
+  uint8_t control;
+  if(!read_regs(0x0E, &control, 1)) {
+    return false;
+  }
+
+  // INTCN routes the alarm to INT/SQW instead of the square wave; alarm 2
+  // is never used so A2IE stays off
+  control &= ~0x03;
+  if(enable) {
+    control |= 0x04 | 0x01;
+  }
+  return write_regs(0x0E, &control, 1);
+}
+
+bool RTCDriver::clear_alarm() {
+  uint8_t status;
+  if(!read_regs(0x0F, &status, 1)) {
+    return false;
+  }
+
+  status &= ~0x03;
+  return write_regs(0x0F, &status, 1);
+}
+
+
+esp_err_t RTCDriver::transact(i2c_cmd_handle_t cmd) {
+  int64_t start = esp_timer_get_time();
   esp_err_t ret = i2c_master_cmd_begin(rtc_port, cmd, 50 / portTICK_RATE_MS);
+  transaction_latency.observe(esp_timer_get_time() - start);
+  if(ret != ESP_OK) {
+    errors.add();
+  }
+  return ret;
+}
+
+bool RTCDriver::read_regs(uint8_t reg, uint8_t* data, size_t len) {
+  i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+  i2c_master_start(cmd);
+  i2c_master_write_byte(cmd, 0xD0 | 0x00, (i2c_ack_type_t)true);
+  i2c_master_write_byte(cmd, reg, (i2c_ack_type_t)true);
+  i2c_master_start(cmd);
+  i2c_master_write_byte(cmd, 0xD0 | 0x01, (i2c_ack_type_t)true);
+  i2c_master_read(cmd, data, len, I2C_MASTER_LAST_NACK);
+  i2c_master_stop(cmd);
+  esp_err_t ret = transact(cmd);
+  i2c_cmd_link_delete(cmd);
+
+  if (ret != ESP_OK){
+    ESP_LOGI("I2C", "Error message: %s", esp_err_to_name(ret));
+    return false;
+  }
+  return true;
+}
+
+bool RTCDriver::write_regs(uint8_t reg, const uint8_t* data, size_t len) {
+  i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+  i2c_master_start(cmd);
+  i2c_master_write_byte(cmd, 0xD0 | 0x00, (i2c_ack_type_t)true);
+  i2c_master_write_byte(cmd, reg, (i2c_ack_type_t)true);
+  i2c_master_write(cmd, (uint8_t*)data, len, (i2c_ack_type_t)true);
+  i2c_master_stop(cmd);
+  esp_err_t ret = transact(cmd);
   i2c_cmd_link_delete(cmd);
 
   if (ret != ESP_OK){
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <driver/i2c.h>
 
+#include "metrics.hpp"
+
 
 class RTCDriver {
 public:
@@ -16,6 +18,12 @@ public:
                  uint16_t new_year);
   bool sync();
 
+  // Alarm 1 fires daily when hours, minutes and seconds match and pulls
+  // INT/SQW low until the flag is cleared
+  bool set_alarm(uint8_t alarm_hour, uint8_t alarm_min, uint8_t alarm_sec);
+  bool enable_alarm_interrupt(bool enable);
+  bool clear_alarm();
+
   uint8_t get_sec() { return sec; };
   uint8_t get_min() { return min; };
   uint8_t get_hour() { return hour; };
@@ -24,6 +32,9 @@ public:
   uint8_t get_month() { return month; };
   uint16_t get_year() { return year; };
 
+  const Histogram& get_transaction_latency() { return transaction_latency; };
+  const Counter& get_errors() { return errors; };
+
 private:
   uint8_t _esp_i2c_port_num;
   uint8_t _sda;
@@ -31,6 +42,14 @@ private:
 
   i2c_port_t rtc_port;
 
+  Histogram transaction_latency;
+  Counter errors;
+
+  esp_err_t transact(i2c_cmd_handle_t cmd);
+
+  bool read_regs(uint8_t reg, uint8_t* data, size_t len);
+  bool write_regs(uint8_t reg, const uint8_t* data, size_t len);
+
   bool twelve_hour_mode_enable = false;
 
   uint8_t sec;
@@ -0,0 +1,48 @@
+#ifndef SPSC_QUEUE_HPP
+#define SPSC_QUEUE_HPP
+
+#include <atomic>
+#include <stdint.h>
+
+
+// Bounded single producer, single consumer ring. Neither side ever blocks or
+// takes a lock, so a network task can hand work to the display task without
+// the display being held up by a mutex owned by the other core. Exactly one
+// task may push and exactly one task may pop.
+template <typename T, uint32_t N>
+class SpscQueue {
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscQueue size must be a power of two");
+
+public:
+  SpscQueue() : head(0), tail(0) {};
+  ~SpscQueue() {};
+
+  bool push(const T& item) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if(t - head.load(std::memory_order_acquire) == N) {
+      return false;
+    }
+    items[t & (N - 1)] = item;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  };
+
+  bool pop(T& item) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if(h == tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    item = items[h & (N - 1)];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  };
+
+  bool empty() { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); };
+
+private:
+  T items[N];
+  std::atomic<uint32_t> head;
+  std::atomic<uint32_t> tail;
+};
+
+#endif // SPSC_QUEUE_HPP
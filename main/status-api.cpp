@@ -0,0 +1,144 @@
+#include "status-api.hpp"
+
+#include <esp_timer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  const char* name;
+  TubeManager::effect_t effect;
+} effect_name_t;
+
+static const effect_name_t effect_names[] = {
+  {"scan", TubeManager::TUBE_EFFECT_SCAN},
+  {"cathode_cycle", TubeManager::TUBE_EFFECT_CATHODE_CYCLE},
+  {"exercise", TubeManager::TUBE_EFFECT_EXERCISE},
+  {"slot_roll", TubeManager::TUBE_EFFECT_SLOT_ROLL},
+  {"scroll", TubeManager::TUBE_EFFECT_SCROLL},
+  {"wipe", TubeManager::TUBE_EFFECT_WIPE},
+  {"depth_sweep", TubeManager::TUBE_EFFECT_DEPTH_SWEEP}
+};
+
+// 1 or 0, -1 for anything that isn't clearly one or the other
+static int parse_bool(const char* value) {
+  if(strcmp(value, "1") == 0 || strcmp(value, "true") == 0 || strcmp(value, "on") == 0) {
+    return 1;
+  }
+  if(strcmp(value, "0") == 0 || strcmp(value, "false") == 0 || strcmp(value, "off") == 0) {
+    return 0;
+  }
+  return -1;
+}
+
+
+StatusApi::StatusApi(DisplayController& _display, DisplayState& _state, TimeSync& _time_sync, PeerSync& _peer_sync, WifiManager& _wifi) :
+  display(_display), state(_state), time_sync(_time_sync), peer_sync(_peer_sync), wifi(_wifi) {}
+
+void StatusApi::attach(App& app) {
+  app.add_json_route("/api/status", [this](struct http_message* hm, char* buf, size_t size, size_t& len) {
+    return render_status(buf, size, len);
+  });
+  app.add_json_route("/api/control", [this](struct http_message* hm, char* buf, size_t size, size_t& len) {
+    return control(hm, buf, size, len);
+  });
+}
+
+int StatusApi::render_status(char* buf, size_t size, size_t& len) {
+  display_snapshot_t snapshot = state.read();
+  TimeSync::stats_t ntp = time_sync.get_stats();
+  PeerSync::stats_t peer = peer_sync.get_stats();
+  WifiManager::stats_t wifi_stats = wifi.get_stats();
+  int64_t now = peer_sync.now_us();
+
+  char digits[7];
+  for(int i = 0; i < 6; i++) {
+    digits[i] = snapshot.digits[i] >= 0 && snapshot.digits[i] <= 9 ? '0' + snapshot.digits[i] : '-';
+  }
+  digits[6] = 0;
+
+  int n = snprintf(buf, size,
+    "{\"time\":%lld.%06lld,\"uptime\":%lld,"
+    "\"ntp\":{\"synced\":%s,\"offset_us\":%lld,\"delay_us\":%lld,\"jitter_us\":%lld,\"syncs\":%u,\"http_syncs\":%u,\"failures\":%u},"
+    "\"peer\":{\"leader\":%s,\"leader_id\":\"%08X\",\"locked\":%s,\"offset_us\":%lld,\"jitter_us\":%lld},"
+    "\"wifi\":{\"connected\":%s,\"rssi\":%d},"
+    "\"display\":{\"mode\":\"%s\",\"digits\":\"%s\",\"hv\":%s,\"brightness\":%u}}",
+    now / 1000000, now % 1000000, esp_timer_get_time() / 1000000,
+    time_sync.is_synced() ? "true" : "false", ntp.offset_us, ntp.delay_us, ntp.jitter_us, ntp.syncs, ntp.http_syncs, ntp.failures,
+    peer.leader ? "true" : "false", peer.leader_id, peer.locked ? "true" : "false", peer.offset_us, peer.jitter_us,
+    wifi.is_connected() ? "true" : "false", wifi_stats.rssi,
+    display_mode_name(snapshot.mode), digits, snapshot.hv ? "true" : "false", snapshot.brightness
+  );
+  if(n < 0 || (size_t)n >= size) {
+    return 500;
+  }
+  len = n;
+  return 200;
+}
+
+int StatusApi::control(struct http_message* hm, char* buf, size_t size, size_t& len) {
+  const struct mg_str* params = mg_vcmp(&hm->method, "POST") == 0 ? &hm->body : &hm->query_string;
+  char value[16];
+  const char* error = NULL;
+
+  // Everything is checked before anything is posted, so a bad parameter
+  // leaves the display as it was
+  int hv = -1;
+  if(mg_get_http_var(params, "hv", value, sizeof(value)) > 0) {
+    hv = parse_bool(value);
+    error = hv < 0 ? "hv" : error;
+  }
+  long brightness = -1;
+  if(mg_get_http_var(params, "brightness", value, sizeof(value)) > 0) {
+    char* end;
+    brightness = strtol(value, &end, 10);
+    if(end == value || *end != 0 || brightness < 0 || brightness > 100) {
+      error = "brightness";
+    }
+  }
+  const effect_name_t* effect = NULL;
+  if(mg_get_http_var(params, "effect", value, sizeof(value)) > 0) {
+    for(const effect_name_t& entry : effect_names) {
+      if(strcmp(value, entry.name) == 0) {
+        effect = &entry;
+      }
+    }
+    error = effect == NULL ? "effect" : error;
+  }
+  int stopwatch = -1;
+  if(mg_get_http_var(params, "mode", value, sizeof(value)) > 0) {
+    stopwatch = strcmp(value, "stopwatch") == 0 ? 1 : strcmp(value, "clock") == 0 ? 0 : -1;
+    error = stopwatch < 0 ? "mode" : error;
+  }
+
+  bool posted = true;
+  if(error == NULL) {
+    if(hv >= 0) {
+      posted &= display.set_hv(hv == 1);
+    }
+    if(brightness >= 0) {
+      posted &= display.set_brightness((uint8_t)brightness);
+    }
+    if(effect != NULL) {
+      posted &= display.start_effect(effect->effect);
+    }
+    if(stopwatch >= 0) {
+      posted &= display.stopwatch(stopwatch == 1 ? DisplayController::TIMER_RESET : DisplayController::TIMER_EXIT);
+    }
+  }
+
+  int n;
+  int status;
+  if(error != NULL) {
+    status = 400;
+    n = snprintf(buf, size, "{\"error\":\"invalid %s\"}", error);
+  } else if(!posted) {
+    status = 503;
+    n = snprintf(buf, size, "{\"error\":\"display busy\"}");
+  } else {
+    status = 200;
+    n = snprintf(buf, size, "{\"ok\":true}");
+  }
+  len = n > 0 ? n : 0;
+  return status;
+}
@@ -0,0 +1,44 @@
+#ifndef STATUS_API_HPP
+#define STATUS_API_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "app.hpp"
+#include "display-controller.hpp"
+#include "display-state.hpp"
+#include "peer-sync.hpp"
+#include "time-sync.hpp"
+#include "wifi-manager.hpp"
+
+
+// Local JSON API on the App's HTTP server.
+//
+//   GET /api/status   time, sync state, Wi-Fi and what the tubes show
+//   /api/control      hv=0|1|off|on|false|true, brightness=0-100, effect=<name>,
+//                     mode=clock|stopwatch
+//
+// Control takes its parameters from the query string or a form encoded POST
+// body. Any invalid one rejects the whole request with 400 before anything
+// changes. Otherwise it only posts commands to the display, so it returns
+// immediately; the status reflects them once the display task has applied
+// them.
+class StatusApi {
+public:
+  StatusApi(DisplayController& display, DisplayState& state, TimeSync& time_sync, PeerSync& peer_sync, WifiManager& wifi);
+  ~StatusApi() {};
+
+  void attach(App& app);
+
+private:
+  DisplayController& display;
+  DisplayState& state;
+  TimeSync& time_sync;
+  PeerSync& peer_sync;
+  WifiManager& wifi;
+
+  int render_status(char* buf, size_t size, size_t& len);
+  int control(struct http_message* hm, char* buf, size_t size, size_t& len);
+};
+
+#endif // STATUS_API_HPP
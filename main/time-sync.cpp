@@ -0,0 +1,510 @@
+#include "time-sync.hpp"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <math.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define NTP_PACKET_LEN  48
+#define NTP_UNIX_OFFSET 2208988800ULL
+
+static const char* month_names[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+
+TimeSync::TimeSync(WifiManager& _wifi, DnsCache& _dns, const char* _server, const char* _http_urls, uint32_t interval_secs) :
+  wifi(_wifi), dns(_dns), server(_server), interval_us((int64_t)interval_secs * 1000000),
+  mgr(NULL), conn(NULL), conn_ready(false), query_lock("ntp_query"), state(TIME_SYNC_IDLE), next_sync(0),
+  session_start(0), radio_ready(0), next_request(0), sent(0), consecutive_failures(0), synced(false),
+  request_ts(0), request_time(0), burst_count(0), offset_count(0),
+  http_urls(_http_urls), http_cursor(_http_urls), http_conn(NULL), http_start(0), http_sent_at(0), http_sent(0),
+  http_samples(0), http_lo(0), http_hi(0), ntp_failures(0), ntp_skips(0),
+  stats_lock(portMUX_INITIALIZER_UNLOCKED) {
+  memset(&stats, 0, sizeof(stats));
+}
+
+void TimeSync::init(struct mg_mgr* _mgr) {
+  mgr = _mgr;
+}
+
+TimeSync::stats_t TimeSync::get_stats() {
+  portENTER_CRITICAL(&stats_lock);
+  stats_t snapshot = stats;
+  portEXIT_CRITICAL(&stats_lock);
+  return snapshot;
+}
+
+int64_t TimeSync::poll(int64_t now) {
+  switch(state) {
+    case TIME_SYNC_IDLE:
+      if(now >= next_sync) {
+        session_start = now;
+        burst_count = 0;
+        state = TIME_SYNC_WAIT_RADIO;
+        wifi.acquire();
+      }
+      break;
+
+    case TIME_SYNC_WAIT_RADIO:
+      if(wifi.is_connected()) {
+        radio_ready = now;
+        if(probe_ntp()) {
+          state = TIME_SYNC_RESOLVE;
+        } else {
+          start_http(now);
+        }
+      } else if(now - session_start > TIME_SYNC_RADIO_US) {
+        ESP_LOGI("NTP", "No network for sync");
+        finish(now);
+      }
+      break;
+
+    case TIME_SYNC_RESOLVE: {
+      char target[80];
+      char addr[80];
+      snprintf(target, sizeof(target), "udp://%s:123", server);
+
+      DnsCache::result_t result = dns.resolve(target, addr, sizeof(addr));
+      if(result == DnsCache::DNS_FOUND) {
+        start_query(now, addr);
+      } else if(result == DnsCache::DNS_FAILED || now - radio_ready > TIME_SYNC_RESOLVE_US) {
+        ESP_LOGI("NTP", "Could not resolve %s", server);
+        end_ntp(now);
+      }
+      break;
+    }
+
+    case TIME_SYNC_QUERY:
+      if(burst_count >= TIME_SYNC_BURST || (sent >= TIME_SYNC_BURST && now - request_time > TIME_SYNC_REPLY_US)) {
+        end_ntp(now);
+      } else if(conn_ready && sent < TIME_SYNC_BURST && now >= next_request) {
+        next_request = now + TIME_SYNC_SPACING_US;
+        send_request();
+      } else if(!conn_ready && now - radio_ready > TIME_SYNC_REPLY_US * TIME_SYNC_BURST) {
+        end_ntp(now);
+      }
+      break;
+
+    case TIME_SYNC_HTTP:
+      if(now - http_start > TIME_SYNC_HTTP_US || (http_conn == NULL && http_sent >= TIME_SYNC_HTTP_BURST)) {
+        finish_http(now);
+      } else if(http_conn == NULL && now >= next_request) {
+        send_http(now);
+      }
+      break;
+  }
+  return next_wakeup();
+}
+
+int64_t TimeSync::next_wakeup() {
+  // Replies and DNS answers wake the network task on their own; only the
+  // timeouts and request spacing need a deadline. The radio coming up is
+  // noticed within APP_POLL_MAX_US.
+  switch(state) {
+    case TIME_SYNC_IDLE:
+      return next_sync;
+    case TIME_SYNC_WAIT_RADIO:
+      return session_start + TIME_SYNC_RADIO_US;
+    case TIME_SYNC_RESOLVE:
+      return radio_ready + TIME_SYNC_RESOLVE_US;
+    case TIME_SYNC_QUERY:
+      if(!conn_ready) {
+        return radio_ready + TIME_SYNC_REPLY_US * TIME_SYNC_BURST;
+      }
+      return sent < TIME_SYNC_BURST ? next_request : request_time + TIME_SYNC_REPLY_US;
+    case TIME_SYNC_HTTP: {
+      int64_t deadline = http_start + TIME_SYNC_HTTP_US;
+      return http_conn == NULL && next_request < deadline ? next_request : deadline;
+    }
+  }
+  return INT64_MAX;
+}
+
+
+void TimeSync::handler(struct mg_connection* nc, int ev, void* ev_data) {
+  TimeSync* sync = (TimeSync*)nc->user_data;
+
+  switch(ev) {
+    case MG_EV_CONNECT:
+      if(nc == sync->conn) {
+        sync->conn_ready = *(int*)ev_data == 0;
+      }
+      break;
+    case MG_EV_RECV: {
+      int64_t rx_time = system_us();
+      if(nc == sync->conn) {
+        sync->handle_reply((const uint8_t*)nc->recv_mbuf.buf, nc->recv_mbuf.len, rx_time);
+      }
+      mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+      break;
+    }
+    case MG_EV_CLOSE:
+      if(nc == sync->conn) {
+        sync->conn = NULL;
+        sync->conn_ready = false;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void TimeSync::start_query(int64_t now, const char* addr) {
+  struct mg_connect_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.user_data = this;
+
+  // Keep the CPU at full speed so timestamps aren't skewed by a clock switch
+  query_lock.acquire();
+  sent = 0;
+  burst_count = 0;
+  next_request = now;
+  conn_ready = false;
+  conn = mg_connect_opt(mgr, addr, &TimeSync::handler, opts);
+  state = TIME_SYNC_QUERY;
+}
+
+void TimeSync::send_request() {
+  uint8_t packet[NTP_PACKET_LEN] = {0};
+
+  // LI 3 (unsynchronized), version 4, mode 3 (client)
+  packet[0] = (3 << 6) | (4 << 3) | 3;
+
+  // The server echoes our transmit timestamp back as the originate
+  // timestamp, which is how stale or spoofed replies are told apart
+  request_time = esp_timer_get_time();
+  request_ts = to_ntp(system_us());
+  for(int i = 0; i < 8; i++) {
+    packet[40 + i] = (uint8_t)(request_ts >> (56 - 8 * i));
+  }
+
+  sent++;
+  mg_send(conn, packet, sizeof(packet));
+}
+
+void TimeSync::handle_reply(const uint8_t* data, size_t len, int64_t rx_time) {
+  if(len < NTP_PACKET_LEN) {
+    return;
+  }
+
+  uint8_t mode = data[0] & 0x07;
+  uint8_t stratum = data[1];
+  if(mode != 4 || stratum == 0 || stratum > 15) {
+    return;
+  }
+
+  uint64_t ts[3] = {0, 0, 0};
+  for(int t = 0; t < 3; t++) {
+    for(int i = 0; i < 8; i++) {
+      ts[t] = (ts[t] << 8) | data[24 + 8 * t + i];
+    }
+  }
+  if(ts[0] != request_ts || burst_count >= TIME_SYNC_BURST) {
+    return;
+  }
+
+  int64_t t1 = from_ntp(ts[0]);
+  int64_t t2 = from_ntp(ts[1]);
+  int64_t t3 = from_ntp(ts[2]);
+  int64_t t4 = rx_time;
+
+  sample_t& sample = burst[burst_count++];
+  sample.offset = ((t2 - t1) + (t3 - t4)) / 2;
+  sample.delay = (t4 - t1) - (t3 - t2);
+}
+
+void TimeSync::end_ntp(int64_t now) {
+  if(burst_count > 0) {
+    ntp_failures = 0;
+    finish(now);
+  } else if(http_urls[0] != 0) {
+    ntp_failures++;
+    close_conn();
+    start_http(now);
+  } else {
+    finish(now);
+  }
+}
+
+void TimeSync::finish(int64_t now) {
+  close_conn();
+  query_lock.release();
+  wifi.release();
+  state = TIME_SYNC_IDLE;
+
+  if(burst_count == 0) {
+    consecutive_failures++;
+    int64_t retry = TIME_SYNC_RETRY_US << (consecutive_failures < 6 ? consecutive_failures - 1 : 5);
+    next_sync = now + (retry < interval_us ? retry : interval_us);
+
+    portENTER_CRITICAL(&stats_lock);
+    stats.failures++;
+    portEXIT_CRITICAL(&stats_lock);
+
+    ESP_LOGI("NTP", "Sync failed, retrying in %lld s", (next_sync - now) / 1000000);
+    return;
+  }
+
+  // Same clock filter as peer sync: the fastest exchange is the least skewed
+  const sample_t* best = &burst[0];
+  for(uint32_t i = 1; i < burst_count; i++) {
+    if(burst[i].delay < best->delay) {
+      best = &burst[i];
+    }
+  }
+
+  apply(*best);
+  consecutive_failures = 0;
+  next_sync = now + interval_us;
+  synced = true;
+
+  if(sync_callback) {
+    sync_callback(best->offset);
+  }
+}
+
+void TimeSync::close_conn() {
+  if(conn != NULL) {
+    conn->flags |= MG_F_CLOSE_IMMEDIATELY;
+    conn = NULL;
+  }
+  if(http_conn != NULL) {
+    http_conn->flags |= MG_F_CLOSE_IMMEDIATELY;
+    http_conn = NULL;
+  }
+  conn_ready = false;
+}
+
+
+bool TimeSync::probe_ntp() {
+  if(http_urls[0] == 0 || ntp_failures < TIME_SYNC_NTP_SKIP_AFTER) {
+    return true;
+  }
+  // NTP looks blocked here; keep checking now and then in case that changes
+  return ++ntp_skips % TIME_SYNC_NTP_PROBE_EVERY == 0;
+}
+
+void TimeSync::start_http(int64_t now) {
+  query_lock.acquire();
+  http_start = now;
+  http_sent = 0;
+  http_samples = 0;
+  next_request = now;
+  state = TIME_SYNC_HTTP;
+}
+
+void TimeSync::send_http(int64_t now) {
+  char url[96];
+  struct mg_str scheme, user_info, host, path, query, fragment;
+  unsigned int port = 0;
+
+  if(!next_url(url, sizeof(url)) ||
+     mg_parse_uri(mg_mk_str(url), &scheme, &user_info, &host, &port, &path, &query, &fragment) != 0 ||
+     mg_vcmp(&scheme, "http") != 0 || host.len == 0) {
+    // Mongoose is built without SSL, so https:// can't be used either
+    ESP_LOGW("NTP", "Unusable time URL %s", url);
+    http_sent++;
+    return;
+  }
+
+  char target[80];
+  char addr[80];
+  snprintf(target, sizeof(target), "tcp://%.*s:%u", (int)host.len, host.p, port ? port : 80);
+  DnsCache::result_t result = dns.resolve(target, addr, sizeof(addr));
+  if(result == DnsCache::DNS_PENDING) {
+    return;
+  }
+
+  next_request = now + TIME_SYNC_HTTP_SPACING_US;
+  http_sent++;
+  if(result == DnsCache::DNS_FAILED) {
+    return;
+  }
+
+  snprintf(http_request, sizeof(http_request), "HEAD %.*s HTTP/1.1\r\nHost: %.*s\r\nConnection: close\r\n\r\n",
+    path.len ? (int)path.len : 1, path.len ? path.p : "/", (int)host.len, host.p
+  );
+
+  struct mg_connect_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.user_data = this;
+  http_conn = mg_connect_opt(mgr, addr, &TimeSync::http_handler, opts);
+}
+
+void TimeSync::http_handler(struct mg_connection* nc, int ev, void* ev_data) {
+  TimeSync* sync = (TimeSync*)nc->user_data;
+
+  switch(ev) {
+    case MG_EV_CONNECT:
+      if(nc == sync->http_conn && *(int*)ev_data == 0) {
+        sync->http_sent_at = system_us();
+        mg_send(nc, sync->http_request, strlen(sync->http_request));
+      }
+      break;
+    case MG_EV_RECV: {
+      int64_t rx_time = system_us();
+      if(nc != sync->http_conn || sync->handle_http_reply(nc, rx_time)) {
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      }
+      break;
+    }
+    case MG_EV_CLOSE:
+      if(nc == sync->http_conn) {
+        sync->http_conn = NULL;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+bool TimeSync::handle_http_reply(struct mg_connection* nc, int64_t rx_time) {
+  struct http_message hm;
+  int head_len = mg_parse_http(nc->recv_mbuf.buf, nc->recv_mbuf.len, &hm, 0);
+  if(head_len == 0) {
+    return nc->recv_mbuf.len > TIME_SYNC_HTTP_HEAD_MAX;
+  }
+
+  int64_t date;
+  struct mg_str* header = head_len > 0 ? mg_get_http_header(&hm, "Date") : NULL;
+  if(header == NULL || !parse_date(*header, date)) {
+    ESP_LOGI("NTP", "No usable Date in HTTP reply");
+    return true;
+  }
+
+  // The reply was made somewhere in [date, date + 1 s), at a local time
+  // somewhere between sending the request and seeing the reply
+  int64_t lo = date * 1000000 - rx_time;
+  int64_t hi = date * 1000000 + 1000000 - http_sent_at;
+  if(http_samples > 0 && (lo > http_hi || hi < http_lo)) {
+    ESP_LOGI("NTP", "HTTP time replies disagree, keeping the latest");
+    http_samples = 0;
+  }
+  if(http_samples == 0) {
+    http_lo = lo;
+    http_hi = hi;
+  } else {
+    http_lo = lo > http_lo ? lo : http_lo;
+    http_hi = hi < http_hi ? hi : http_hi;
+  }
+  http_samples++;
+  return true;
+}
+
+void TimeSync::finish_http(int64_t now) {
+  if(http_samples > 0) {
+    // The true offset is anywhere in the bound, so the middle is never
+    // more than half its width out; an edge could be out by all of it
+    sample_t& sample = burst[0];
+    sample.offset = http_lo + (http_hi - http_lo) / 2;
+    sample.delay = http_hi - http_lo;
+    burst_count = 1;
+
+    portENTER_CRITICAL(&stats_lock);
+    stats.http_syncs++;
+    portEXIT_CRITICAL(&stats_lock);
+  }
+  finish(now);
+}
+
+bool TimeSync::next_url(char* url, size_t len) {
+  http_cursor += strspn(http_cursor, " ");
+  if(*http_cursor == 0) {
+    http_cursor = http_urls + strspn(http_urls, " ");
+  }
+
+  size_t url_len = strcspn(http_cursor, " ");
+  snprintf(url, len, "%.*s", (int)url_len, http_cursor);
+  http_cursor += url_len;
+  return url_len > 0 && url_len < len;
+}
+
+bool TimeSync::parse_date(const struct mg_str& date, int64_t& secs) {
+  // RFC 7231 IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+  char text[40];
+  char month[4];
+  struct tm parts;
+  memset(&parts, 0, sizeof(parts));
+  snprintf(text, sizeof(text), "%.*s", (int)date.len, date.p);
+  if(sscanf(text, "%*3s, %d %3s %d %d:%d:%d", &parts.tm_mday, month, &parts.tm_year, &parts.tm_hour, &parts.tm_min, &parts.tm_sec) != 6) {
+    return false;
+  }
+
+  parts.tm_mon = -1;
+  for(int i = 0; i < 12; i++) {
+    if(strcmp(month, month_names[i]) == 0) {
+      parts.tm_mon = i;
+    }
+  }
+  if(parts.tm_mon < 0 || parts.tm_year < 2020) {
+    return false;
+  }
+
+  parts.tm_year -= 1900;
+  secs = (int64_t)cs_timegm(&parts);
+  return true;
+}
+
+
+void TimeSync::apply(const sample_t& sample) {
+  if(llabs(sample.offset) > TIME_SYNC_STEP_US) {
+    struct timeval tv;
+    int64_t corrected = system_us() + sample.offset;
+    tv.tv_sec = corrected / 1000000;
+    tv.tv_usec = corrected % 1000000;
+    settimeofday(&tv, NULL);
+  } else {
+    // Small corrections are slewed so the display never skips or repeats a second
+    struct timeval delta;
+    delta.tv_sec = sample.offset / 1000000;
+    delta.tv_usec = sample.offset % 1000000;
+    adjtime(&delta, NULL);
+  }
+
+  offsets[offset_count % TIME_SYNC_JITTER_SAMPLES] = sample.offset;
+  offset_count++;
+
+  uint32_t n = offset_count < TIME_SYNC_JITTER_SAMPLES ? offset_count : TIME_SYNC_JITTER_SAMPLES;
+  double sum_sq = 0;
+  for(uint32_t i = 0; i < n; i++) {
+    double diff = (double)(offsets[i] - sample.offset);
+    sum_sq += diff * diff;
+  }
+
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&stats_lock);
+  stats.offset_us = sample.offset;
+  stats.delay_us = sample.delay;
+  stats.jitter_us = n > 1 ? (int64_t)sqrt(sum_sq / (n - 1)) : 0;
+  stats.syncs++;
+  stats.last_sync = now;
+  stats.radio_wait_ms = (radio_ready - session_start) / 1000;
+  stats.session_ms = (now - session_start) / 1000;
+  portEXIT_CRITICAL(&stats_lock);
+
+  WifiManager::stats_t wifi_stats = wifi.get_stats();
+  ESP_LOGI("NTP", "Synced: offset %lld us, delay %lld us, radio wait %lld ms, session %lld ms, radio duty %lld.%lld%%",
+    sample.offset, sample.delay, stats.radio_wait_ms, stats.session_ms,
+    wifi_stats.radio_on_us * 100 / wifi_stats.uptime_us,
+    (wifi_stats.radio_on_us * 1000 / wifi_stats.uptime_us) % 10
+  );
+}
+
+int64_t TimeSync::system_us() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+uint64_t TimeSync::to_ntp(int64_t us) {
+  uint64_t secs = (uint64_t)(us / 1000000) + NTP_UNIX_OFFSET;
+  uint64_t frac = ((uint64_t)(us % 1000000) << 32) / 1000000;
+  return (secs << 32) | frac;
+}
+
+int64_t TimeSync::from_ntp(uint64_t ntp) {
+  int64_t secs = (int64_t)(ntp >> 32) - (int64_t)NTP_UNIX_OFFSET;
+  int64_t usecs = (int64_t)(((ntp & 0xFFFFFFFF) * 1000000) >> 32);
+  return secs * 1000000 + usecs;
+}
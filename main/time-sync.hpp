@@ -0,0 +1,155 @@
+#ifndef TIME_SYNC_HPP
+#define TIME_SYNC_HPP
+
+#include <functional>
+#include <stdint.h>
+
+#include <freertos/FreeRTOS.h>
+
+#include "dns-cache.hpp"
+#include "mongoose.h"
+#include "power-manager.hpp"
+#include "wifi-manager.hpp"
+
+#define TIME_SYNC_BURST           3
+#define TIME_SYNC_SPACING_US      1000000
+#define TIME_SYNC_REPLY_US        2000000
+#define TIME_SYNC_RADIO_US        60000000
+#define TIME_SYNC_RESOLVE_US      15000000
+#define TIME_SYNC_RETRY_US        60000000
+#define TIME_SYNC_STEP_US         128000
+#define TIME_SYNC_JITTER_SAMPLES  8
+#define TIME_SYNC_HTTP_BURST      4
+#define TIME_SYNC_HTTP_SPACING_US 1250000
+#define TIME_SYNC_HTTP_US         15000000
+#define TIME_SYNC_HTTP_HEAD_MAX   2048
+#define TIME_SYNC_NTP_SKIP_AFTER  3
+#define TIME_SYNC_NTP_PROBE_EVERY 8
+
+
+// SNTP client on the App's mongoose manager. Each sync is a short session:
+// hold the radio, send a small burst of requests, keep the reply with the
+// lowest round trip, correct the system clock and let the radio go again.
+// The server is looked up through the DNS cache, so a known address is used
+// straight away.
+//
+// Where UDP 123 is blocked, the session falls back to HEAD requests against
+// the configured HTTP endpoints and reads their Date header. A Date only
+// says the reply was made some time in a one second window, somewhere
+// between sending the request and seeing the reply, which bounds the
+// offset. Requests are spaced a non-whole number of seconds apart so the
+// bounds from each reply narrow each other. The clock is moved to the
+// middle of the final bound, and its width is reported as the sample's
+// delay. After a few sessions where NTP got nothing, NTP is only retried
+// occasionally before going straight to HTTP.
+// Everything runs from poll(), so it never blocks the network task.
+class TimeSync {
+public:
+  typedef struct {
+    int64_t offset_us;
+    int64_t delay_us;
+    int64_t jitter_us;
+    uint32_t syncs;
+    uint32_t http_syncs;
+    uint32_t failures;
+    int64_t last_sync;
+    int64_t radio_wait_ms;
+    int64_t session_ms;
+  } stats_t;
+
+  TimeSync(WifiManager& wifi, DnsCache& dns, const char* server, const char* http_urls, uint32_t interval_secs);
+  ~TimeSync() {};
+
+  void init(struct mg_mgr* mgr);
+  // Returns when it next needs to run
+  int64_t poll(int64_t now);
+
+  void on_sync(std::function<void(int64_t)> callback) { sync_callback = callback; };
+  bool is_synced() { return synced; };
+  stats_t get_stats();
+
+private:
+  typedef struct {
+    int64_t offset;
+    int64_t delay;
+  } sample_t;
+
+  typedef enum {
+    TIME_SYNC_IDLE,
+    TIME_SYNC_WAIT_RADIO,
+    TIME_SYNC_RESOLVE,
+    TIME_SYNC_QUERY,
+    TIME_SYNC_HTTP
+  } state_t;
+
+  WifiManager& wifi;
+  DnsCache& dns;
+  const char* server;
+  int64_t interval_us;
+
+  struct mg_mgr* mgr;
+  struct mg_connection* conn;
+  bool conn_ready;
+  PerfLock query_lock;
+
+  state_t state;
+  int64_t next_sync;
+  int64_t session_start;
+  int64_t radio_ready;
+  int64_t next_request;
+  uint32_t sent;
+  uint32_t consecutive_failures;
+  bool synced;
+
+  uint64_t request_ts;
+  int64_t request_time;
+  sample_t burst[TIME_SYNC_BURST];
+  uint32_t burst_count;
+
+  int64_t offsets[TIME_SYNC_JITTER_SAMPLES];
+  uint32_t offset_count;
+
+  const char* http_urls;
+  const char* http_cursor;
+  struct mg_connection* http_conn;
+  char http_request[192];
+  int64_t http_start;
+  int64_t http_sent_at;
+  uint32_t http_sent;
+  uint32_t http_samples;
+  int64_t http_lo;
+  int64_t http_hi;
+  uint32_t ntp_failures;
+  uint32_t ntp_skips;
+
+  portMUX_TYPE stats_lock;
+  stats_t stats;
+
+  std::function<void(int64_t)> sync_callback;
+
+  static void handler(struct mg_connection* nc, int ev, void* ev_data);
+  static void http_handler(struct mg_connection* nc, int ev, void* ev_data);
+
+  void start_query(int64_t now, const char* addr);
+  void send_request();
+  void handle_reply(const uint8_t* data, size_t len, int64_t rx_time);
+  void end_ntp(int64_t now);
+  void finish(int64_t now);
+  void close_conn();
+  int64_t next_wakeup();
+
+  bool probe_ntp();
+  void start_http(int64_t now);
+  void send_http(int64_t now);
+  bool handle_http_reply(struct mg_connection* nc, int64_t rx_time);
+  void finish_http(int64_t now);
+  bool next_url(char* url, size_t len);
+  static bool parse_date(const struct mg_str& date, int64_t& secs);
+
+  void apply(const sample_t& sample);
+  static int64_t system_us();
+  static uint64_t to_ntp(int64_t us);
+  static int64_t from_ntp(uint64_t ntp);
+};
+
+#endif // TIME_SYNC_HPP
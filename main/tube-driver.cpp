@@ -1,11 +1,20 @@
 #include "tube-driver.hpp"
+#include "cathode-order.hpp"
 #include <esp_log.h>
 #include <esp_err.h>
+#include <esp_sleep.h>
+#include <esp_rom_sys.h>
+#include <esp_timer.h>
 #include <string.h>
 #include <freertos/task.h>
+#include <soc/soc_caps.h>
+
+static const uint32_t FRAME_BOUNDS_US[] = {5, 10, 20, 50, 100, 200, 500, 1000};
 
 TubeDriver::TubeDriver(uint8_t mosi_pin, uint8_t sclk_pin, uint8_t _le_pin, uint8_t _pol_pin, uint8_t _blank_pin, uint8_t _hv_dis_pin) :
-                       le_pin(_le_pin), pol_pin(_pol_pin), blank_pin(_blank_pin), hv_dis_pin(_hv_dis_pin) {
+                       le_pin(_le_pin), pol_pin(_pol_pin), blank_pin(_blank_pin), hv_dis_pin(_hv_dis_pin),
+                       hv_lock(portMUX_INITIALIZER_UNLOCKED), hv_on(false), hv_on_since(0), hv_on_us(0),
+                       frame_latency(FRAME_BOUNDS_US) {
   gpio_config_t io_conf;
 
   // Configure GPIO
@@ -61,6 +70,96 @@ TubeDriver::TubeDriver(uint8_t mosi_pin, uint8_t sclk_pin, uint8_t _le_pin, uint
 
   ESP_ERROR_CHECK(spi_bus_initialize(HSPI_HOST, &buscfg, 1));
   ESP_ERROR_CHECK(spi_bus_add_device(HSPI_HOST, &devcfg, &spi));
+
+  init_brightness();
+
+  // The HV5530 latches hold the digits through light sleep only if LE, BL,
+  // POL and HV_DIS keep their levels and the bus lines don't glitch, so keep
+  // these pads out of the automatic sleep configuration. The SPI driver holds
+  // its own PM lock for the duration of a transfer.
+#if SOC_GPIO_SUPPORT_SLP_SWITCH
+  const uint8_t retained_pins[] = {le_pin, pol_pin, blank_pin, hv_dis_pin, mosi_pin, sclk_pin};
+  for(auto pin : retained_pins) {
+    gpio_sleep_sel_dis((gpio_num_t)pin);
+  }
+#endif
+}
+
+
+void TubeDriver::init_brightness() {
+  // The RTC8M clock keeps running through light sleep, where the APB clock
+  // would stop the PWM and leave the tubes dark or at full brightness
+  ledc_timer_config_t timer_conf = {};
+  timer_conf.speed_mode = LEDC_LOW_SPEED_MODE;
+  timer_conf.duty_resolution = TUBE_BRIGHTNESS_RESOLUTION;
+  timer_conf.timer_num = LEDC_TIMER_0;
+  timer_conf.freq_hz = TUBE_BRIGHTNESS_FREQ_HZ;
+  timer_conf.clk_cfg = LEDC_USE_RTC8M_CLK;
+  ESP_ERROR_CHECK(ledc_timer_config(&timer_conf));
+  esp_sleep_pd_config(ESP_PD_DOMAIN_RTC8M, ESP_PD_OPTION_ON);
+
+  ledc_channel_config_t channel_conf = {};
+  channel_conf.gpio_num = blank_pin;
+  channel_conf.speed_mode = LEDC_LOW_SPEED_MODE;
+  channel_conf.channel = LEDC_CHANNEL_0;
+  channel_conf.intr_type = LEDC_INTR_DISABLE;
+  channel_conf.timer_sel = LEDC_TIMER_0;
+  channel_conf.duty = 1 << TUBE_BRIGHTNESS_RESOLUTION;
+  channel_conf.hpoint = 0;
+  ESP_ERROR_CHECK(ledc_channel_config(&channel_conf));
+}
+
+void TubeDriver::set_brightness(uint8_t percent) {
+  uint32_t duty = ((uint32_t)(percent > 100 ? 100 : percent) << TUBE_BRIGHTNESS_RESOLUTION) / 100;
+  ledc_set_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, duty);
+  ledc_update_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0);
+}
+
+void TubeDriver::enable_hv() {
+  gpio_set_level((gpio_num_t)hv_dis_pin, 0);
+
+  portENTER_CRITICAL(&hv_lock);
+  if(!hv_on) {
+    hv_on = true;
+    hv_on_since = esp_timer_get_time();
+  }
+  portEXIT_CRITICAL(&hv_lock);
+}
+
+void TubeDriver::disable_hv() {
+  gpio_set_level((gpio_num_t)hv_dis_pin, 1);
+
+  portENTER_CRITICAL(&hv_lock);
+  if(hv_on) {
+    hv_on = false;
+    hv_on_us += esp_timer_get_time() - hv_on_since;
+  }
+  portEXIT_CRITICAL(&hv_lock);
+}
+
+int64_t TubeDriver::get_hv_on_us(int64_t now) {
+  portENTER_CRITICAL(&hv_lock);
+  int64_t total = hv_on_us + (hv_on ? now - hv_on_since : 0);
+  portEXIT_CRITICAL(&hv_lock);
+  return total;
+}
+
+
+void TubeDriver::hold_off() {
+  ledc_stop(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, 0);
+  disable_hv();
+  // Nothing is left on RTC8M once the PWM stops
+  esp_sleep_pd_config(ESP_PD_DOMAIN_RTC8M, ESP_PD_OPTION_AUTO);
+
+  gpio_hold_en((gpio_num_t)blank_pin);
+  gpio_hold_en((gpio_num_t)hv_dis_pin);
+  gpio_deep_sleep_hold_en();
+}
+
+void TubeDriver::release_hold() {
+  gpio_deep_sleep_hold_dis();
+  gpio_hold_dis((gpio_num_t)blank_pin);
+  gpio_hold_dis((gpio_num_t)hv_dis_pin);
 }
 
 
@@ -81,21 +180,25 @@ void TubeDriver::set_tubes(int8_t one, int8_t two, int8_t three, int8_t four, in
 
   memset(&cathode_enables, 0x00, sizeof(cathode_enables_t));
 
-  cathode_enables.one = (0x0200 >> one) & (one > -1 ? 0xFFFF : 0x0000);
-  cathode_enables.two = (0x0200 >> two) & (two > -1 ? 0xFFFF : 0x0000);
-  cathode_enables.three = (0x0200 >> three) & (three > -1 ? 0xFFFF : 0x0000);
-  cathode_enables.four = (0x0200 >> four) & (four > -1 ? 0xFFFF : 0x0000);
-  cathode_enables.five = (0x0200 >> five) & (five > -1 ? 0xFFFF : 0x0000);
-  cathode_enables.six = (0x0200 >> six) & (six > -1 ? 0xFFFF : 0x0000);
+  cathode_enables.one = cathode::mask(one);
+  cathode_enables.two = cathode::mask(two);
+  cathode_enables.three = cathode::mask(three);
+  cathode_enables.four = cathode::mask(four);
+  cathode_enables.five = cathode::mask(five);
+  cathode_enables.six = cathode::mask(six);
 
   cathode_enables.nc1 = 0;
   cathode_enables.nc2 = 0;
 
+  int64_t start = esp_timer_get_time();
   send_cathodes((const uint8_t*)&cathode_enables, sizeof(cathode_enables_t));
 
+  // The HV5530 only needs the latch high for tens of nanoseconds; a
+  // scheduler tick here would cap the frame rate at 100 Hz with no margin
   gpio_set_level((gpio_num_t)le_pin, 1);
-  vTaskDelay(1);
+  esp_rom_delay_us(1);
   gpio_set_level((gpio_num_t)le_pin, 0);
+  frame_latency.observe(esp_timer_get_time() - start);
 };
 
 
@@ -107,8 +210,9 @@ void TubeDriver::send_cathodes(const uint8_t *data, int len) {
     t.length = len * 8;                 //Len is in bytes, transaction length is in bits.
     t.tx_buffer = data;                 //Data
     t.user = (void*)1;                  //D/C needs to be set to 1
-    ret = spi_device_transmit(spi, &t); //Transmit!
+    ret = spi_device_polling_transmit(spi, &t); //Transmit! A few microseconds, not worth an interrupt
     if( ret != ESP_OK){
+      spi_errors.add();
       ESP_LOGI("I2C", "Error message: %s", esp_err_to_name(ret));
     }
 }
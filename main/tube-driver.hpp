@@ -3,7 +3,14 @@
 
 #include <stdint.h>
 #include <driver/gpio.h>
+#include <driver/ledc.h>
 #include <driver/spi_master.h>
+#include <freertos/FreeRTOS.h>
+
+#include "metrics.hpp"
+
+#define TUBE_BRIGHTNESS_FREQ_HZ     1000
+#define TUBE_BRIGHTNESS_RESOLUTION  LEDC_TIMER_8_BIT
 
 class TubeDriver {
 public:
@@ -13,9 +20,23 @@ public:
 
   void set_tubes(int8_t one, int8_t two, int8_t three, int8_t four, int8_t five, int8_t six);
 
-  void disable_hv() { gpio_set_level((gpio_num_t)hv_dis_pin, 1); };
-  void enable_hv() { gpio_set_level((gpio_num_t)hv_dis_pin, 0); };
-  bool hv_enabled() { return (bool)gpio_get_level((gpio_num_t)hv_dis_pin); }
+  void disable_hv();
+  void enable_hv();
+  bool hv_enabled() { return hv_on; }
+  // Total time the HV supply has been enabled since boot
+  int64_t get_hv_on_us(int64_t now);
+
+  // PWM on the blanking input, 0 to 100 percent
+  void set_brightness(uint8_t percent);
+
+  // Blank and power down the tubes and latch those levels through deep
+  // sleep, when the pads would otherwise float
+  void hold_off();
+  void release_hold();
+
+  // SPI transfer plus latch, per frame
+  const Histogram& get_frame_latency() { return frame_latency; };
+  const Counter& get_spi_errors() { return spi_errors; };
 
 private:
   spi_device_handle_t spi;
@@ -26,6 +47,15 @@ private:
   uint8_t blank_pin;
   uint8_t hv_dis_pin;
 
+  portMUX_TYPE hv_lock;
+  bool hv_on;
+  int64_t hv_on_since;
+  int64_t hv_on_us;
+
+  Histogram frame_latency;
+  Counter spi_errors;
+
+  void init_brightness();
   void send_cathodes(const uint8_t* data, int len);
 };
 
@@ -1,92 +1,199 @@
 #include "tube-manager.hpp"
+#include "cathode-order.hpp"
 
 #include <esp_log.h>
-#include <sys/time.h>
-#include <time.h>
-
-
-TubeManager::TubeManager(TubeDriver& _td) : td(_td), poison_prev_int(300), poison_prev_dur(10) {};
+#include <string.h>
+
+#define SCAN_STEP_MS        100
+#define SLOT_ROLL_MS        1500
+#define SCROLL_STEP_MS      80
+#define WIPE_STEP_MS        60
+#define DEPTH_STEP_MS       40
+
+// Exercise time per cathode grows with how long it has been dark
+#define EXERCISE_MIN_MS         40
+#define EXERCISE_MAX_MS         1000
+#define EXERCISE_MS_PER_HOUR    200
+
+
+TubeManager::TubeManager(TubeDriver& _td) : td(_td), poison_prev_int(300), poison_prev_dur(10), poison_prev_spd(1),
+                                            next_prevention(0), sent_at(0),
+                                            usage_lock(portMUX_INITIALIZER_UNLOCKED), current_effect(TUBE_EFFECT_NONE) {
+  memset(digits, -1, sizeof(digits));
+  memset(sent, -1, sizeof(sent));
+  memset(cathodes, 0, sizeof(cathodes));
+};
+
+void TubeManager::set_digits(int8_t _one, int8_t _two, int8_t _three, int8_t _four, int8_t _five, int8_t _six) {
+  digits[0] = _one;
+  digits[1] = _two;
+  digits[2] = _three;
+  digits[3] = _four;
+  digits[4] = _five;
+  digits[5] = _six;
+
+  if(!digits_set && current_effect == TUBE_EFFECT_SCAN) {
+    effect.stop();
+  }
+  digits_set = true;
+}
 
-void TubeManager::set_digits(uint8_t _one, uint8_t _two, uint8_t _three, uint8_t _four, uint8_t _five, uint8_t _six) {
-  one = _one;
-  two = _two;
-  three = _three;
-  four = _four;
-  five = _five;
-  six = _six;
+void TubeManager::start_effect(effect_t new_effect, int64_t now) {
+  switch(new_effect) {
+    case TUBE_EFFECT_SCAN:
+      animation_scan(effect, SCAN_STEP_MS);
+      break;
+    case TUBE_EFFECT_CATHODE_CYCLE:
+      animation_cathode_cycle(effect, 10 * (poison_prev_spd > 0 ? poison_prev_spd : 1), poison_prev_dur * 1000);
+      break;
+    case TUBE_EFFECT_EXERCISE:
+      if(!build_exercise(now)) {
+        return;
+      }
+      break;
+    case TUBE_EFFECT_SLOT_ROLL:
+      animation_slot_roll(effect, sent, digits, SLOT_ROLL_MS);
+      break;
+    case TUBE_EFFECT_SCROLL:
+      animation_scroll(effect, sent, digits, SCROLL_STEP_MS);
+      break;
+    case TUBE_EFFECT_WIPE:
+      animation_wipe(effect, sent, digits, WIPE_STEP_MS);
+      break;
+    case TUBE_EFFECT_DEPTH_SWEEP:
+      animation_depth_sweep(effect, sent, digits, DEPTH_STEP_MS);
+      break;
+    case TUBE_EFFECT_NONE:
+    default:
+      effect.stop();
+      current_effect = TUBE_EFFECT_NONE;
+      return;
+  }
 
-  digits_set = true;
+  current_effect = new_effect;
+  effect.start(now);
 }
 
 
-void TubeManager::tick_10ms() {
-  if(!digits_set) {
-    if(scan_count % 10 == 0) {
-      if(scan_increment) {
-        scan_pos++;
-      } else {
-        scan_pos--;
-      }
+void TubeManager::tick(int64_t now) {
+  if(!digits_set && !effect.is_playing()) {
+    start_effect(TUBE_EFFECT_SCAN, now);
+  }
 
-      if(scan_pos >= 6) {
-        scan_increment = false;
-        scan_pos = 6;
-      } else if(scan_pos <= 1) {
-        scan_increment = true;
-        scan_pos = 1;
+  // Prevention is scheduled on the monotonic clock, so setting the time
+  // doesn't trigger it; the first run is a full interval after the digits
+  // are first set
+  if(digits_set) {
+    if(next_prevention == 0) {
+      next_prevention = now + (int64_t)poison_prev_int * 1000000;
+    } else if(now >= next_prevention) {
+      next_prevention = now + (int64_t)poison_prev_int * 1000000;
+      if(!effect.is_playing() && !prevention_held) {
+        start_effect(TUBE_EFFECT_EXERCISE, now);
       }
-
-      // Update the tubes
-      one = (0x02 >> scan_pos) & 0x01;
-      two = (0x04 >> scan_pos) & 0x01;
-      three = (0x08 >> scan_pos) & 0x01;
-      four = (0x10 >> scan_pos) & 0x01;
-      five = (0x20 >> scan_pos) & 0x01;
-      six = (0x40 >> scan_pos) & 0x01;
-
-      one = one > 0 ? one : -1;
-      two = two > 0 ? two : -1;
-      three = three > 0 ? three : -1;
-      four = four > 0 ? four : -1;
-      five = five > 0 ? five : -1;
-      six = six > 0 ? six : -1;
     }
+  }
 
-    scan_count++;
+  int8_t frame[6];
+  if(!effect.frame_at(now, frame)) {
+    memcpy(frame, digits, sizeof(frame));
+  }
+  for(uint8_t tube = 0; tube < 6; tube++) {
+    if(frame[tube] == ANIMATION_PASSTHROUGH) {
+      frame[tube] = digits[tube];
+    }
+  }
 
-    td.set_tubes(one, two, three, four, five, six);
+  // The HV5530 latches hold the last frame, so only send changes
+  if(memcmp(frame, sent, sizeof(sent)) == 0) {
     return;
   }
+  account(now);
+  memcpy(sent, frame, sizeof(sent));
+  td.set_tubes(frame[0], frame[1], frame[2], frame[3], frame[4], frame[5]);
+}
+
+
+void TubeManager::account(int64_t now) {
+  // Charge the outgoing frame for the time it was latched; with HV off
+  // nothing was actually lit
+  int64_t lit_us = sent_at > 0 && td.hv_enabled() ? now - sent_at : 0;
 
-  time_t now = 0;
-  time(&now);
-
-  if(poison_prev_active && ((now - poison_prev_start) < poison_prev_dur)) {
-    td.set_tubes(
-      one_index,
-      (one_index + 1) % 10,
-      (one_index + 2) % 10,
-      (one_index + 3) % 10,
-      (one_index + 4) % 10,
-      (one_index + 5) % 10
-    );
-    one_index++;
-    one_index %= 10;
-  } else {
-    td.set_tubes(one, two, three, four, five, six);
-    poison_prev_active = false;
+  portENTER_CRITICAL(&usage_lock);
+  for(uint8_t tube = 0; tube < 6; tube++) {
+    if(sent[tube] >= 0 && sent[tube] <= 9) {
+      cathode_t& cathode = cathodes[tube][sent[tube]];
+      cathode.on_us += lit_us;
+      if(lit_us > 0) {
+        cathode.last_lit = now;
+      }
+    }
   }
+  portEXIT_CRITICAL(&usage_lock);
+  sent_at = now;
+}
 
-  // Don't run prevention on startup
-  if(now - 1200 > poison_prev_start){
-    poison_prev_start = now;
-    return;
+void TubeManager::get_on_time_us(int64_t on_us[6][10]) {
+  portENTER_CRITICAL(&usage_lock);
+  for(uint8_t tube = 0; tube < 6; tube++) {
+    for(uint8_t digit = 0; digit < 10; digit++) {
+      on_us[tube][digit] = cathodes[tube][digit].on_us;
+    }
   }
+  portEXIT_CRITICAL(&usage_lock);
+}
+
+bool TubeManager::build_exercise(int64_t now) {
+  // Skip the latched digits, they're lit right now
+  account(now);
+
+  const int8_t passthrough[6] = {
+    ANIMATION_PASSTHROUGH, ANIMATION_PASSTHROUGH, ANIMATION_PASSTHROUGH,
+    ANIMATION_PASSTHROUGH, ANIMATION_PASSTHROUGH, ANIMATION_PASSTHROUGH
+  };
+  effect.clear(passthrough);
+
+  // Each tube visits only the cathodes that have been dark for at least an
+  // interval and dwells on each in proportion to how long it sat unused.
+  // They're visited front to back through the stack, so the glow moves
+  // between physical neighbours. Tubes with nothing to do keep showing
+  // the time.
+  int64_t threshold_us = (int64_t)poison_prev_int * 1000000;
+  uint16_t length_ms = 0;
+  uint32_t exercised = 0;
+  for(uint8_t tube = 0; tube < 6; tube++) {
+    uint8_t order[10];
+    uint8_t count = 0;
+    for(uint8_t depth = 0; depth < 10; depth++) {
+      uint8_t digit = cathode::STACK[depth];
+      if(now - cathodes[tube][digit].last_lit >= threshold_us) {
+        order[count++] = digit;
+      }
+    }
 
-  // Posion prevention is needed, run now
-  if(now > poison_prev_start + poison_prev_int){
-    poison_prev_start = now;
-    poison_prev_active = true;
-    one_index = 0;
+    uint16_t at_ms = 0;
+    for(uint8_t i = 0; i < count; i++) {
+      int64_t idle_ms = (now - cathodes[tube][order[i]].last_lit) / 1000;
+      int64_t dwell_ms = idle_ms * EXERCISE_MS_PER_HOUR / 3600000;
+      dwell_ms = dwell_ms < EXERCISE_MIN_MS ? EXERCISE_MIN_MS : dwell_ms > EXERCISE_MAX_MS ? EXERCISE_MAX_MS : dwell_ms;
+
+      effect.add_key(tube, at_ms, order[i]);
+      at_ms += dwell_ms;
+    }
+    if(count > 0) {
+      effect.add_key(tube, at_ms, ANIMATION_PASSTHROUGH);
+    }
+
+    exercised += count;
+    if(at_ms > length_ms) {
+      length_ms = at_ms;
+    }
+  }
+
+  if(exercised == 0) {
+    return false;
   }
+
+  ESP_LOGI("Tubes", "Exercising %u idle cathodes for %u ms", exercised, length_ms);
+  return effect.compile(length_ms);
 }
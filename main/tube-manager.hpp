@@ -2,41 +2,79 @@
 #define TUBE_MANAGER_HPP
 
 #include <stdint.h>
+#include <string.h>
 
+#include <freertos/FreeRTOS.h>
+
+#include "animation.hpp"
 #include "tube-driver.hpp"
 
 class TubeManager {
 public:
+  typedef enum {
+    TUBE_EFFECT_NONE,
+    TUBE_EFFECT_SCAN,
+    TUBE_EFFECT_CATHODE_CYCLE,
+    TUBE_EFFECT_EXERCISE,
+    TUBE_EFFECT_SLOT_ROLL,
+    TUBE_EFFECT_SCROLL,
+    TUBE_EFFECT_WIPE,
+    TUBE_EFFECT_DEPTH_SWEEP
+  } effect_t;
+
   TubeManager(TubeDriver& td);
 
-  void set_digits(uint8_t _one, uint8_t _two, uint8_t _three, uint8_t _four, uint8_t _five, uint8_t _six);
+  void set_digits(int8_t _one, int8_t _two, int8_t _three, int8_t _four, int8_t _five, int8_t _six);
   void set_posion_prev_int(uint32_t new_poison_prev_int) { poison_prev_int = new_poison_prev_int; };
   void set_posion_prev_dur(uint32_t new_poison_prev_dur) { poison_prev_dur = new_poison_prev_dur; };
   void set_posion_prev_spd(uint8_t new_poison_prev_spd) { poison_prev_spd = new_poison_prev_spd; };
-  void tick_10ms();
+  void tick(int64_t now);
+  void start_prevention(int64_t now) { start_effect(TUBE_EFFECT_CATHODE_CYCLE, now); };
+  void start_effect(effect_t effect, int64_t now);
+  // Keep scheduled prevention from interrupting a mode that needs every tube
+  void hold_prevention(bool hold) { prevention_held = hold; };
+
+  // Nothing is animating, so the tubes only change with the digits
+  bool is_idle() { return digits_set && !effect.is_playing(); };
+  bool is_scanning() { return !digits_set; };
+  bool is_preventing() { return effect.is_playing() && (current_effect == TUBE_EFFECT_CATHODE_CYCLE || current_effect == TUBE_EFFECT_EXERCISE); };
+  void get_digits(int8_t* _digits) { memcpy(_digits, digits, sizeof(digits)); };
+  // What is latched into the drivers, which differs from the digits while
+  // an effect plays
+  void get_frame(int8_t* frame) { memcpy(frame, sent, sizeof(sent)); };
+
+  // Cathode usage, accumulated whenever a digit is lit
+  int64_t get_idle_us(uint8_t tube, uint8_t digit, int64_t now) { return now - cathodes[tube][digit].last_lit; };
+  // Safe from any task
+  void get_on_time_us(int64_t on_us[6][10]);
 
 private:
+  typedef struct {
+    int64_t on_us;
+    int64_t last_lit;
+  } cathode_t;
+
   TubeDriver& td;
 
   uint32_t poison_prev_int;
   uint8_t poison_prev_dur;
   uint8_t poison_prev_spd;
-
-  time_t poison_prev_start;
-  bool poison_prev_active;
-  uint8_t one_index;
+  int64_t next_prevention;
+  bool prevention_held = false;
 
   bool digits_set = false;
-  int8_t scan_pos = 0;
-  bool scan_increment = true;
-  uint32_t scan_count = 0;
-
-  int8_t one;
-  int8_t two;
-  int8_t three;
-  int8_t four;
-  int8_t five;
-  int8_t six;
+  int8_t digits[6];
+  int8_t sent[6];
+  int64_t sent_at;
+
+  portMUX_TYPE usage_lock;
+  cathode_t cathodes[6][10];
+
+  Animation effect;
+  effect_t current_effect;
+
+  void account(int64_t now);
+  bool build_exercise(int64_t now);
 };
 
 
@@ -0,0 +1,107 @@
+#include "wear-counters.hpp"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <nvs.h>
+#include <stdio.h>
+#include <string.h>
+
+#define WEAR_COUNTERS_NAMESPACE "wear"
+#define WEAR_COUNTERS_KEY       "counters"
+
+
+WearCounters::WearCounters(TubeManager& _tm, TubeDriver& _td, uint32_t flush_secs) :
+  tm(_tm), td(_td), flush_us((int64_t)flush_secs * 1000000), next_flush(0) {
+  memset(&baseline, 0, sizeof(baseline));
+  memset(&stored, 0, sizeof(stored));
+}
+
+void WearCounters::init() {
+  nvs_handle_t handle;
+  if(nvs_open(WEAR_COUNTERS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+    size_t len = sizeof(record_t);
+    esp_err_t ret = nvs_get_blob(handle, WEAR_COUNTERS_KEY, &baseline, &len);
+    nvs_close(handle);
+
+    if(ret != ESP_OK || len != sizeof(record_t) || baseline.version != WEAR_COUNTERS_VERSION) {
+      memset(&baseline, 0, sizeof(baseline));
+    }
+  }
+
+  stored = baseline;
+  baseline.version = WEAR_COUNTERS_VERSION;
+  baseline.boots++;
+  next_flush = esp_timer_get_time() + flush_us;
+  flush();
+
+  ESP_LOGI("Wear", "Boot %u, HV on %u h", baseline.boots, baseline.hv_secs / 3600);
+}
+
+int64_t WearCounters::poll(int64_t now) {
+  if(now >= next_flush) {
+    next_flush = now + flush_us;
+    flush();
+  }
+  return next_flush;
+}
+
+bool WearCounters::flush() {
+  record_t totals = get_totals();
+  if(memcmp(&totals, &stored, sizeof(record_t)) == 0) {
+    return true;
+  }
+
+  nvs_handle_t handle;
+  if(nvs_open(WEAR_COUNTERS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+    return false;
+  }
+
+  esp_err_t ret = nvs_set_blob(handle, WEAR_COUNTERS_KEY, &totals, sizeof(record_t));
+  if(ret == ESP_OK) {
+    ret = nvs_commit(handle);
+  }
+  nvs_close(handle);
+
+  if(ret != ESP_OK) {
+    ESP_LOGI("Wear", "Failed to store counters: %s", esp_err_to_name(ret));
+    return false;
+  }
+
+  stored = totals;
+  return true;
+}
+
+
+WearCounters::record_t WearCounters::get_totals() {
+  int64_t now = esp_timer_get_time();
+  int64_t on_us[6][10];
+  tm.get_on_time_us(on_us);
+
+  record_t totals = baseline;
+  totals.hv_secs += td.get_hv_on_us(now) / 1000000;
+  for(uint8_t tube = 0; tube < 6; tube++) {
+    for(uint8_t digit = 0; digit < 10; digit++) {
+      totals.cathode_secs[tube][digit] += on_us[tube][digit] / 1000000;
+    }
+  }
+  return totals;
+}
+
+size_t WearCounters::render_json(char* buf, size_t len) {
+  record_t totals = get_totals();
+
+  size_t pos = snprintf(buf, len, "{\"boots\":%u,\"hv_secs\":%u,\"cathode_secs\":[", totals.boots, totals.hv_secs);
+  for(uint8_t tube = 0; tube < 6 && pos < len; tube++) {
+    pos += snprintf(buf + pos, len - pos, "%s[", tube ? "," : "");
+    for(uint8_t digit = 0; digit < 10 && pos < len; digit++) {
+      pos += snprintf(buf + pos, len - pos, "%s%u", digit ? "," : "", totals.cathode_secs[tube][digit]);
+    }
+    if(pos < len) {
+      pos += snprintf(buf + pos, len - pos, "]");
+    }
+  }
+  if(pos < len) {
+    pos += snprintf(buf + pos, len - pos, "]}");
+  }
+  return pos < len ? pos : len - 1;
+}
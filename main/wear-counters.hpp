@@ -0,0 +1,48 @@
+#ifndef WEAR_COUNTERS_HPP
+#define WEAR_COUNTERS_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tube-driver.hpp"
+#include "tube-manager.hpp"
+
+#define WEAR_COUNTERS_VERSION 1
+
+
+// Lifetime tube wear kept in NVS. TubeManager and TubeDriver count lit and
+// HV time in RAM since boot; this adds them to the totals restored at boot
+// and writes the result back only every flush interval, and only when it
+// changed, so the flash sees a few hundred bytes an hour at most.
+class WearCounters {
+public:
+  typedef struct {
+    uint32_t version;
+    uint32_t boots;
+    uint32_t hv_secs;
+    uint32_t cathode_secs[6][10];
+  } record_t;
+
+  WearCounters(TubeManager& tm, TubeDriver& td, uint32_t flush_secs);
+  ~WearCounters() {};
+
+  // Restore the totals; call once NVS is up
+  void init();
+  // Returns when it next needs to run
+  int64_t poll(int64_t now);
+  bool flush();
+
+  record_t get_totals();
+  size_t render_json(char* buf, size_t len);
+
+private:
+  TubeManager& tm;
+  TubeDriver& td;
+  int64_t flush_us;
+  int64_t next_flush;
+
+  record_t baseline;
+  record_t stored;
+};
+
+#endif // WEAR_COUNTERS_HPP
@@ -0,0 +1,69 @@
+#include "wifi-cache.hpp"
+
+#include <esp_log.h>
+#include <nvs.h>
+#include <string.h>
+
+#define WIFI_CACHE_NAMESPACE "wifi_cache"
+#define WIFI_CACHE_KEY       "last_ap"
+
+
+bool WifiCache::load() {
+  nvs_handle_t handle;
+  valid = false;
+
+  if(nvs_open(WIFI_CACHE_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+    return false;
+  }
+
+  size_t len = sizeof(entry_t);
+  esp_err_t ret = nvs_get_blob(handle, WIFI_CACHE_KEY, &entry, &len);
+  nvs_close(handle);
+
+  if(ret != ESP_OK || len != sizeof(entry_t)) {
+    ESP_LOGI("WiFi", "No cached AP");
+    return false;
+  }
+
+  valid = entry.channel > 0;
+  return valid;
+}
+
+bool WifiCache::store(const entry_t& new_entry) {
+  // Skip the flash write when nothing changed
+  if(valid && memcmp(&entry, &new_entry, sizeof(entry_t)) == 0) {
+    return true;
+  }
+
+  nvs_handle_t handle;
+  if(nvs_open(WIFI_CACHE_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+    return false;
+  }
+
+  esp_err_t ret = nvs_set_blob(handle, WIFI_CACHE_KEY, &new_entry, sizeof(entry_t));
+  if(ret == ESP_OK) {
+    ret = nvs_commit(handle);
+  }
+  nvs_close(handle);
+
+  if(ret != ESP_OK) {
+    ESP_LOGI("WiFi", "Failed to store AP cache: %s", esp_err_to_name(ret));
+    return false;
+  }
+
+  entry = new_entry;
+  valid = true;
+  return true;
+}
+
+void WifiCache::clear() {
+  nvs_handle_t handle;
+  valid = false;
+
+  if(nvs_open(WIFI_CACHE_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+    return;
+  }
+  nvs_erase_key(handle, WIFI_CACHE_KEY);
+  nvs_commit(handle);
+  nvs_close(handle);
+}
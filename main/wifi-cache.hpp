@@ -0,0 +1,35 @@
+#ifndef WIFI_CACHE_HPP
+#define WIFI_CACHE_HPP
+
+#include <stdint.h>
+
+#include <esp_err.h>
+
+
+// Last known good association, kept in NVS so the next boot can skip the
+// all channel scan. The address is lwIP's to remember: with
+// CONFIG_LWIP_DHCP_RESTORE_LAST_IP the DHCP client asks for it back in a
+// single request instead of going through discovery.
+class WifiCache {
+public:
+  typedef struct {
+    uint8_t bssid[6];
+    uint8_t channel;
+  } entry_t;
+
+  WifiCache() : valid(false) {};
+  ~WifiCache() {};
+
+  bool load();
+  bool store(const entry_t& new_entry);
+  void clear();
+
+  bool has_ap() { return valid; };
+  const entry_t& get() { return entry; };
+
+private:
+  bool valid;
+  entry_t entry;
+};
+
+#endif // WIFI_CACHE_HPP
@@ -0,0 +1,395 @@
+#include "wifi-manager.hpp"
+
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <string.h>
+
+// Private events posted by acquire() and release()
+static const char* WIFI_MANAGER_EVENT = "WIFI_MANAGER_EVENT";
+enum {
+  WIFI_MANAGER_ACQUIRE,
+  WIFI_MANAGER_RELEASE
+};
+
+
+WifiManager::WifiManager(const char* _ssid, const char* _pass) :
+  ssid(_ssid), pass(_pass), policy(WIFI_POLICY_ALWAYS_ON), control_window_secs(0),
+  radio_refs(0), radio_on(false), radio_started(0), stop_at(0), netif(NULL), fast_connect(false), connect_lock("wifi_connect"),
+  event_group(NULL), events(NULL), task_handle(NULL), stats_lock(portMUX_INITIALIZER_UNLOCKED),
+  state(WIFI_STATE_IDLE), failures(0), retry_at(0), connect_start(0), connected_at(0), next_rssi(0) {
+  memset(&config, 0, sizeof(config));
+  memset(&stats, 0, sizeof(stats));
+}
+
+void WifiManager::start() {
+  ESP_ERROR_CHECK(esp_netif_init());
+  event_group = xEventGroupCreate();
+  events = xQueueCreate(WIFI_EVENT_QUEUE_LEN, sizeof(event_t));
+
+  ESP_ERROR_CHECK(esp_event_loop_create_default());
+  netif = esp_netif_create_default_wifi_sta();
+  ESP_ERROR_CHECK(esp_netif_set_hostname(netif, "NixieClock"));
+
+  wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+  ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+
+  esp_event_handler_instance_t instance_any_id;
+  esp_event_handler_instance_t instance_any_ip;
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
+                                                      ESP_EVENT_ANY_ID,
+                                                      &WifiManager::event_handler,
+                                                      this,
+                                                      &instance_any_id));
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
+                                                      ESP_EVENT_ANY_ID,
+                                                      &WifiManager::event_handler,
+                                                      this,
+                                                      &instance_any_ip));
+
+  strcpy((char*)config.sta.ssid, ssid);
+  strcpy((char*)config.sta.password, pass);
+  config.sta.threshold.authmode = WIFI_AUTH_WPA2_PSK;
+  if(policy == WIFI_POLICY_MODEM_SLEEP) {
+    config.sta.listen_interval = WIFI_LISTEN_INTERVAL;
+  }
+  apply_cache();
+
+  ESP_LOGI("WiFi", "Setting WiFi configuration SSID %s...", config.sta.ssid);
+  ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+  ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &config));
+
+  xTaskCreatePinnedToCore(&WifiManager::task, "wifi_task", 4096, this, 3, &task_handle, 0);
+
+  // Sync-only still starts with the radio up so there is a control window
+  // after boot; it shuts down once that passes with nobody holding it
+  int64_t now = esp_timer_get_time();
+  stop_at = now + (int64_t)control_window_secs * 1000000;
+  start_radio(now);
+
+  if(policy == WIFI_POLICY_MODEM_SLEEP) {
+    ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MAX_MODEM));
+  }
+}
+
+void WifiManager::acquire() {
+  event_t event = {WIFI_MANAGER_EVENT, WIFI_MANAGER_ACQUIRE, 0};
+  xQueueSend(events, &event, portMAX_DELAY);
+}
+
+void WifiManager::release() {
+  event_t event = {WIFI_MANAGER_EVENT, WIFI_MANAGER_RELEASE, 0};
+  xQueueSend(events, &event, portMAX_DELAY);
+}
+
+bool WifiManager::wait_connected(TickType_t timeout) {
+  return xEventGroupWaitBits(event_group, WIFI_CONNECTED_BIT, pdFALSE, pdTRUE, timeout) & WIFI_CONNECTED_BIT;
+}
+
+WifiManager::stats_t WifiManager::get_stats() {
+  portENTER_CRITICAL(&stats_lock);
+  stats_t snapshot = stats;
+  portEXIT_CRITICAL(&stats_lock);
+
+  int64_t now = esp_timer_get_time();
+  if(state == WIFI_STATE_CONNECTED) {
+    snapshot.connected_us += now - connected_at;
+  }
+  if(radio_on) {
+    snapshot.radio_on_us += now - radio_started;
+  }
+  snapshot.uptime_us = now;
+  return snapshot;
+}
+
+
+void WifiManager::event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
+  WifiManager* manager = (WifiManager*)arg;
+
+  event_t event;
+  event.base = event_base;
+  event.id = event_id;
+  event.reason = 0;
+  if(event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+    event.reason = ((wifi_event_sta_disconnected_t*)event_data)->reason;
+  }
+
+  // Never block the default event loop; the task catches up on the next event
+  xQueueSend(manager->events, &event, 0);
+}
+
+void WifiManager::task(void* ctx) {
+  WifiManager* manager = (WifiManager*)ctx;
+  event_t event;
+
+  while(1) {
+    TickType_t wait = manager->next_wakeup(esp_timer_get_time());
+    bool have_event = xQueueReceive(manager->events, &event, wait) == pdTRUE;
+
+    int64_t now = esp_timer_get_time();
+    if(have_event) {
+      manager->handle_event(event, now);
+    }
+
+    if(manager->policy == WIFI_POLICY_SYNC_ONLY && manager->radio_on &&
+       manager->radio_refs == 0 && now >= manager->stop_at) {
+      manager->stop_radio(now);
+    } else if(manager->state == WIFI_STATE_BACKOFF && now >= manager->retry_at) {
+      manager->connect(now);
+    } else if(manager->state == WIFI_STATE_CONNECTED && now >= manager->next_rssi) {
+      manager->sample_rssi(now);
+    }
+  }
+}
+
+void WifiManager::handle_event(const event_t& event, int64_t now) {
+  if(event.base == WIFI_MANAGER_EVENT && event.id == WIFI_MANAGER_ACQUIRE) {
+    radio_refs++;
+    if(!radio_on) {
+      start_radio(now);
+    }
+  } else if(event.base == WIFI_MANAGER_EVENT && event.id == WIFI_MANAGER_RELEASE) {
+    if(radio_refs > 0 && --radio_refs == 0) {
+      stop_at = now + (int64_t)control_window_secs * 1000000;
+    }
+  } else if(event.base == WIFI_EVENT && event.id == WIFI_EVENT_STA_START) {
+    connect(now);
+  } else if(event.base == WIFI_EVENT && event.id == WIFI_EVENT_STA_DISCONNECTED) {
+    xEventGroupClearBits(event_group, WIFI_CONNECTED_BIT);
+
+    portENTER_CRITICAL(&stats_lock);
+    stats.last_reason = event.reason;
+    if(state == WIFI_STATE_CONNECTED) {
+      stats.disconnects++;
+      stats.connected_us += now - connected_at;
+    }
+    portEXIT_CRITICAL(&stats_lock);
+
+    // A deliberate radio stop isn't a failure
+    if(!radio_on) {
+      state = WIFI_STATE_OFF;
+      return;
+    }
+
+    ESP_LOGI("WiFi", "Disconnected, reason %u", event.reason);
+    if(fast_connect) {
+      full_scan();
+    } else if(config.sta.bssid_set) {
+      // Still pinned to the AP of an earlier fast connect; scan so roaming
+      // or a replaced AP can be found
+      restore_scan();
+    }
+    schedule_retry(now);
+  } else if(event.base == IP_EVENT && event.id == IP_EVENT_STA_GOT_IP) {
+    if(state == WIFI_STATE_CONNECTED) {
+      // DHCP getting the address back after losing it
+      xEventGroupSetBits(event_group, WIFI_CONNECTED_BIT);
+      return;
+    }
+
+    wifi_ap_record_t ap_info;
+    int8_t rssi = esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK ? ap_info.rssi : 0;
+
+    portENTER_CRITICAL(&stats_lock);
+    stats.connects++;
+    stats.fast_connects += fast_connect ? 1 : 0;
+    stats.connect_ms = (now - connect_start) / 1000;
+    stats.backoff_ms = 0;
+    stats.rssi = rssi;
+    if(stats.connects == 1 || rssi < stats.rssi_min) {
+      stats.rssi_min = rssi;
+    }
+    if(stats.connects == 1 || rssi > stats.rssi_max) {
+      stats.rssi_max = rssi;
+    }
+    portEXIT_CRITICAL(&stats_lock);
+
+    ESP_LOGI("WiFi", "Connected in %lld ms after %u attempt(s) (%s), RSSI %d",
+      stats.connect_ms, failures + 1, fast_connect ? "cached AP" : "full scan", rssi
+    );
+
+    connect_lock.release();
+    store_cache();
+    fast_connect = false;
+    failures = 0;
+    connected_at = now;
+    next_rssi = now + (int64_t)WIFI_RSSI_INTERVAL_MS * 1000;
+    state = WIFI_STATE_CONNECTED;
+    xEventGroupSetBits(event_group, WIFI_CONNECTED_BIT);
+  } else if(event.base == IP_EVENT && event.id == IP_EVENT_STA_LOST_IP) {
+    xEventGroupClearBits(event_group, WIFI_CONNECTED_BIT);
+  }
+}
+
+void WifiManager::connect(int64_t now) {
+  if(state != WIFI_STATE_CONNECTING) {
+    connect_start = now;
+  }
+
+  portENTER_CRITICAL(&stats_lock);
+  stats.attempts++;
+  portEXIT_CRITICAL(&stats_lock);
+
+  // Association and the WPA handshake are the only CPU heavy part of Wi-Fi
+  connect_lock.acquire();
+  state = WIFI_STATE_CONNECTING;
+  if(esp_wifi_connect() != ESP_OK) {
+    schedule_retry(now);
+  }
+}
+
+void WifiManager::schedule_retry(int64_t now) {
+  // Exponential backoff with equal jitter: half the window is fixed so the
+  // delay keeps growing, the other half is random so a room full of clocks
+  // doesn't hammer the AP in lockstep when it comes back
+  uint32_t shift = failures < 16 ? failures : 16;
+  uint32_t window = WIFI_BACKOFF_BASE_MS << shift;
+  if(window > WIFI_BACKOFF_MAX_MS || window < WIFI_BACKOFF_BASE_MS) {
+    window = WIFI_BACKOFF_MAX_MS;
+  }
+  uint32_t delay_ms = window / 2 + esp_random() % (window / 2 + 1);
+
+  connect_lock.release();
+  failures++;
+  retry_at = now + (int64_t)delay_ms * 1000;
+  state = WIFI_STATE_BACKOFF;
+
+  portENTER_CRITICAL(&stats_lock);
+  stats.backoff_ms = delay_ms;
+  portEXIT_CRITICAL(&stats_lock);
+
+  ESP_LOGI("WiFi", "Retrying connection in %u ms", delay_ms);
+}
+
+void WifiManager::sample_rssi(int64_t now) {
+  next_rssi = now + (int64_t)WIFI_RSSI_INTERVAL_MS * 1000;
+
+  wifi_ap_record_t ap_info;
+  if(esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+    return;
+  }
+
+  portENTER_CRITICAL(&stats_lock);
+  // Light smoothing; single beacons swing by several dB
+  stats.rssi = (int8_t)((stats.rssi * 3 + ap_info.rssi) / 4);
+  if(ap_info.rssi < stats.rssi_min) {
+    stats.rssi_min = ap_info.rssi;
+  }
+  if(ap_info.rssi > stats.rssi_max) {
+    stats.rssi_max = ap_info.rssi;
+  }
+  portEXIT_CRITICAL(&stats_lock);
+}
+
+TickType_t WifiManager::next_wakeup(int64_t now) {
+  int64_t deadline;
+  if(state == WIFI_STATE_BACKOFF) {
+    deadline = retry_at;
+  } else if(state == WIFI_STATE_CONNECTED) {
+    deadline = next_rssi;
+  } else {
+    deadline = INT64_MAX;
+  }
+
+  if(policy == WIFI_POLICY_SYNC_ONLY && radio_on && radio_refs == 0 && stop_at < deadline) {
+    deadline = stop_at;
+  }
+
+  if(deadline == INT64_MAX) {
+    return portMAX_DELAY;
+  }
+
+  if(deadline <= now) {
+    return 0;
+  }
+  return pdMS_TO_TICKS((deadline - now) / 1000) + 1;
+}
+
+
+void WifiManager::start_radio(int64_t now) {
+  if(radio_on) {
+    return;
+  }
+
+  // Every power up after the first goes straight back to the last AP too
+  if(radio_started != 0 && cache.has_ap()) {
+    use_cached_ap();
+    esp_wifi_set_config(WIFI_IF_STA, &config);
+  }
+
+  radio_on = true;
+  radio_started = now;
+  connect_start = now;
+  state = WIFI_STATE_IDLE;
+
+  portENTER_CRITICAL(&stats_lock);
+  stats.radio_sessions++;
+  portEXIT_CRITICAL(&stats_lock);
+
+  ESP_ERROR_CHECK(esp_wifi_start());
+}
+
+void WifiManager::stop_radio(int64_t now) {
+  ESP_LOGI("WiFi", "Stopping radio");
+  radio_on = false;
+
+  portENTER_CRITICAL(&stats_lock);
+  stats.radio_on_us += now - radio_started;
+  if(state == WIFI_STATE_CONNECTED) {
+    stats.connected_us += now - connected_at;
+  }
+  portEXIT_CRITICAL(&stats_lock);
+
+  state = WIFI_STATE_OFF;
+  connect_lock.release();
+  xEventGroupClearBits(event_group, WIFI_CONNECTED_BIT);
+  esp_wifi_stop();
+}
+
+
+void WifiManager::apply_cache() {
+  if(!cache.load()) {
+    return;
+  }
+
+  use_cached_ap();
+}
+
+void WifiManager::use_cached_ap() {
+  // Go straight to the last AP instead of scanning every channel
+  const WifiCache::entry_t& cached = cache.get();
+  config.sta.bssid_set = true;
+  memcpy(config.sta.bssid, cached.bssid, sizeof(cached.bssid));
+  config.sta.channel = cached.channel;
+  config.sta.scan_method = WIFI_FAST_SCAN;
+  fast_connect = true;
+  ESP_LOGI("WiFi", "Using cached AP " MACSTR " on channel %u", MAC2STR(cached.bssid), cached.channel);
+}
+
+void WifiManager::full_scan() {
+  ESP_LOGI("WiFi", "Cached AP unavailable, falling back to full scan");
+  fast_connect = false;
+  cache.clear();
+  restore_scan();
+}
+
+void WifiManager::restore_scan() {
+  config.sta.bssid_set = false;
+  config.sta.channel = 0;
+  config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+  esp_wifi_set_config(WIFI_IF_STA, &config);
+}
+
+void WifiManager::store_cache() {
+  WifiCache::entry_t entry = cache.get();
+
+  wifi_ap_record_t ap_info;
+  if(esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+    return;
+  }
+  memcpy(entry.bssid, ap_info.bssid, sizeof(entry.bssid));
+  entry.channel = ap_info.primary;
+
+  // Only a move to another AP reaches flash
+  cache.store(entry);
+}
@@ -0,0 +1,141 @@
+#ifndef WIFI_MANAGER_HPP
+#define WIFI_MANAGER_HPP
+
+#include <stdint.h>
+
+#include <esp_event.h>
+#include <esp_wifi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+
+#include "power-manager.hpp"
+#include "wifi-cache.hpp"
+
+#define WIFI_CONNECTED_BIT    BIT0
+
+#define WIFI_BACKOFF_BASE_MS  500
+#define WIFI_BACKOFF_MAX_MS   60000
+#define WIFI_RSSI_INTERVAL_MS 10000
+#define WIFI_EVENT_QUEUE_LEN  8
+#define WIFI_LISTEN_INTERVAL  10
+
+
+// Owns the station interface. Driver events are forwarded to a queue and
+// handled by a dedicated task, so reconnect pacing never runs in the event
+// loop and nobody has to block on the connection to make progress.
+// Connectivity is published through an event group that other subsystems
+// can wait on or poll.
+//
+// The connectivity policy decides how much the radio is used. In sync-only
+// mode the radio is stopped whenever nobody holds it through acquire(),
+// after a grace period that leaves room for HomeKit control.
+class WifiManager {
+public:
+  typedef enum {
+    WIFI_POLICY_ALWAYS_ON,
+    WIFI_POLICY_MODEM_SLEEP,
+    WIFI_POLICY_SYNC_ONLY
+  } policy_t;
+
+  typedef enum {
+    WIFI_STATE_OFF,
+    WIFI_STATE_IDLE,
+    WIFI_STATE_CONNECTING,
+    WIFI_STATE_CONNECTED,
+    WIFI_STATE_BACKOFF
+  } state_t;
+
+  typedef struct {
+    uint32_t attempts;
+    uint32_t connects;
+    uint32_t disconnects;
+    uint32_t fast_connects;
+    uint8_t last_reason;
+    int8_t rssi;
+    int8_t rssi_min;
+    int8_t rssi_max;
+    int64_t connect_ms;
+    int64_t connected_us;
+    uint32_t backoff_ms;
+    uint32_t radio_sessions;
+    int64_t radio_on_us;
+    int64_t uptime_us;
+  } stats_t;
+
+  WifiManager(const char* ssid, const char* pass);
+  ~WifiManager() {};
+
+  void set_policy(policy_t new_policy, uint32_t new_control_window_secs) { policy = new_policy; control_window_secs = new_control_window_secs; };
+  void start();
+
+  // Hold the radio on; only has an effect under the sync-only policy
+  void acquire();
+  void release();
+
+  bool is_connected() { return xEventGroupGetBits(event_group) & WIFI_CONNECTED_BIT; };
+  bool wait_connected(TickType_t timeout);
+  EventGroupHandle_t get_event_group() { return event_group; };
+  esp_netif_t* get_netif() { return netif; };
+  state_t get_state() { return state; };
+  policy_t get_policy() { return policy; };
+  stats_t get_stats();
+
+private:
+  typedef struct {
+    esp_event_base_t base;
+    int32_t id;
+    uint8_t reason;
+  } event_t;
+
+  const char* ssid;
+  const char* pass;
+
+  policy_t policy;
+  uint32_t control_window_secs;
+  uint32_t radio_refs;
+  bool radio_on;
+  int64_t radio_started;
+  int64_t stop_at;
+
+  esp_netif_t* netif;
+  wifi_config_t config;
+  WifiCache cache;
+  bool fast_connect;
+
+  PerfLock connect_lock;
+
+  EventGroupHandle_t event_group;
+  QueueHandle_t events;
+  TaskHandle_t task_handle;
+  portMUX_TYPE stats_lock;
+
+  volatile state_t state;
+  uint32_t failures;
+  int64_t retry_at;
+  int64_t connect_start;
+  int64_t connected_at;
+  int64_t next_rssi;
+  stats_t stats;
+
+  static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
+  static void task(void* ctx);
+
+  void handle_event(const event_t& event, int64_t now);
+  void connect(int64_t now);
+  void schedule_retry(int64_t now);
+  void sample_rssi(int64_t now);
+  TickType_t next_wakeup(int64_t now);
+
+  void start_radio(int64_t now);
+  void stop_radio(int64_t now);
+
+  void apply_cache();
+  void use_cached_ap();
+  void full_scan();
+  void restore_scan();
+  void store_cache();
+};
+
+#endif // WIFI_MANAGER_HPP
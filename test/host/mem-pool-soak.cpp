@@ -0,0 +1,218 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <esp_timer.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "app.hpp"
+#include "mem-pool.h"
+
+#define ROUNDS        3000
+#define ROUND_US      1000000
+#define SETTLE_US     200000
+#define BIG_BODY_LEN  8192
+#define KEEP_ALIVE    (APP_HTTP_SLOTS * 2)
+
+#define CHECK(cond) do { if(!(cond)) { fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failed = true; } } while(0)
+
+static bool failed = false;
+
+
+static uint32_t block_bytes() {
+  mem_pool_stats_t stats;
+  mem_pool_get_stats(&stats);
+  return stats.block_bytes;
+}
+
+// Clients are plain sockets, so only the server side goes through the pool
+// as it would on the clock
+static int open_client(uint16_t port) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(sock < 0 || connect(sock, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
+    perror("connect");
+    return -1;
+  }
+  fcntl(sock, F_SETFL, O_NONBLOCK);
+  return sock;
+}
+
+// One request on an open connection, which stays open. Returns the status
+// and the body length once the whole response is in, -1 if it never is.
+static int request(struct mg_mgr* mgr, int sock, const char* path, size_t& body_len) {
+  if(sock < 0) {
+    return -1;
+  }
+
+  char req[128];
+  int req_len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: clock\r\n\r\n", path);
+  send(sock, req, req_len, 0);
+
+  static char resp[BIG_BODY_LEN * 2];
+  size_t len = 0;
+  int status = -1;
+  int64_t deadline = esp_timer_get_time() + ROUND_US;
+  while(status < 0 && esp_timer_get_time() < deadline) {
+    mg_mgr_poll(mgr, 1);
+    ssize_t n = recv(sock, resp + len, sizeof(resp) - len - 1, 0);
+    if(n <= 0) {
+      continue;
+    }
+    len += n;
+    resp[len] = 0;
+
+    const char* body = strstr(resp, "\r\n\r\n");
+    if(body == NULL) {
+      continue;
+    }
+    body += 4;
+    const char* content_length = strstr(resp, "Content-Length: ");
+    if(content_length != NULL && content_length < body) {
+      size_t expected = strtoul(content_length + 16, NULL, 10);
+      if((size_t)(resp + len - body) >= expected) {
+        body_len = expected;
+        status = atoi(resp + 9);
+      }
+    } else if(len >= 5 && strcmp(resp + len - 5, "0\r\n\r\n") == 0) {
+      // Chunk framing included; close enough to tell a full body
+      body_len = resp + len - body;
+      status = atoi(resp + 9);
+    }
+  }
+  return status;
+}
+
+// Whether the server has closed its end, polling until it does or the
+// deadline passes
+static bool closed_by_server(struct mg_mgr* mgr, int sock, int64_t deadline) {
+  do {
+    mg_mgr_poll(mgr, 10);
+    char c;
+    if(recv(sock, &c, 1, 0) == 0) {
+      return true;
+    }
+  } while(esp_timer_get_time() < deadline);
+  return false;
+}
+
+
+// Serves a few thousand requests through App with mongoose allocating from
+// the pool, each on its own connection: a JSON route, a chunked body much
+// bigger than a slot and a 404. Every round has to hand back exactly what
+// it took, nothing may spill to the heap, and once the manager is freed
+// every block is back. Then twice as many keep-alive clients as there are
+// slots all have to be served, and closed once they go idle.
+int main() {
+  App* app = new App();
+  app->init();
+  if(!app->listen_http("127.0.0.1:0")) {
+    return 1;
+  }
+  struct mg_mgr* mgr = app->get_mgr();
+
+  uint16_t port = 0;
+  for(struct mg_connection* c = mg_next(mgr, NULL); c != NULL; c = mg_next(mgr, c)) {
+    char addr[32];
+    if((c->flags & MG_F_LISTENING) && !(c->flags & MG_F_UDP)) {
+      mg_conn_addr_to_str(c, addr, sizeof(addr), MG_SOCK_STRINGIFY_PORT);
+      port = (uint16_t)atoi(addr);
+    }
+  }
+
+  app->add_json_route("/status", [](struct http_message* hm, char* buf, size_t size, size_t& len){
+    len = mem_pool_render_json(buf, size);
+    return 200;
+  });
+  app->add_route("/big", [app](struct mg_connection* nc, struct http_message* hm){
+    static const char head[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nTransfer-Encoding: chunked\r\n\r\n";
+    size_t left = BIG_BODY_LEN;
+    app->send_chunked(nc, head, sizeof(head) - 1, [left](char* buf, size_t len) mutable {
+      size_t n = left < len ? left : len;
+      memset(buf, 'x', n);
+      left -= n;
+      return n;
+    });
+  });
+
+  mg_mgr_poll(mgr, 1);
+  uint32_t baseline = block_bytes();
+
+  static const char* paths[] = {"/status", "/big", "/missing"};
+  static const int statuses[] = {200, 200, 404};
+  uint32_t errors = 0;
+  uint32_t leaks = 0;
+  for(int i = 0; i < ROUNDS; i++) {
+    size_t body_len = 0;
+    int sock = open_client(port);
+    int status = request(mgr, sock, paths[i % 3], body_len);
+    close(sock);
+    if(status != statuses[i % 3] || (i % 3 == 1 && body_len < BIG_BODY_LEN)) {
+      errors++;
+    }
+
+    // The server only sees the close on its next poll or two
+    int64_t deadline = esp_timer_get_time() + SETTLE_US;
+    while(block_bytes() != baseline && esp_timer_get_time() < deadline) {
+      mg_mgr_poll(mgr, 1);
+    }
+    if(block_bytes() != baseline) {
+      leaks++;
+    }
+  }
+
+  int clients[KEEP_ALIVE];
+  uint32_t refused = 0;
+  for(int i = 0; i < KEEP_ALIVE; i++) {
+    size_t body_len = 0;
+    clients[i] = open_client(port);
+    if(request(mgr, clients[i], "/status", body_len) != 200) {
+      refused++;
+    }
+  }
+  // A second round on the same connections, still all open
+  for(int i = 0; i < KEEP_ALIVE; i++) {
+    size_t body_len = 0;
+    if(request(mgr, clients[i], "/status", body_len) != 200) {
+      refused++;
+    }
+  }
+  uint32_t lingering = 0;
+  int64_t idle_deadline = esp_timer_get_time() + (APP_HTTP_IDLE_SECS + 2) * 1000000LL;
+  for(int i = 0; i < KEEP_ALIVE; i++) {
+    if(!closed_by_server(mgr, clients[i], idle_deadline)) {
+      lingering++;
+    }
+    close(clients[i]);
+  }
+
+  mem_pool_stats_t stats;
+  mem_pool_get_stats(&stats);
+  CHECK(errors == 0);
+  CHECK(refused == 0);
+  CHECK(lingering == 0);
+  CHECK(leaks == 0);
+  CHECK(stats.heap_fallbacks == 0);
+
+  mg_mgr_free(mgr);
+  mem_pool_get_stats(&stats);
+  for(int c = 0; c < MEM_POOL_CLASSES; c++) {
+    CHECK(stats.classes[c].in_use == 0);
+  }
+  CHECK(stats.block_bytes == 0);
+  CHECK(stats.heap_live == 0);
+
+  printf("mem-pool-soak: %d rounds, %u bad responses, %u leaky rounds, %u block bytes at rest, %u high water, %u heap fallbacks\n",
+    ROUNDS, errors, leaks, baseline, stats.block_bytes_high_water, stats.heap_fallbacks);
+  printf("mem-pool-soak: %d keep-alive clients, %u refused, %u left open after %d idle seconds\n",
+    KEEP_ALIVE, refused, lingering, APP_HTTP_IDLE_SECS);
+  printf("%s\n", failed ? "mem-pool-soak: FAILED" : "mem-pool-soak: ok");
+  return failed ? 1 : 0;
+}
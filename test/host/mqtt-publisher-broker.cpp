@@ -0,0 +1,146 @@
+#include <esp_timer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mongoose.h"
+#include "mqtt-publisher.hpp"
+
+#define SECONDS       30
+#define FLOOD_AT      15
+#define FLOOD_EVENTS  40
+#define CONNECT_US    5000000
+#define DRAIN_US      200000
+
+#define CHECK(cond) do { if(!(cond)) { fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failed = true; } } while(0)
+
+typedef struct {
+  uint32_t batches;
+  uint32_t full;
+  uint32_t steady;
+  uint32_t flooded;
+  uint32_t flood_lost;
+  size_t max_len;
+  bool unterminated;
+} received_t;
+
+
+// The publisher only reads the connected bit; the radio never starts
+WifiManager::WifiManager(const char* _ssid, const char* _pass) :
+  ssid(_ssid), pass(_pass), connect_lock("wifi_connect"), event_group(xEventGroupCreate()) {
+  xEventGroupSetBits(event_group, WIFI_CONNECTED_BIT);
+}
+
+static void broker_handler(struct mg_connection* nc, int ev, void* ev_data) {
+  received_t* received = (received_t*)nc->user_data;
+  struct mg_mqtt_message* msg = (struct mg_mqtt_message*)ev_data;
+
+  if(ev == MG_EV_MQTT_PUBLISH && mg_vcmp(&msg->topic, "neon/clock-1/telemetry") == 0) {
+    char payload[MQTT_PAYLOAD_LEN + 1];
+    size_t len = msg->payload.len < MQTT_PAYLOAD_LEN ? msg->payload.len : MQTT_PAYLOAD_LEN;
+    memcpy(payload, msg->payload.p, len);
+    payload[len] = 0;
+
+    received->batches++;
+    received->max_len = msg->payload.len > received->max_len ? msg->payload.len : received->max_len;
+    received->unterminated = received->unterminated || payload[len - 1] != '}';
+    if(strstr(payload, "\"full\":1") != NULL) {
+      received->full++;
+    }
+    if(strstr(payload, "\"steady\":") != NULL) {
+      received->steady++;
+    }
+    if(strstr(payload, "\"ev\":") != NULL) {
+      const char* lost = strstr(payload, "\"lost\":");
+      received->flooded++;
+      received->flood_lost = lost != NULL ? strtoul(lost + 7, NULL, 10) : 0;
+    }
+  }
+  mg_mqtt_broker(nc, ev, ev_data);
+}
+
+static void drain(struct mg_mgr* mgr, MqttPublisher& mqtt, received_t& received) {
+  int64_t until = esp_timer_get_time() + DRAIN_US;
+  while(received.batches < mqtt.get_published().get() && esp_timer_get_time() < until) {
+    mg_mgr_poll(mgr, 1);
+  }
+}
+
+
+// Runs the publisher against mongoose's own broker on loopback for half a
+// minute of virtual time: one batch per interval, everything in full every
+// MQTT_FULL_EVERY, quiet fields only then, and an event flood that has to
+// stay inside the payload cap and be reported as lost.
+int main() {
+  struct mg_mgr mgr;
+  mg_mgr_init(&mgr, NULL);
+
+  received_t received;
+  memset(&received, 0, sizeof(received));
+
+  struct mg_mqtt_broker broker;
+  mg_mqtt_broker_init(&broker, NULL);
+  struct mg_bind_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.user_data = &received;
+  struct mg_connection* listener = mg_bind_opt(&mgr, "127.0.0.1:0", broker_handler, opts);
+  if(listener == NULL) {
+    fprintf(stderr, "FAIL: no broker listener\n");
+    return 1;
+  }
+  listener->priv_2 = &broker;
+  mg_set_protocol_mqtt(listener);
+
+  static char address[32];
+  mg_conn_addr_to_str(listener, address, sizeof(address), MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_PORT);
+
+  WifiManager wifi("", "");
+  DnsCache dns;
+  DisplayState state;
+  dns.init(&mgr);
+
+  MqttPublisher mqtt(wifi, dns, state, address, "neon", 1);
+  double count = 0;
+  mqtt.add_field("count", 0.5, [&count](){ return count; });
+  mqtt.add_field("steady", 1, [](){ return 42.0; });
+  mqtt.init(&mgr, "clock-1");
+
+  int64_t deadline = esp_timer_get_time() + CONNECT_US;
+  while(!mqtt.is_connected() && esp_timer_get_time() < deadline) {
+    mqtt.poll(esp_timer_get_time());
+    mg_mgr_poll(&mgr, 10);
+  }
+
+  bool failed = false;
+  CHECK(mqtt.is_connected());
+
+  for(int i = 0; i <= SECONDS; i++) {
+    if(i == FLOOD_AT) {
+      for(int j = 0; j < FLOOD_EVENTS; j++) {
+        mqtt.add_event("a-rather-long-event-name-to-fill-the-payload", j);
+      }
+    }
+    mqtt.poll(esp_timer_get_time());
+    drain(&mgr, mqtt, received);
+    count++;
+    shim_advance_time(1000000);
+  }
+
+  uint32_t batches = SECONDS + 1;
+  uint32_t full = (batches + MQTT_FULL_EVERY - 1) / MQTT_FULL_EVERY;
+  CHECK(mqtt.get_published().get() == batches);
+  CHECK(mqtt.get_held().get() == 0);
+  CHECK(received.batches == batches);
+  CHECK(received.full == full);
+  CHECK(received.steady == full);
+  CHECK(received.max_len <= MQTT_PAYLOAD_LEN);
+  CHECK(!received.unterminated);
+  CHECK(received.flooded == 1);
+  CHECK(received.flood_lost >= FLOOD_EVENTS - MQTT_MAX_EVENTS);
+
+  mg_mgr_free(&mgr);
+  printf("mqtt-publisher-broker: %u batches, %u full, largest %u bytes, %u events lost in the flood\n",
+    received.batches, received.full, (unsigned int)received.max_len, received.flood_lost);
+  printf("%s\n", failed ? "mqtt-publisher-broker: FAILED" : "mqtt-publisher-broker: ok");
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,21 @@
+#ifndef ESP_ERR_H
+#define ESP_ERR_H
+
+typedef int esp_err_t;
+
+#define ESP_OK    0
+#define ESP_FAIL  -1
+
+#define ESP_ERR_NVS_NOT_FOUND  0x1102
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+const char* esp_err_to_name(esp_err_t code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ESP_ERR_H
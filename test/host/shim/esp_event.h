@@ -0,0 +1,10 @@
+#ifndef ESP_EVENT_H
+#define ESP_EVENT_H
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+typedef const char* esp_event_base_t;
+
+#endif // ESP_EVENT_H
@@ -0,0 +1,8 @@
+#ifndef ESP_PM_H
+#define ESP_PM_H
+
+#include "esp_err.h"
+
+typedef struct esp_pm_lock* esp_pm_lock_handle_t;
+
+#endif // ESP_PM_H
@@ -0,0 +1,22 @@
+#ifndef ESP_TIMER_H
+#define ESP_TIMER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Monotonic time plus whatever shim_advance_time() has added, so a test
+// can run minutes of intervals in a moment
+int64_t esp_timer_get_time(void);
+void shim_advance_time(int64_t us);
+// Shifts both esp_timer and gettimeofday, standing in for another device's
+// clocks; a test running several devices switches it around each one's work
+void shim_set_clock_offset(int64_t us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ESP_TIMER_H
@@ -0,0 +1,28 @@
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+typedef uint32_t EventBits_t;
+typedef struct shim_task* TaskHandle_t;
+typedef struct shim_queue* QueueHandle_t;
+typedef struct shim_event_group* EventGroupHandle_t;
+
+#define BIT0 0x01
+
+#define pdFAIL 0
+#define pdPASS 1
+
+// Tests drive everything from one thread
+typedef struct {
+  int unused;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portENTER_CRITICAL(mux) (void)(mux)
+#define portEXIT_CRITICAL(mux) (void)(mux)
+
+#endif // FREERTOS_H
@@ -0,0 +1,6 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include "FreeRTOS.h"
+
+#endif // QUEUE_H
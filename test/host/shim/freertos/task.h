@@ -0,0 +1,20 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include "FreeRTOS.h"
+
+typedef void (*TaskFunction_t)(void*);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Tests poll on their own thread; nothing is ever started
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char* name, uint32_t stack, void* arg,
+                                   uint32_t priority, TaskHandle_t* handle, BaseType_t core);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TASK_H
@@ -0,0 +1,89 @@
+#include <esp_err.h>
+#include <esp_timer.h>
+#include <freertos/event_groups.h>
+#include <freertos/task.h>
+#include <nvs.h>
+#include <sys/time.h>
+#include <time.h>
+
+struct shim_event_group {
+  EventBits_t bits;
+};
+
+static int64_t time_offset = 0;
+static int64_t clock_offset = 0;
+
+
+int64_t esp_timer_get_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + time_offset + clock_offset;
+}
+
+void shim_advance_time(int64_t us) {
+  time_offset += us;
+}
+
+void shim_set_clock_offset(int64_t us) {
+  clock_offset = us;
+}
+
+// Takes the place of libc's for everything linked into the test, so the
+// system time moves with the selected clock as well
+extern "C" int gettimeofday(struct timeval* tv, void* tz) noexcept {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  int64_t us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + clock_offset;
+  tv->tv_sec = us / 1000000;
+  tv->tv_usec = us % 1000000;
+  return 0;
+}
+
+const char* esp_err_to_name(esp_err_t code) {
+  return code == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char* name, uint32_t stack, void* arg,
+                                   uint32_t priority, TaskHandle_t* handle, BaseType_t core) {
+  return pdFAIL;
+}
+
+
+EventGroupHandle_t xEventGroupCreate(void) {
+  return new shim_event_group{0};
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits) {
+  return group->bits |= bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits) {
+  EventBits_t before = group->bits;
+  group->bits &= ~bits;
+  return before;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group) {
+  return group->bits;
+}
+
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t mode, nvs_handle_t* handle) {
+  return ESP_ERR_NVS_NOT_FOUND;
+}
+
+void nvs_close(nvs_handle_t handle) {
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* value, size_t* length) {
+  return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length) {
+  return ESP_FAIL;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+  return ESP_FAIL;
+}
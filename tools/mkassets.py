@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+"""Pack the web UI into an asset bundle for the assets partition.
+
+    tools/mkassets.py web/ assets.bin
+    parttool.py write_partition --partition-name assets --input assets.bin
+
+The build runs this and flashes the bundle with the app; the commands above
+update the UI alone. Every file is stored gzip compressed with a strong
+ETag over the stored bytes, so the clock serves it straight from flash
+without touching the content. The format is documented in
+main/asset-server.hpp.
+"""
+
+import argparse
+import gzip
+import hashlib
+import os
+import struct
+import sys
+
+MAGIC = 0x3142414E  # "NAB1"
+HEADER = "<IIII"
+ENTRY = "<64s32s24sII"
+PARTITION_SIZE = 128 * 1024
+
+TYPES = {
+    ".html": "text/html; charset=utf-8",
+    ".js": "application/javascript",
+    ".css": "text/css",
+    ".json": "application/json",
+    ".svg": "image/svg+xml",
+    ".png": "image/png",
+    ".ico": "image/x-icon",
+}
+
+
+def collect(root):
+    assets = []
+    for directory, _, files in os.walk(root):
+        for name in sorted(files):
+            path = os.path.join(directory, name)
+            uri = "/" + os.path.relpath(path, root).replace(os.sep, "/")
+            kind = TYPES.get(os.path.splitext(name)[1].lower())
+            if kind is None:
+                sys.exit("%s: unknown content type" % path)
+            if len(uri) >= 64:
+                sys.exit("%s: path too long" % path)
+            with open(path, "rb") as f:
+                assets.append((uri, kind, f.read()))
+    return sorted(assets)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("root", help="directory holding the UI")
+    parser.add_argument("bundle", help="bundle file to write")
+    parser.add_argument("--size", type=lambda s: int(s, 0), default=PARTITION_SIZE, help="partition size")
+    args = parser.parse_args()
+
+    assets = collect(args.root)
+    offset = struct.calcsize(HEADER) + struct.calcsize(ENTRY) * len(assets)
+    index = b""
+    data = b""
+    raw = 0
+
+    for uri, kind, content in assets:
+        # mtime 0 keeps the output, and so the ETag, stable across builds
+        stored = gzip.compress(content, compresslevel=9, mtime=0)
+        etag = '"%s"' % hashlib.sha256(stored).hexdigest()[:16]
+        pad = (-len(data)) % 4
+        data += b"\0" * pad
+        index += struct.pack(ENTRY, uri.encode(), kind.encode(), etag.encode(), offset + len(data), len(stored))
+        data += stored
+        raw += len(content)
+
+    bundle = struct.pack(HEADER, MAGIC, len(assets), offset + len(data), 0) + index + data
+    if len(bundle) > args.size:
+        sys.exit("bundle is %d bytes, partition holds %d" % (len(bundle), args.size))
+
+    with open(args.bundle, "wb") as f:
+        f.write(bundle)
+    print("%s: %d assets, %d bytes (%d uncompressed)" % (args.bundle, len(assets), len(bundle), raw))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+"""Make a delta OTA patch between two firmware images.
+
+    tools/mkdelta.py old.bin new.bin update.ndd
+    curl --data-binary @update.ndd http://<clock>/ota/delta
+
+The clock must be running exactly old.bin; the patch carries its SHA-256
+and is refused otherwise. The format is documented in main/delta-patch.hpp.
+
+Matching works like bsdiff: a short exact match seeds a region, which is
+then extended through bytes that differ as long as most still agree. The
+region is sent as per-byte differences from the old image, which are
+almost all zero when code has only moved and pointers shifted, and the
+whole op stream is zlib compressed.
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+import zlib
+
+MAGIC = 0x3144444E  # "NDD1"
+VERSION = 1
+
+OP_END = 0x00
+OP_COPY = 0x01
+OP_ADD = 0x02
+OP_INSERT = 0x03
+
+SEED = 16          # bytes that must match exactly to start a region
+INDEX_STEP = 4     # index every Nth offset of the old image
+GIVE_UP = 64       # stop extending this far past the best score
+
+
+def build_index(old):
+    index = {}
+    for offset in range(0, len(old) - SEED + 1, INDEX_STEP):
+        index.setdefault(old[offset:offset + SEED], offset)
+    return index
+
+
+def find_seed(old, new, pos, index, hint):
+    """Old offset matching new[pos:pos + SEED], preferring the hint."""
+    key = new[pos:pos + SEED]
+    if len(key) < SEED:
+        return None
+    if 0 <= hint <= len(old) - SEED and old[hint:hint + SEED] == key:
+        return hint
+    # The index only holds every INDEX_STEP-th offset, so also look a few
+    # bytes back in the new image for an indexed alignment
+    for back in range(INDEX_STEP):
+        if pos - back < 0:
+            break
+        src = index.get(new[pos - back:pos - back + SEED])
+        if src is not None and src + back <= len(old) - SEED and old[src + back:src + back + SEED] == key:
+            return src + back
+    return None
+
+
+def extend(old, new, src, dst):
+    """Length of the region starting at src/dst, scored 2 * matches - length."""
+    best_len = 0
+    best_score = 0
+    score = 0
+    length = 0
+    limit = min(len(old) - src, len(new) - dst)
+    while length < limit:
+        score += 1 if old[src + length] == new[dst + length] else -1
+        length += 1
+        if score > best_score:
+            best_score = score
+            best_len = length
+        elif length - best_len > GIVE_UP:
+            break
+    return best_len
+
+
+def diff(old, new):
+    index = build_index(old)
+    ops = bytearray()
+    literal = bytearray()
+    pos = 0
+    hint = 0
+
+    def flush_literal():
+        if literal:
+            ops.extend(struct.pack("<BI", OP_INSERT, len(literal)))
+            ops.extend(literal)
+            literal.clear()
+
+    while pos < len(new):
+        src = find_seed(old, new, pos, index, hint)
+        if src is None:
+            literal.append(new[pos])
+            pos += 1
+            hint += 1
+            continue
+
+        length = extend(old, new, src, pos)
+        flush_literal()
+        region_old = old[src:src + length]
+        region_new = new[pos:pos + length]
+        if region_old == region_new:
+            ops.extend(struct.pack("<BII", OP_COPY, src, length))
+        else:
+            ops.extend(struct.pack("<BII", OP_ADD, src, length))
+            ops.extend((b - a) & 0xFF for a, b in zip(region_old, region_new))
+        pos += length
+        hint = src + length
+
+    flush_literal()
+    ops.append(OP_END)
+    return bytes(ops)
+
+
+def apply(old, patch):
+    """Reference applier, used to check every patch before it is written."""
+    magic, version, base_size, target_size = struct.unpack_from("<IB3xII", patch)
+    base_hash = patch[16:48]
+    target_hash = patch[48:80]
+    if magic != MAGIC or version != VERSION or hashlib.sha256(old[:base_size]).digest() != base_hash:
+        raise ValueError("patch does not match base")
+
+    ops = zlib.decompress(patch[80:])
+    out = bytearray()
+    i = 0
+    while True:
+        op = ops[i]
+        if op == OP_END:
+            break
+        if op == OP_COPY:
+            src, length = struct.unpack_from("<II", ops, i + 1)
+            out.extend(old[src:src + length])
+            i += 9
+        elif op == OP_ADD:
+            src, length = struct.unpack_from("<II", ops, i + 1)
+            deltas = ops[i + 9:i + 9 + length]
+            out.extend((a + d) & 0xFF for a, d in zip(old[src:src + length], deltas))
+            i += 9 + length
+        elif op == OP_INSERT:
+            (length,) = struct.unpack_from("<I", ops, i + 1)
+            out.extend(ops[i + 5:i + 5 + length])
+            i += 5 + length
+        else:
+            raise ValueError("unknown op %d" % op)
+
+    if len(out) != target_size or hashlib.sha256(out).digest() != target_hash:
+        raise ValueError("patch does not reproduce target")
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("old", help="image the clock is running")
+    parser.add_argument("new", help="image to update to")
+    parser.add_argument("patch", help="patch file to write")
+    args = parser.parse_args()
+
+    with open(args.old, "rb") as f:
+        old = f.read()
+    with open(args.new, "rb") as f:
+        new = f.read()
+
+    header = struct.pack("<IB3xII", MAGIC, VERSION, len(old), len(new))
+    header += hashlib.sha256(old).digest() + hashlib.sha256(new).digest()
+    patch = header + zlib.compress(diff(old, new), 9)
+
+    if apply(old, patch) != new:
+        sys.exit("patch failed to verify")
+
+    with open(args.patch, "wb") as f:
+        f.write(patch)
+    print("%s: %d bytes for a %d byte image (%.1f%%)" % (args.patch, len(patch), len(new), 100.0 * len(patch) / len(new)))
+
+
+if __name__ == "__main__":
+    main()
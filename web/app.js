@@ -0,0 +1,53 @@
+"use strict";
+
+const $ = (id) => document.getElementById(id);
+
+function control(name, value) {
+  return fetch("/api/control", {
+    method: "POST",
+    headers: { "Content-Type": "application/x-www-form-urlencoded" },
+    body: encodeURIComponent(name) + "=" + encodeURIComponent(value),
+  });
+}
+
+function row(list, name, value) {
+  const dt = document.createElement("dt");
+  const dd = document.createElement("dd");
+  dt.textContent = name;
+  dd.textContent = value;
+  list.append(dt, dd);
+}
+
+async function refresh() {
+  try {
+    const status = await (await fetch("/api/status")).json();
+    $("digits").textContent = status.display.digits;
+    $("hv").checked = status.display.hv;
+    if (document.activeElement !== $("brightness")) {
+      $("brightness").value = status.display.brightness;
+    }
+    $("mode").value = status.display.mode === "stopwatch" ? "stopwatch" : "clock";
+
+    const list = $("status");
+    list.replaceChildren();
+    row(list, "NTP", status.ntp.synced ? `offset ${status.ntp.offset_us} us, jitter ${status.ntp.jitter_us} us` : "not synced");
+    row(list, "Peers", status.peer.leader ? "leading" : `following ${status.peer.leader_id}${status.peer.locked ? "" : " (unlocked)"}`);
+    row(list, "Wi-Fi", status.wifi.connected ? `${status.wifi.rssi} dBm` : "disconnected");
+    row(list, "Uptime", `${Math.floor(status.uptime / 3600)} h ${Math.floor(status.uptime / 60) % 60} m`);
+  } catch (err) {
+    $("digits").textContent = "------";
+  }
+}
+
+$("hv").addEventListener("change", (e) => control("hv", e.target.checked ? 1 : 0));
+$("brightness").addEventListener("change", (e) => control("brightness", e.target.value));
+$("mode").addEventListener("change", (e) => control("mode", e.target.value));
+$("effect").addEventListener("change", (e) => {
+  if (e.target.value) {
+    control("effect", e.target.value);
+    e.target.value = "";
+  }
+});
+
+refresh();
+setInterval(refresh, 2000);